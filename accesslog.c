@@ -0,0 +1,178 @@
+#include "accesslog.h"
+#include "mem.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * The access log file is mapped whole, so adding a record is a copy
+ * into memory and the kernel writes it out when it likes. A file holds
+ * a fixed number of records; when it is full it is renamed to
+ * <name>.0, the older ones are shifted along, keeping ACCESSLOG_KEEP of
+ * them, and a new one is started. The record count in the header is bumped
+ * after each record, so a reader never sees half of one.
+ */
+
+#define ACCESSLOG_RECORDS	65536	/* Per file */
+#define ACCESSLOG_KEEP		4	/* Rotated files kept */
+
+struct accesslog
+{
+	char *name;
+	struct accesslog_header *hdr;	/* Start of the mapping */
+	struct access_record *rec;
+	size_t size;			/* Of the mapping */
+};
+
+static int  _map(struct accesslog *);
+static void _unmap(struct accesslog *);
+static void _rotate(struct accesslog *);
+
+/*
+ * Opens the access log in file, carrying on with the records there.
+ * Returns NULL, having logged why, if it cannot be mapped.
+ */
+struct accesslog *
+accesslog_open(const char *file)
+{
+	struct accesslog *self;
+
+	if ((self = mem_calloc(MEM_LOG, 1, sizeof(struct accesslog))) == NULL ||
+	    (self->name = mem_strdup(MEM_LOG, file)) == NULL)
+		err(1, "accesslog_open");
+
+	if (_map(self) == -1) {
+		_rotate(self);
+		if (_map(self) == -1) {
+			accesslog_close(self);
+			return NULL;
+		}
+	}
+
+	return self;
+}
+
+void
+accesslog_close(struct accesslog *self)
+{
+	if (self == NULL)
+		return;
+
+	_unmap(self);
+	mem_free(self->name);
+	mem_free(self);
+}
+
+void
+accesslog_add(struct accesslog *self, const struct access_record *rec)
+{
+	if (self->hdr == NULL)
+		return;
+
+	if (self->hdr->count == self->hdr->capacity) {
+		_unmap(self);
+		_rotate(self);
+		if (_map(self) == -1)
+			return;
+	}
+
+	memcpy(&self->rec[self->hdr->count], rec, sizeof(*rec));
+	self->hdr->count++;
+}
+
+/*
+ * Maps the file, creating it if needed. Returns -1 if it cannot, or if
+ * what is there is not an access log of this version with room left.
+ */
+static int
+_map(struct accesslog *self)
+{
+	struct accesslog_header *hdr;
+	struct stat sb;
+	size_t size;
+	int fd;
+
+	size = sizeof(struct accesslog_header) +
+	    ACCESSLOG_RECORDS * sizeof(struct access_record);
+
+	if ((fd = open(self->name, O_RDWR | O_CREAT, 0644)) == -1) {
+		syslog(LOG_ERR, "accesslog: %s: %m", self->name);
+		return -1;
+	}
+	if (fstat(fd, &sb) == -1 || (sb.st_size != 0 &&
+	    (size_t) sb.st_size != size) ||
+	    (sb.st_size == 0 && ftruncate(fd, size) == -1)) {
+		syslog(LOG_ERR, "accesslog: %s: unusable file", self->name);
+		close(fd);
+		return -1;
+	}
+	hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		syslog(LOG_ERR, "accesslog: mmap %s: %m", self->name);
+		return -1;
+	}
+
+	if (sb.st_size == 0) {
+		memcpy(hdr->magic, ACCESSLOG_MAGIC, sizeof(hdr->magic));
+		hdr->version = ACCESSLOG_VERSION;
+		hdr->record_size = sizeof(struct access_record);
+		hdr->capacity = ACCESSLOG_RECORDS;
+		hdr->count = 0;
+	} else if (memcmp(hdr->magic, ACCESSLOG_MAGIC,
+	    sizeof(hdr->magic)) != 0 || hdr->version != ACCESSLOG_VERSION ||
+	    hdr->record_size != sizeof(struct access_record) ||
+	    hdr->capacity != ACCESSLOG_RECORDS ||
+	    hdr->count > hdr->capacity) {
+		syslog(LOG_WARNING, "accesslog: %s: unknown format",
+		    self->name);
+		munmap(hdr, size);
+		return -1;
+	}
+
+	self->hdr = hdr;
+	self->rec = (struct access_record *) (hdr + 1);
+	self->size = size;
+	return 0;
+}
+
+static void
+_unmap(struct accesslog *self)
+{
+	if (self->hdr == NULL)
+		return;
+
+	munmap(self->hdr, self->size);
+	self->hdr = NULL;
+	self->rec = NULL;
+}
+
+/*
+ * Moves the file out of the way as <name>.0, after shifting the files
+ * before it along.
+ */
+static void
+_rotate(struct accesslog *self)
+{
+	char from[1024], to[1024];
+	int i;
+
+	for (i = ACCESSLOG_KEEP - 1; i > 0; i--) {
+		snprintf(from, sizeof(from), "%s.%d", self->name, i - 1);
+		snprintf(to, sizeof(to), "%s.%d", self->name, i);
+		if (rename(from, to) == -1 && errno != ENOENT)
+			syslog(LOG_ERR, "accesslog: rename %s: %m", from);
+	}
+
+	snprintf(to, sizeof(to), "%s.0", self->name);
+	if (rename(self->name, to) == -1 && errno != ENOENT)
+		syslog(LOG_ERR, "accesslog: rename %s: %m", self->name);
+}
@@ -0,0 +1,55 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <stdint.h>
+
+/*
+ * One record per proxied connection, written when it closes. The file
+ * is a struct accesslog_header followed by up to capacity records, of
+ * which count are written, in the byte order of the writer.
+ */
+
+#define ACCESSLOG_MAGIC		"webgwacc"
+#define ACCESSLOG_VERSION	1
+
+#define ACCESS_RESOLVED		0x01	/* dns_usec is set */
+#define ACCESS_CONNECTED	0x02	/* connect_usec is set */
+#define ACCESS_FIRSTBYTE	0x04	/* firstbyte_usec is set */
+#define ACCESS_TRUNCATED	0x08	/* host was cut short */
+
+struct accesslog_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t capacity;
+	uint64_t count;
+	char reserved[96];
+};
+
+struct access_record
+{
+	uint64_t time_usec;	/* Of closing, since the epoch */
+	uint64_t lifetime_usec;
+	uint64_t bytes_from_client;
+	uint64_t bytes_from_target;
+	uint32_t parse_usec;	/* Accept to request headers */
+	uint32_t dns_usec;
+	uint32_t connect_usec;
+	uint32_t firstbyte_usec; /* Connected to first byte from target */
+	uint16_t port;
+	uint8_t state;		/* enum conn_state when closed */
+	uint8_t flags;
+	char method[8];
+	char rid[8];		/* Not NUL terminated */
+	char host[60];
+};
+
+struct accesslog;
+
+struct accesslog *accesslog_open  (const char *);
+void              accesslog_close (struct accesslog *);
+void              accesslog_add   (struct accesslog *,
+                                   const struct access_record *);
+
+#endif
@@ -0,0 +1,293 @@
+/*
+ * Summarizes webgw access logs: totals, the state connections closed
+ * in, latency percentiles and the busiest hosts.
+ *
+ * Usage: accesstat [-n top] file ...
+ */
+
+#include "extern.h"
+#include "accesslog.h"
+#include "hist.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <err.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+enum latency
+{
+	LAT_LIFETIME,
+	LAT_PARSE,
+	LAT_DNS,
+	LAT_CONNECT,
+	LAT_FIRSTBYTE,
+	NLATENCIES
+};
+
+static const char *latency_names[NLATENCIES] = {
+	"lifetime", "parse", "dns", "connect", "firstbyte"
+};
+
+static const char *state_names[NCONNSTATES] = {
+	[CONN_READING]		= "reading",
+	[CONN_PARKED]		= "parked",
+	[CONN_RESOLVING]	= "resolving",
+	[CONN_CONNECTING]	= "connecting",
+	[CONN_TUNNELLING]	= "tunnelling",
+	[CONN_ADMIN]		= "admin",
+};
+
+struct hoststat
+{
+	char host[sizeof(((struct access_record *) 0)->host)];
+	int port;
+	unsigned long long count;
+	unsigned long long bytes;
+};
+
+static struct
+{
+	unsigned long long records;
+	uint64_t first, last;		/* time_usec */
+	unsigned long long bytes_from_client;
+	unsigned long long bytes_from_target;
+	unsigned long long states[NCONNSTATES];
+	struct hist latency[NLATENCIES];
+
+	struct hoststat *hosts;		/* One per record until merged */
+	size_t nhosts;
+	size_t maxhosts;
+} stats;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: accesstat [-n top] file ...\n");
+	exit(1);
+}
+
+static void
+add_record(const struct access_record *rec)
+{
+	struct hoststat *hs;
+
+	if (stats.records == 0 || rec->time_usec < stats.first)
+		stats.first = rec->time_usec;
+	if (rec->time_usec > stats.last)
+		stats.last = rec->time_usec;
+	stats.records++;
+	stats.bytes_from_client += rec->bytes_from_client;
+	stats.bytes_from_target += rec->bytes_from_target;
+	if (rec->state < NCONNSTATES)
+		stats.states[rec->state]++;
+
+	hist_record(&stats.latency[LAT_LIFETIME], rec->lifetime_usec);
+	if (rec->method[0] != '\0')
+		hist_record(&stats.latency[LAT_PARSE], rec->parse_usec);
+	if (rec->flags & ACCESS_RESOLVED)
+		hist_record(&stats.latency[LAT_DNS], rec->dns_usec);
+	if (rec->flags & ACCESS_CONNECTED)
+		hist_record(&stats.latency[LAT_CONNECT], rec->connect_usec);
+	if (rec->flags & ACCESS_FIRSTBYTE)
+		hist_record(&stats.latency[LAT_FIRSTBYTE],
+		    rec->firstbyte_usec);
+
+	if (rec->host[0] == '\0')
+		return;
+	if (stats.nhosts == stats.maxhosts) {
+		stats.maxhosts = stats.maxhosts ? stats.maxhosts * 2 : 1024;
+		if ((stats.hosts = reallocarray(stats.hosts, stats.maxhosts,
+		    sizeof(struct hoststat))) == NULL)
+			err(1, NULL);
+	}
+	hs = &stats.hosts[stats.nhosts++];
+	memcpy(hs->host, rec->host, sizeof(hs->host));
+	hs->host[sizeof(hs->host) - 1] = '\0';
+	hs->port = rec->port;
+	hs->count = 1;
+	hs->bytes = rec->bytes_from_client + rec->bytes_from_target;
+}
+
+static void
+read_file(const char *file)
+{
+	const struct accesslog_header *hdr;
+	const struct access_record *rec;
+	struct stat sb;
+	uint64_t i;
+	int fd;
+
+	if ((fd = open(file, O_RDONLY)) == -1)
+		err(1, "%s", file);
+	if (fstat(fd, &sb) == -1)
+		err(1, "%s", file);
+	if ((size_t) sb.st_size < sizeof(*hdr))
+		errx(1, "%s: short file", file);
+	hdr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED)
+		err(1, "mmap %s", file);
+
+	if (memcmp(hdr->magic, ACCESSLOG_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != ACCESSLOG_VERSION ||
+	    hdr->record_size != sizeof(struct access_record))
+		errx(1, "%s: unknown format", file);
+	if (hdr->count > ((size_t) sb.st_size - sizeof(*hdr)) /
+	    sizeof(struct access_record))
+		errx(1, "%s: truncated", file);
+
+	rec = (const struct access_record *) (hdr + 1);
+	for (i = 0; i < hdr->count; i++)
+		add_record(&rec[i]);
+
+	munmap((void *) hdr, sb.st_size);
+}
+
+static int
+host_cmp(const void *a, const void *b)
+{
+	const struct hoststat *x = a, *y = b;
+	int c;
+
+	if ((c = strcmp(x->host, y->host)) != 0)
+		return c;
+	return x->port - y->port;
+}
+
+static int
+count_cmp(const void *a, const void *b)
+{
+	const struct hoststat *x = a, *y = b;
+
+	if (x->count != y->count)
+		return x->count < y->count ? 1 : -1;
+	return host_cmp(a, b);
+}
+
+static int
+bytes_cmp(const void *a, const void *b)
+{
+	const struct hoststat *x = a, *y = b;
+
+	if (x->bytes != y->bytes)
+		return x->bytes < y->bytes ? 1 : -1;
+	return host_cmp(a, b);
+}
+
+/*
+ * Folds the per-record entries into one per host and port.
+ */
+static void
+merge_hosts(void)
+{
+	size_t i, n;
+
+	if (stats.nhosts == 0)
+		return;
+
+	qsort(stats.hosts, stats.nhosts, sizeof(struct hoststat), host_cmp);
+	for (i = 1, n = 0; i < stats.nhosts; i++) {
+		if (host_cmp(&stats.hosts[n], &stats.hosts[i]) == 0) {
+			stats.hosts[n].count += stats.hosts[i].count;
+			stats.hosts[n].bytes += stats.hosts[i].bytes;
+		} else
+			stats.hosts[++n] = stats.hosts[i];
+	}
+	stats.nhosts = n + 1;
+}
+
+static void
+print_time(const char *label, uint64_t usec)
+{
+	char buf[64];
+	time_t t;
+
+	t = usec / 1000000;
+	strftime(buf, sizeof(buf), "%Y-%m-%d %T", localtime(&t));
+	printf("%-14s %s\n", label, buf);
+}
+
+static void
+print_top(const char *title, size_t top)
+{
+	size_t i;
+
+	printf("\ntop hosts by %s\n", title);
+	printf("  %10s %12s  %s\n", "conns", "kB", "host");
+	for (i = 0; i < top && i < stats.nhosts; i++)
+		printf("  %10llu %12.1f  %s:%d\n", stats.hosts[i].count,
+		    stats.hosts[i].bytes / 1024.0, stats.hosts[i].host,
+		    stats.hosts[i].port);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const struct hist *h;
+	size_t top;
+	int ch, i;
+
+	top = 10;
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			if ((top = strtoul(optarg, NULL, 10)) == 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 0)
+		usage();
+
+	for (i = 0; i < argc; i++)
+		read_file(argv[i]);
+
+	printf("%-14s %llu\n", "connections", stats.records);
+	if (stats.records == 0)
+		return 0;
+	print_time("first closed", stats.first);
+	print_time("last closed", stats.last);
+	printf("%-14s %.1f kB\n", "from clients",
+	    stats.bytes_from_client / 1024.0);
+	printf("%-14s %.1f kB\n", "from targets",
+	    stats.bytes_from_target / 1024.0);
+
+	printf("\nclosed while\n");
+	for (i = 0; i < NCONNSTATES; i++)
+		if (stats.states[i] > 0)
+			printf("  %-12s %10llu\n", state_names[i],
+			    stats.states[i]);
+
+	printf("\n  %-12s %10s %10s %10s %10s %10s %10s\n", "ms", "count",
+	    "p50", "p90", "p99", "p999", "max");
+	for (i = 0; i < NLATENCIES; i++) {
+		h = &stats.latency[i];
+		printf("  %-12s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+		    latency_names[i], (unsigned long long) h->count,
+		    hist_percentile(h, 0.5) / 1000.0,
+		    hist_percentile(h, 0.9) / 1000.0,
+		    hist_percentile(h, 0.99) / 1000.0,
+		    hist_percentile(h, 0.999) / 1000.0,
+		    h->max / 1000.0);
+	}
+
+	merge_hosts();
+	qsort(stats.hosts, stats.nhosts, sizeof(struct hoststat), count_cmp);
+	print_top("connections", top);
+	qsort(stats.hosts, stats.nhosts, sizeof(struct hoststat), bytes_cmp);
+	print_top("traffic", top);
+
+	free(stats.hosts);
+	return 0;
+}
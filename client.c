@@ -1,6 +1,15 @@
 #include "extern.h"
 #include "client.h"
+#include "http.h"
 #include "host.h"
+#include "hostdb.h"
+#include "webclient.h"
+#include "dynstr.h"
+#include "log.h"
+#include "accesslog.h"
+#include "trace.h"
+#include "tcpinfo.h"
+#include "mem.h"
 
 #include <sys/types.h>
 #include <sys/event.h>
@@ -13,6 +22,7 @@
 #include <stdio.h>
 #include <err.h>
 #include <string.h>
+#include <stdint.h>
 #include <assert.h>
 
 void
@@ -39,7 +49,7 @@ write_fd(int fd, const char *buf, size_t n)
 
 	for (off = 0; off < n; off += nw)
 		if ((nw = write(fd, buf + off, n - off)) == 0 || nw == -1) {
-			syslog(LOG_ERR, "write: %s", strerror(errno));
+			log_msg(LOG_ERR, "write: %s", strerror(errno));
 			break;
 		}
 	if (off != n)
@@ -48,24 +58,60 @@ write_fd(int fd, const char *buf, size_t n)
 }
 
 const char *
-http_status(int code)
+phase_name(int phase)
 {
-	static const struct { int code; char *msg; } status[] = {
-		{ .code = 200, .msg = "Connection Established" },
-		{ .code = 400, .msg = "Bad Request" },
-		{ .code = 403, .msg = "Forbidden" },
-		{ .code = 500, .msg = "Internal Error" },
-		{ .code = 502, .msg = "Proxy Failed Connection" },
-		{ .code = 503, .msg = "Service Unavailable" },
+	static const char *name[NPHASES] = {
+		[PHASE_ACCEPT]		= "accept",
+		[PHASE_PARSE]		= "parse",
+		[PHASE_POLICY]		= "policy",
+		[PHASE_DNS]		= "dns",
+		[PHASE_CONNECT]		= "connect",
+		[PHASE_FIRSTBYTE]	= "firstbyte",
+		[PHASE_LIFETIME]	= "lifetime",
+		[PHASE_REQUEST_SIZE]	= "request_size",
 	};
-	int i;
 
-	for (i = 0; i < sizeof(status) / sizeof(status[0]); i++)
-		if (status[i].code == code)
-			return status[i].msg;
+	assert(phase >= 0 && phase < NPHASES);
+	return name[phase];
+}
+
+/*
+ * Moves the client to another enum conn_state, keeping the counts in
+ * ctx->nconn.
+ */
+void
+client_set_state(struct webgw *ctx, struct client *client, int state)
+{
+	ctx->nconn[client->state]--;
+	ctx->nconn[state]++;
+	client->state = state;
+}
+
+/*
+ * Samples the TCP state of the target connection into its host and the
+ * upstream totals: at connect for the handshake round trip, and when
+ * closing for the retransmits and delivery rate of the whole transfer.
+ */
+void
+client_sample_target(struct webgw *ctx, struct client *client, int closing)
+{
+	struct tcpinfo ti;
+
+	if (client->targetfd == -1 || client->target_host == NULL ||
+	    tcpinfo_get(client->targetfd, &ti) == -1)
+		return;
 
-	assert(0);
-	return "Unknown Error";
+	if (!closing) {
+		ti.retransmits = 0;
+		ti.delivery_rate = 0;
+	}
+	host_add_tcp_sample(client->target_host, ti.rtt_usec,
+	    ti.retransmits, ti.delivery_rate);
+	/* The first sample grows the host; removeclient() refiles it last */
+	if (!closing)
+		hostdb_refile(ctx->hostdb, client->target_host);
+	hist_record(&ctx->upstream_rtt, ti.rtt_usec);
+	ctx->upstream_retransmits += ti.retransmits;
 }
 
 void
@@ -73,49 +119,95 @@ write_error(int fd, int code, char *text)
 {
 	static char buf[4096];
 	int n;
-	char datebuf[80];
-	struct tm *tm;
-	time_t t;
-
-	t = time(0);
-	tm = gmtime(&t);
-	strftime(datebuf, sizeof(datebuf), "%a, %d %b %Y %T %Z", tm);
-
-	n = snprintf(buf, sizeof(buf),
-	    "HTTP/1.1 %d %s\r\n"
-	    "Server: webgw/1.0\r\n"
-	    "Date: %s\r\n"
-	    "Content-Type: text/plain;charset=us-ascii\r\n"
-	    "Content-Length: %lu\r\n"
-	    "Via: 1.1 spirit (webgw/1.0)\r\n"
-	    "Connection: close\r\n\r\n"
-	    "%s", code, http_status(code), datebuf, strlen(text), text);
+
+	if ((n = http_format_error(buf, sizeof(buf), code, text)) >=
+	    (int) sizeof(buf))
+		n = sizeof(buf) - 1;
 	if (write_fd(fd, buf, n) == -1)
-		syslog(LOG_ERR, "write_error: %m");
+		log_msg(LOG_ERR, "write_error: %s", strerror(errno));
 }
 
 void
 clientlog(struct client *client, int priority, const char *msg, ...)
 {
 	va_list ap;
-	static char str[1024];
+	char prefix[32];
+	const char *kind;
+
+	if (priority > log_level())
+		return;
 
-	va_start(ap, msg);
-	if (vsnprintf(str, sizeof(str), msg, ap) >= sizeof(str)) {
-		str[sizeof(str)-3] = '.';
-		str[sizeof(str)-2] = '.';
-		str[sizeof(str)-1] = '\0';
-	}
-	va_end(ap);
 	if (priority == LOG_ERR || priority == LOG_CRIT ||
 	    priority == LOG_ALERT || priority == LOG_EMERG)
-		syslog(priority, "[%s] err: %s", client->rid, str);
+		kind = "err: ";
 	else if (priority == LOG_WARNING)
-		syslog(priority, "[%s] warning: %s", client->rid, str);
+		kind = "warning: ";
 	else if (priority == LOG_DEBUG)
-		syslog(priority, "[%s] debug: %s", client->rid, str);
+		kind = "debug: ";
 	else
-		syslog(priority, "[%s] %s", client->rid, str);
+		kind = "";
+	snprintf(prefix, sizeof(prefix), "[%s] %s", client->rid, kind);
+
+	va_start(ap, msg);
+	log_vmsg(priority, prefix, msg, ap);
+	va_end(ap);
+}
+
+static uint32_t
+usec32(const struct timespec *from, const struct timespec *to)
+{
+	uint64_t usec;
+
+	usec = hist_usec(from, to);
+	return usec > UINT32_MAX ? UINT32_MAX : usec;
+}
+
+/*
+ * Adds the client, which is being removed, to the access log.
+ */
+static void
+client_access_record(struct webgw *ctx, struct client *client)
+{
+	struct access_record rec;
+	struct timespec now;
+	size_t len;
+
+	memset(&rec, 0, sizeof(rec));
+	clock_gettime(CLOCK_REALTIME, &now);
+	rec.time_usec = (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	rec.lifetime_usec = hist_usec(&client->ts_begin, &client->ts_end);
+	rec.bytes_from_client = client->bytes_from_client;
+	rec.bytes_from_target = client->bytes_from_target;
+	rec.state = client->state;
+	memcpy(rec.rid, client->rid, sizeof(rec.rid));
+
+	if (client->parser.state == HTTP_BODY) {
+		rec.parse_usec = usec32(&client->ts_begin,
+		    &client->ts_headers);
+		rec.port = client->parser.port;
+		strlcpy(rec.method, client->parser.method, sizeof(rec.method));
+		len = strlcpy(rec.host, client->parser.host, sizeof(rec.host));
+		if (len >= sizeof(rec.host))
+			rec.flags |= ACCESS_TRUNCATED;
+	}
+	if (client->ts_resolved.tv_sec != 0 ||
+	    client->ts_resolved.tv_nsec != 0) {
+		rec.dns_usec = usec32(&client->ts_resolve,
+		    &client->ts_resolved);
+		rec.flags |= ACCESS_RESOLVED;
+	}
+	if (client->targetconnected) {
+		rec.connect_usec = usec32(&client->ts_resolved,
+		    &client->ts_connect);
+		rec.flags |= ACCESS_CONNECTED;
+	}
+	if (client->bytes_from_target > 0) {
+		rec.firstbyte_usec = usec32(&client->ts_connect,
+		    &client->ts_firstbyte);
+		rec.flags |= ACCESS_FIRSTBYTE;
+	}
+
+	accesslog_add(ctx->accesslog, &rec);
 }
 
 void
@@ -123,8 +215,14 @@ removeclient(struct webgw *ctx, struct client *client)
 {
 	struct kevent changelist;
 
-	if (client->target_host != NULL)
+	if (client->targetconnected == 1)
+		client_sample_target(ctx, client, 1);
+	if (client->target_host != NULL) {
 		host_unref(client->target_host);
+		hostdb_refile(ctx->hostdb, client->target_host);
+	}
+	dynstr_free(client->body);
+	webclient_free_response(ctx, client);
 
 	EV_SET(&changelist, client->fd,
 	    EVFILT_TIMER, EV_DELETE | EV_DISABLE,
@@ -161,64 +259,77 @@ removeclient(struct webgw *ctx, struct client *client)
 	}
 
 	if (client->targetconnected == 1) {
-		time_t s;
-		double ms;
-		double comb;
-
-		s = client->ts_end.tv_sec - client->ts_begin.tv_sec;
-		ms = (client->ts_end.tv_nsec - client->ts_begin.tv_nsec) /
-		    1000.0 / 1000.0;
-		comb = s + (ms / 1000.0);
 		clientlog(client, LOG_INFO, "lifetime: %.3f s (%s)",
-		    comb, client->parser.host);
-
-		s = client->ts_connect.tv_sec - client->ts_begin.tv_sec;
-		ms = (client->ts_connect.tv_nsec - client->ts_begin.tv_nsec) /
-		    1000.0 / 1000.0;
-		comb = (s * 1000.0) + ms;
+		    hist_usec(&client->ts_begin, &client->ts_end) / 1e6,
+		    client->parser.host);
 		clientlog(client, LOG_INFO, "time to connect: %.1f ms (%s)",
-		    comb, client->parser.host);
-
-		if (client->bytes_from_target > 0) {
-			s = client->ts_firstbyte.tv_sec -
-			    client->ts_begin.tv_sec;
-			ms = (client->ts_firstbyte.tv_nsec -
-			    client->ts_begin.tv_nsec) /
-			    1000.0 / 1000.0;
-			comb = (s * 1000.0) + ms;
+		    hist_usec(&client->ts_begin, &client->ts_connect) / 1e3,
+		    client->parser.host);
+		if (client->bytes_from_target > 0)
 			clientlog(client, LOG_INFO,
 			    "time to firstbyte: %.1f ms (%s)",
-			    comb, client->parser.host);
-
-		}
+			    hist_usec(&client->ts_begin,
+			    &client->ts_firstbyte) / 1e3,
+			    client->parser.host);
 	}
 
-	if (client->request_size > 0) {
-		ctx->request_size_sum += client->request_size;
-		ctx->request_size_samples++;
-		if (client->request_size > ctx->request_size_max)
-			ctx->request_size_max = client->request_size;
+	if (client->type == CLIENT_PROXY) {
+		hist_record(&ctx->phase[PHASE_LIFETIME],
+		    hist_usec(&client->ts_begin, &client->ts_end));
+		if (ctx->accesslog != NULL)
+			client_access_record(ctx, client);
+		if (client->sampled)
+			trace_add(client);
 	}
+	if (client->request_size > 0)
+		hist_record(&ctx->phase[PHASE_REQUEST_SIZE],
+		    client->request_size);
 
-	free(client);
+	ctx->nconn[client->state]--;
+	mem_free(client);
 	ctx->nclient--;
 	ctx->refill_queue = 1;
-	syslog(LOG_INFO, "clients now: %d", ctx->nclient);
-
-	syslog(LOG_INFO,
-	    "server [%.2fms max, %.2fms avg] "
-	    "client [%.2fms max, %.2fms avg] "
-	    "target [%.2fms max, %.2fms avg] "
-	    "resolv+connect [%.2fms max, %.2fms avg] "
-	    "request_size [%dB max, %dB avg] ",
-	    ctx->server_max_usec / 1000.0, ctx->server_samples > 0 ?
-	        ctx->server_sum_usec / ctx->server_samples / 1000.0 : 0.0,
-	    ctx->client_max_usec / 1000.0, ctx->client_samples > 0 ?
-	        ctx->client_sum_usec / ctx->client_samples / 1000.0: 0.0,
-	    ctx->target_max_usec / 1000.0, ctx->target_samples > 0 ?
-	        ctx->target_sum_usec / ctx->target_samples / 1000.0: 0.0,
-	    ctx->resolv_max_usec / 1000.0, ctx->resolv_samples > 0 ?
-	        ctx->resolv_sum_usec / ctx->resolv_samples / 1000.0: 0.0,
-	    ctx->request_size_max, ctx->request_size_sum > 0 ?
-	        ctx->request_size_sum / ctx->request_size_samples: 0);
+	log_msg(LOG_INFO, "clients now: %d", ctx->nclient);
+}
+
+/*
+ * Logs one line with p50/p99/p999/max of every phase seen so far. It is
+ * called from the stats timer, and says nothing if INFO is filtered or
+ * nothing was recorded since the last line.
+ */
+void
+client_log_phases(struct webgw *ctx)
+{
+	static uint64_t logged;
+	const struct hist *h;
+	char stats[1024];
+	uint64_t count;
+	size_t len;
+	int i, n;
+
+	if (log_level() < LOG_INFO)
+		return;
+	for (i = 0, count = 0; i < NPHASES; i++)
+		count += ctx->phase[i].count;
+	if (count == logged)
+		return;
+	logged = count;
+
+	for (i = 0, len = 0; i < NPHASES && len < sizeof(stats); i++) {
+		h = &ctx->phase[i];
+		if (h->count == 0)
+			continue;
+		n = snprintf(stats + len, sizeof(stats) - len,
+		    "%s%s [%llu p50, %llu p99, %llu p999, %llu max]",
+		    len > 0 ? " " : "", phase_name(i),
+		    (unsigned long long) hist_percentile(h, 0.5),
+		    (unsigned long long) hist_percentile(h, 0.99),
+		    (unsigned long long) hist_percentile(h, 0.999),
+		    (unsigned long long) h->max);
+		if (n < 0)
+			break;
+		len += n;
+	}
+	if (len > 0)
+		log_msg(LOG_INFO, "%s", stats);
 }
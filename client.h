@@ -20,6 +20,9 @@ void removeclient(struct webgw *, struct client *);
 int write_fd(int, const char *, size_t);
 void write_error(int, int, char *);
 void mkrid(struct client *);
-const char *http_status(int);
+const char *phase_name(int);
+void client_log_phases(struct webgw *);
+void client_set_state(struct webgw *, struct client *, int);
+void client_sample_target(struct webgw *, struct client *, int);
 
 #endif
@@ -8,5 +8,30 @@
 #define QUEUE_DEPTH	256
 #define WRITE_BLOCK_SZ	8192
 #define READ_BLOCK_SZ	8192
+#define HOSTDB_FLUSH_MSEC	5000
+#define HOST_HOLD_SEC	30
+#define HOSTDB_MAX_MB	64
+#define RULES_MAX_BODY	(16 * 1024 * 1024)	/* 100k rules, urlencoded */
+#define ADMIN_PAGE_ROWS	100	/* Hosts per page of the admin listing */
+#define ADMIN_MAX_ROWS	1000
+#define ADMIN_SORT_MAX	10000	/* Hosts a sorted listing can reach */
+#define ADMIN_LIST_STEP	4096	/* Hosts visited per turn of the loop */
+#define ADMIN_LIST_CHUNK	16384	/* Bytes rendered per turn of the loop */
+#define ADMIN_CACHE_SLOTS	32	/* Rendered sections kept */
+#define ADMIN_MEM_SITES	20	/* Allocation sites shown at /memory */
+#define METRICS_SPARES	4	/* /metrics buffers kept for reuse */
+#define LOG_RING_SLOTS	1024	/* Messages queued for the log drainer */
+#define LOG_LINE_MAX	512
+#define LOG_DRAIN_MSEC	10	/* Drainer sleep when the ring is empty */
+#define ACCESSLOG_FILE	"access.log"
+#define TRACE_SAMPLES	256	/* Connection timelines kept for /trace */
+#define TRACE_RATE_PPM	10000	/* Connections traced, per million */
+#define LOOP_STALL_MSEC	50	/* Event batch that is logged as a stall */
+#define STATS_FILE	"webgw.stats"	/* Shared with webgw-top */
+#define STATS_PUBLISH_MSEC	1000
+#define PROF_HZ		99	/* Profiler samples per second of CPU */
+#define PROF_SAMPLES	8192	/* Kept from one start of the profiler */
+#define PROF_DEPTH	32	/* Frames kept of each stack */
+#define PROF_RENDER_STEP	64	/* Stacks named per turn of the loop */
 
 #endif
@@ -0,0 +1,148 @@
+#include "denyset.h"
+#include "mem.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <err.h>
+
+/*
+ * Bloom filter of denied (host, port) pairs. It answers "certainly
+ * not denied" for most requests without touching the hostdb; a "maybe"
+ * must still be confirmed against the host itself. There is no removal:
+ * the owner adds hosts as they are denied, and resets and refills the
+ * set now and then to drop those that no longer are.
+ *
+ * The filter has at least DENYSET_BITS_PER_ENTRY bits per expected
+ * entry and DENYSET_HASHES probes, at most about 0.1% false positives
+ * when full. The probes come from one 64-bit hash by double hashing.
+ */
+
+#define DENYSET_BITS_PER_ENTRY	16
+#define DENYSET_HASHES		6
+#define DENYSET_MIN_BITS	1024
+
+struct denyset
+{
+	uint64_t *bits;
+	size_t nbits;		/* Power of two */
+	size_t nentry;		/* Added since the last reset */
+	size_t maxentry;	/* What nbits is sized for */
+};
+
+static uint64_t _hash(const char *, int);
+
+struct denyset *
+denyset_create()
+{
+	struct denyset *self;
+
+	if ((self = mem_calloc(MEM_DENYSET, 1, sizeof(struct denyset))) == NULL)
+		err(1, "denyset_create");
+	denyset_reset(self, 0);
+
+	return self;
+}
+
+void
+denyset_free(struct denyset *self)
+{
+	if (self == NULL)
+		return;
+	mem_free(self->bits);
+	mem_free(self);
+}
+
+/*
+ * Empties the set and sizes it for n entries.
+ */
+void
+denyset_reset(struct denyset *self, size_t n)
+{
+	size_t nbits;
+
+	nbits = DENYSET_MIN_BITS;
+	while (nbits < n * DENYSET_BITS_PER_ENTRY)
+		nbits *= 2;
+
+	if (nbits != self->nbits) {
+		mem_free(self->bits);
+		if ((self->bits = mem_calloc(MEM_DENYSET, nbits / 64,
+		    sizeof(uint64_t))) == NULL)
+			err(1, "denyset_reset");
+		self->nbits = nbits;
+	} else
+		memset(self->bits, 0, nbits / 8);
+	self->nentry = 0;
+	self->maxentry = nbits / DENYSET_BITS_PER_ENTRY;
+}
+
+/*
+ * Tells if more entries were added than the set was sized for, so that
+ * false positives grow past the intended rate until it is refilled.
+ */
+int
+denyset_full(struct denyset *self)
+{
+	return self->nentry > self->maxentry;
+}
+
+void
+denyset_add(struct denyset *self, const char *name, int port)
+{
+	uint64_t h;
+	uint32_t h1, h2;
+	size_t bit;
+	int i;
+
+	h = _hash(name, port);
+	h1 = h;
+	h2 = (h >> 32) | 1;
+	for (i = 0; i < DENYSET_HASHES; i++) {
+		bit = (h1 + i * h2) & (self->nbits - 1);
+		self->bits[bit / 64] |= (uint64_t)1 << (bit % 64);
+	}
+	self->nentry++;
+}
+
+/*
+ * Returns 0 if the pair was certainly not added, 1 if it might have been.
+ */
+int
+denyset_maybe(struct denyset *self, const char *name, int port)
+{
+	uint64_t h;
+	uint32_t h1, h2;
+	size_t bit;
+	int i;
+
+	h = _hash(name, port);
+	h1 = h;
+	h2 = (h >> 32) | 1;
+	for (i = 0; i < DENYSET_HASHES; i++) {
+		bit = (h1 + i * h2) & (self->nbits - 1);
+		if ((self->bits[bit / 64] & ((uint64_t)1 << (bit % 64))) == 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * FNV-1a over the case-folded name and the port, matching the
+ * case-insensitive host names of the hostdb.
+ */
+static uint64_t
+_hash(const char *name, int port)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	for (; *name != '\0'; name++) {
+		h ^= (unsigned char)tolower((unsigned char)*name);
+		h *= 1099511628211ULL;
+	}
+	h ^= (uint64_t)port;
+	h *= 1099511628211ULL;
+
+	return h;
+}
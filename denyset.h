@@ -0,0 +1,16 @@
+#ifndef DENYSET_H
+#define DENYSET_H
+
+#include <stddef.h>
+
+struct denyset;
+
+struct denyset *denyset_create (void);
+void            denyset_free   (struct denyset *);
+
+void            denyset_reset  (struct denyset *, size_t);
+void            denyset_add    (struct denyset *, const char *, int);
+int             denyset_maybe  (struct denyset *, const char *, int);
+int             denyset_full   (struct denyset *);
+
+#endif
@@ -3,6 +3,7 @@
  */
 
 #include "dynstr.h"
+#include "mem.h"
 
 #include <stdarg.h>
 #include <string.h>
@@ -17,7 +18,7 @@ dynstr_create()
 {
 	struct dynstr *ds;
 
-	if ((ds = calloc(1, sizeof(ds))) == NULL)
+	if ((ds = mem_calloc(MEM_DYNSTR, 1, sizeof(*ds))) == NULL)
 		return NULL;
 	return ds;
 }
@@ -26,8 +27,8 @@ void
 dynstr_free(struct dynstr *ds)
 {
 	if (ds != NULL)
-		free(ds->buf);
-	free(ds);
+		mem_free(ds->buf);
+	mem_free(ds);
 }
 
 void
@@ -58,7 +59,7 @@ dynstr_grow(struct dynstr *ds)
 	else
 		ds->alloc *= 2;
 
-	ds->buf = realloc(ds->buf, (sizeof(char) * ds->alloc));
+	ds->buf = mem_realloc(MEM_DYNSTR, ds->buf, (sizeof(char) * ds->alloc));
 	if (ds->buf == NULL)
 		ds->err = errno;
 	else
@@ -107,6 +108,26 @@ dynstr_add(struct dynstr *ds, const char *fmt, ...)
 	va_end(ap);
 }
 
+/*
+ * Appends len bytes as they are, NULs included.
+ */
+void
+dynstr_append(struct dynstr *ds, const char *buf, size_t len)
+{
+	if (ds == NULL || ds->err)
+		return;
+
+	while (ds->len + len >= ds->alloc) {
+		dynstr_grow(ds);
+		if (ds->err)
+			return;
+	}
+	memcpy(ds->cursor, buf, len);
+	ds->len += len;
+	ds->cursor = ds->buf + ds->len;
+	*ds->cursor = '\0';
+}
+
 const char *
 dynstr_get(struct dynstr *ds)
 {
@@ -118,3 +139,11 @@ dynstr_get(struct dynstr *ds)
 	}
 	return ds->buf;
 }
+
+size_t
+dynstr_len(struct dynstr *ds)
+{
+	if (ds == NULL)
+		return 0;
+	return ds->len;
+}
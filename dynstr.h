@@ -36,7 +36,9 @@
 struct dynstr;
 
 void           dynstr_add    (struct dynstr *, const char *, ...);
+void           dynstr_append (struct dynstr *, const char *, size_t);
 const char    *dynstr_get    (struct dynstr *);
+size_t         dynstr_len    (struct dynstr *);
 void           dynstr_clear  (struct dynstr *);
 
 struct dynstr *dynstr_create (void);
@@ -0,0 +1,103 @@
+/*
+ * TCP echo server for load tests, standing in for the TLS servers that
+ * CONNECT tunnels lead to: the proxy only relays their bytes, so any
+ * byte stream will do.
+ *
+ * Usage: echod [-a addr] [-p port] [-t threads]
+ */
+
+#include "extern.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define ECHOD_PORT	18443
+#define ECHOD_THREADS	64
+
+static int serverfd;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: echod [-a addr] [-p port] [-t threads]\n");
+	exit(1);
+}
+
+/*
+ * Writes back what is read until the client closes.
+ */
+static void
+echo(int fd)
+{
+	char buf[65536];
+	ssize_t nr, nw, off;
+
+	while ((nr = read(fd, buf, sizeof(buf))) > 0)
+		for (off = 0; off < nr; off += nw)
+			if ((nw = write(fd, buf + off, nr - off)) <= 0)
+				return;
+}
+
+static void *
+worker(void *arg)
+{
+	int fd;
+
+	(void) arg;
+	for (;;) {
+		if ((fd = accept(serverfd, NULL, NULL)) == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			err(1, "accept");
+		}
+		echo(fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *addr = "127.0.0.1";
+	pthread_t tid;
+	int port = ECHOD_PORT, nthread = ECHOD_THREADS, ch, i;
+
+	while ((ch = getopt(argc, argv, "a:p:t:")) != -1) {
+		switch (ch) {
+		case 'a':
+			addr = optarg;
+			break;
+		case 'p':
+			if ((port = atoi(optarg)) <= 0)
+				usage();
+			break;
+		case 't':
+			if ((nthread = atoi(optarg)) <= 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc != optind)
+		usage();
+
+	signal(SIGPIPE, SIG_IGN);
+	if ((serverfd = tcpbind(addr, port)) == -1)
+		err(1, "listening on TCP %s:%d", addr, port);
+
+	for (i = 1; i < nthread; i++)
+		if ((errno = pthread_create(&tid, NULL, worker, NULL)) != 0)
+			err(1, "pthread_create");
+	worker(NULL);
+	return 0;
+}
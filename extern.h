@@ -6,8 +6,10 @@
 #include <netdb.h>
 #include <asr.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 #include "config.h"
+#include "hist.h"
 
 enum http_type
 {
@@ -76,6 +78,28 @@ struct evcallback
 	struct client *client;
 	void (*readfunc)(struct webgw *, struct client *);
 	void (*writefunc)(struct webgw *, struct client *);
+	int readkind;		/* enum callback_kind of each, for */
+	int writekind;		/* the loop statistics */
+};
+
+/*
+ * What an event callback does, each with a histogram of the time it
+ * takes in struct webgw.
+ */
+enum callback_kind
+{
+	CB_ACCEPT,
+	CB_ACCEPT_ADMIN,
+	CB_HOUSEKEEPING,
+	CB_READCLIENT,
+	CB_READTARGET,
+	CB_CONNECT,
+	CB_RESOLV,
+	CB_TIMEOUT,
+	CB_REPROCESS,
+	CB_ADMIN_READ,
+	CB_ADMIN_WRITE,
+	NCALLBACKS
 };
 
 enum client_type
@@ -85,6 +109,8 @@ enum client_type
 };
 
 struct host;
+struct dynstr;
+struct response;
 
 typedef struct client
 {
@@ -92,12 +118,12 @@ typedef struct client
 	int targetfd;
 	int targetconnected;
 
-	int request_size;
+	uint64_t request_size;
 
 	struct http_parser parser;
 
-	int bytes_in;	/* Statistics for logs */
-	int bytes_out;
+	uint64_t bytes_in;	/* Statistics for logs */
+	uint64_t bytes_out;
 
 	char rid[8 + 1]; /* random id */
 
@@ -111,12 +137,16 @@ typedef struct client
 	char verb_args[256];
 	int content_length;
 	int have_separator;
+	struct dynstr *body;	/* Request body, when collected */
+	struct response *response; /* Being written, by webclient.c */
 	int nbuf;
 
-	int bytes_from_target;
-	int bytes_from_client;
+	uint64_t bytes_from_target;
+	uint64_t bytes_from_client;
 
 	int type;
+	int state;		/* enum conn_state */
+	int sampled;		/* Timeline goes to the trace */
 
 	struct host *target_host;
 
@@ -137,43 +167,62 @@ typedef struct client
 	struct asr_query *asr_query;
 
 	struct timespec ts_begin;
+	struct timespec ts_headers;	/* Request headers parsed */
+	struct timespec ts_policy;	/* Verdict on the host reached */
+	struct timespec ts_held;	/* First parked on a held host */
+	struct timespec ts_resolve;	/* Name lookup started */
+	struct timespec ts_resolved;
 	struct timespec ts_connect;
 	struct timespec ts_end;
 	struct timespec ts_firstbyte;
 } Client;
 
-struct webgw;
-
-#include <sys/param.h>
-
-struct hoststats
+/*
+ * Phases of a proxied connection, each with a histogram in struct webgw.
+ * All are in microseconds but for PHASE_REQUEST_SIZE, which is in bytes.
+ */
+enum phase
 {
-	unsigned int bytes_sent;
-	unsigned int bytes_received;
-	unsigned int num_requests;
+	PHASE_ACCEPT,		/* Handling the accept */
+	PHASE_PARSE,		/* Accept to request headers parsed */
+	PHASE_POLICY,		/* Finding the host and its rule verdict */
+	PHASE_DNS,		/* Name lookup */
+	PHASE_CONNECT,		/* Name looked up to target connected */
+	PHASE_FIRSTBYTE,	/* Target connected to its first byte */
+	PHASE_LIFETIME,		/* Accept to close */
+	PHASE_REQUEST_SIZE,
+	NPHASES
 };
 
-struct hostport
+/*
+ * Where a connection is, with a count of each in struct webgw.
+ */
+enum conn_state
 {
-	char host[256];
-	unsigned short port;
-	struct hoststats stats;
-	int state;
-	int hold_timer;
-	struct hostport *next;
-	struct hostport *prev;
+	CONN_READING,		/* Reading the request */
+	CONN_PARKED,		/* Waiting on a held host */
+	CONN_RESOLVING,
+	CONN_CONNECTING,
+	CONN_TUNNELLING,	/* Relaying between client and target */
+	CONN_ADMIN,		/* On the admin server */
+	NCONNSTATES
 };
 
+struct webgw;
+
+#include <sys/param.h>
+
 struct hostdb;
+struct denyset;
+struct accesslog;
+struct shmstats;
+struct resolvmap;
 
 struct webgw
 {
 	int serverfd;
 	int serverfd_webserver;
 
-	struct hostport *authorized_head;
-	struct hostport *unauthorized_head;
-
 	char serverhostname[MAXHOSTNAMELEN];
 
 	int kq;		/* kqueue descriptor */
@@ -182,28 +231,46 @@ struct webgw
 
 	int refill_queue;
 
-	/* statistics */
-	int server_max_usec;
-	int server_sum_usec;
-	int server_samples;
+	struct hist phase[NPHASES];	/* statistics */
+	int nconn[NCONNSTATES];
 
-	int client_max_usec;
-	int client_sum_usec;
-	int client_samples;
+	struct hist callback[NCALLBACKS];	/* Time in each, in usec */
+	struct hist loop_lag;		/* Time to run one batch of events */
+	unsigned long loop_stalls;	/* Batches over LOOP_STALL_MSEC */
 
-	int target_max_usec;
-	int target_sum_usec;
-	int target_samples;
+	unsigned long long bytes_upstream;	/* Relayed to targets */
+	unsigned long long bytes_downstream;	/* and back to clients */
+	unsigned long denied_policy;	/* Refused once the headers are in */
+	unsigned long denied_port;
+	unsigned long dns_failures;
+	struct resolvmap *resolvmap;	/* Names not looked up, or NULL */
 
-	int resolv_max_usec;
-	int resolv_sum_usec;
-	int resolv_samples;
-
-	int request_size_max;
-	int request_size_sum;
-	int request_size_samples;
+	struct hist upstream_rtt;	/* TCP_INFO of targets, in usec */
+	unsigned long long upstream_retransmits;
 
 	struct hostdb *hostdb;
+	size_t hostdb_max_bytes;	/* Set before init(), 0 for default */
+	unsigned long hostdb_evictions;	/* As of the last tick */
+
+	struct accesslog *accesslog;	/* NULL if it could not be opened */
+	struct shmstats *shmstats;	/* Likewise */
+	unsigned long accepted_total;	/* Proxy connections */
+
+	/*
+	 * Hosts known to be denied: added to as hosts are denied, and
+	 * rebuilt by the timer after rules are reloaded or when it has
+	 * outgrown its size.
+	 */
+	struct denyset *denyset;
+	unsigned long denyset_reloads;	/* Rule reloads as of the rebuild */
+
+	unsigned long fastreject_total;	/* Requests rejected early */
+	unsigned long fastreject_last;	/* fastreject_total at last tick */
+	struct timespec fastreject_ts;	/* Time of last tick */
+	double fastreject_rate;		/* Per second, since last tick */
+
+	unsigned long admin_cache_hits;	/* Admin page sections served */
+	unsigned long admin_cache_misses; /* from cache, and rendered */
 };
 
 void
@@ -0,0 +1,121 @@
+#include "hist.h"
+
+static size_t _bucket(uint64_t);
+
+void
+hist_record(struct hist *self, uint64_t v)
+{
+	if (self->count == 0 || v < self->min)
+		self->min = v;
+	if (v > self->max)
+		self->max = v;
+	self->count++;
+	self->sum += v;
+	self->bucket[_bucket(v)]++;
+}
+
+/*
+ * Adds the values recorded in other to self.
+ */
+void
+hist_merge(struct hist *self, const struct hist *other)
+{
+	size_t i;
+
+	if (other->count == 0)
+		return;
+	if (self->count == 0 || other->min < self->min)
+		self->min = other->min;
+	if (other->max > self->max)
+		self->max = other->max;
+	self->count += other->count;
+	self->sum += other->sum;
+	for (i = 0; i < HIST_NBUCKETS; i++)
+		self->bucket[i] += other->bucket[i];
+}
+
+/*
+ * Returns the value below or at which the fraction q of the recorded
+ * values lie, rounded up to the end of its bucket, or 0 if nothing was
+ * recorded.
+ */
+uint64_t
+hist_percentile(const struct hist *self, double q)
+{
+	uint64_t rank, seen;
+	size_t i;
+
+	if (self->count == 0)
+		return 0;
+
+	rank = q * self->count;
+	if (rank < q * self->count || rank == 0)
+		rank++;
+	if (rank > self->count)
+		rank = self->count;
+
+	for (seen = 0, i = 0; i < HIST_NBUCKETS; i++)
+		if ((seen += self->bucket[i]) >= rank)
+			break;
+
+	if (i == HIST_NBUCKETS || hist_bucket_max(i) > self->max)
+		return self->max;
+	return hist_bucket_max(i);
+}
+
+double
+hist_mean(const struct hist *self)
+{
+	return self->count > 0 ? (double) self->sum / self->count : 0.0;
+}
+
+/*
+ * Returns the largest value counted in bucket i.
+ */
+uint64_t
+hist_bucket_max(size_t i)
+{
+	size_t shift;
+
+	if (i < HIST_SUB)
+		return i;
+	if (i == HIST_NBUCKETS - 1)
+		return UINT64_MAX;
+
+	shift = i / HIST_SUB - 1;
+	return ((uint64_t) (i % HIST_SUB + HIST_SUB + 1) << shift) - 1;
+}
+
+/*
+ * Returns the microseconds from one time to a later one, or 0 if it is
+ * not later. Seconds and nanoseconds are subtracted together, so a span
+ * across a second boundary comes out right.
+ */
+uint64_t
+hist_usec(const struct timespec *from, const struct timespec *to)
+{
+	int64_t usec;
+
+	usec = (int64_t) (to->tv_sec - from->tv_sec) * 1000000 +
+	    (to->tv_nsec - from->tv_nsec) / 1000;
+	return usec > 0 ? (uint64_t) usec : 0;
+}
+
+/*
+ * Values below HIST_SUB have a bucket each. Above that, the bucket is
+ * given by the position of the top bit and the HIST_SUB_BITS bits
+ * after it.
+ */
+static size_t
+_bucket(uint64_t v)
+{
+	size_t shift;
+
+	if (v < HIST_SUB)
+		return v;
+	if (v >> HIST_MAX_BITS)
+		return HIST_NBUCKETS - 1;
+
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + (v >> shift) - HIST_SUB;
+}
@@ -0,0 +1,37 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Log-linear histogram of non-negative values, such as latencies in
+ * microseconds or sizes in bytes. Every power of two is split into
+ * HIST_SUB linear buckets, so a bucket is at most 1/HIST_SUB of its
+ * values wide, and memory is fixed whatever is recorded. Values from
+ * 2^HIST_MAX_BITS up are counted in the last bucket.
+ */
+#define HIST_SUB_BITS	4
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS	40
+#define HIST_NBUCKETS	((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist
+{
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t bucket[HIST_NBUCKETS];
+};
+
+void     hist_record     (struct hist *, uint64_t);
+void     hist_merge      (struct hist *, const struct hist *);
+uint64_t hist_percentile (const struct hist *, double);
+double   hist_mean       (const struct hist *);
+uint64_t hist_bucket_max (size_t);
+
+uint64_t hist_usec       (const struct timespec *, const struct timespec *);
+
+#endif
@@ -1,45 +1,150 @@
 #include "host.h"
+#include "mem.h"
 #include <err.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#define HOST_CACHE_LINE		64
+
+/*
+ * Request and byte counters. Each worker adds to its own shard, so
+ * workers on different threads never write the same cache line, and
+ * readers sum the shards. With a single shard there is no padding.
+ */
+struct host_counters
+{
+	uint64_t visits;
+	uint64_t rx;
+	uint64_t tx;
+#if HOST_COUNTER_SHARDS > 1
+	char pad[HOST_CACHE_LINE - 3 * sizeof(uint64_t)];
+#endif
+};
+
+#if HOST_COUNTER_SHARDS > 1
+static __thread int _shard;
+#else
+#define _shard 0
+#endif
 
 struct host
 {
+	struct host_counters counters[HOST_COUNTER_SHARDS]; /* Keep first */
+
 	char *name;
 	char *pattern;
 	int port;
-	int visits;
-	int rx;
-	int tx;
 	int is_authorized;
 	int active;
+	int dirty;
+	unsigned long long seq;
+
+	/*
+	 * Cached rules_match() result, valid while policy_gen equals
+	 * rules_generation(). Points into the rule set, not owned.
+	 */
+	unsigned long policy_gen;
+	const char *policy_rule;
+
+	time_t held_since;	/* When a hold began, 0 if none; not saved */
+
+	struct host_tcp *tcp;	/* NULL until the first sample */
 };
 
+/*
+ * Upstream TCP samples, also not saved. Only the event loop adds to
+ * these, so they are not sharded. Most hosts are never connected to,
+ * so they are kept apart.
+ */
+struct host_tcp
+{
+	unsigned long samples;
+	unsigned long long rtt_sum;
+	unsigned rtt_max;
+	unsigned long long retransmits;
+	unsigned long rates;
+	unsigned long long rate_sum;
+};
+
+static void _set_counters(struct host *, uint64_t, uint64_t, uint64_t);
+static void _set_pattern(struct host *, char *);
+
+/*
+ * There are as many hosts as the hostdb holds, so they and their
+ * strings are allocated without the header of the mem_malloc() family,
+ * and accounted by host_size() instead.
+ */
 struct host *
-host_create(const char *name, int port, int visits)
+host_create(const char *name, int port, unsigned long long visits)
 {
 	struct host *self;
 
+#if HOST_COUNTER_SHARDS > 1
+	if (posix_memalign((void **) &self, HOST_CACHE_LINE,
+	    sizeof(struct host)) != 0)
+		err(1, "host_create");
+	memset(self, 0, sizeof(struct host));
+#else
 	if ((self = calloc(1, sizeof(struct host))) == NULL)
 		err(1, "host_create");
+#endif
 
-	self->name = strdup(name);
+	if ((self->name = strdup(name)) == NULL)
+		err(1, "host_create");
 	self->port = port;
-	self->visits = visits;
+	self->counters[0].visits = visits;
+	mem_account(MEM_HOSTDB, host_size(self));
 
 	return self;
 }
 
+/*
+ * Selects the counter shard that the calling thread adds to.
+ */
+void
+host_set_counter_shard(int shard)
+{
+#if HOST_COUNTER_SHARDS > 1
+	_shard = shard % HOST_COUNTER_SHARDS;
+#else
+	(void) shard;
+#endif
+}
+
+/*
+ * Replaces the counters with the given totals, e.g. when loading.
+ */
+static void
+_set_counters(struct host *self, uint64_t visits, uint64_t rx, uint64_t tx)
+{
+	memset(self->counters, 0, sizeof(self->counters));
+	self->counters[0].visits = visits;
+	self->counters[0].rx = rx;
+	self->counters[0].tx = tx;
+}
+
 static char *
-_match_prefix_strdup(const char *str, const char *prefix)
+_match_prefix(char *str, const char *prefix)
 {
-	size_t len, str_len;
+	size_t len;
 
 	len = strlen(prefix);
-	str_len = strlen(str);
-	if (strncmp(str, prefix, len) == 0 && len < str_len)
-		return strdup(&str[len]);
+	if (strncmp(str, prefix, len) == 0 && str[len] != '\0')
+		return &str[len];
+	else
+		return NULL;
+}
+
+static char *
+_match_prefix_strdup(char *str, const char *prefix)
+{
+	char *s;
+
+	if ((s = _match_prefix(str, prefix)) != NULL)
+		return strdup(s);
 	else
 		return NULL;
 }
@@ -48,9 +153,14 @@ struct host *
 host_create_from_data(char *buf)
 {
 	char *s, *name, *eol, *bol, *pattern;
-	int port, visits, rx, tx, is_authorized;
+	int port, is_authorized;
+	unsigned long long seq, visits, rx, tx;
 	struct host *host;
 
+	name = pattern = NULL;
+	port = is_authorized = 0;
+	seq = visits = rx = tx = 0;
+
 	bol = eol = buf;
 	do {
 		bol = eol;
@@ -58,28 +168,34 @@ host_create_from_data(char *buf)
 		if (eol != NULL)
 			*eol = '\0';
 
-		if ((s = _match_prefix_strdup(bol, "host ")) != NULL)
+		if ((s = _match_prefix(bol, "host ")) != NULL)
 			name = s;
 		else if ((s = _match_prefix_strdup(bol, "pattern ")) != NULL)
 			pattern = s;
-		else if ((s = _match_prefix_strdup(bol, "port ")) != NULL)
+		else if ((s = _match_prefix(bol, "port ")) != NULL)
 			port = atoi(s);
-		else if ((s = _match_prefix_strdup(bol, "visits ")) != NULL)
-			visits = atoi(s);
-		else if ((s = _match_prefix_strdup(bol, "rx_bytes ")) != NULL)
-			rx = atoi(s);
-		else if ((s = _match_prefix_strdup(bol, "tx_bytes ")) != NULL)
-			tx = atoi(s);
-		else if ((s = _match_prefix_strdup(bol, "is_authorized ")) !=
-		    NULL)
+		else if ((s = _match_prefix(bol, "visits ")) != NULL)
+			visits = strtoull(s, NULL, 10);
+		else if ((s = _match_prefix(bol, "rx_bytes ")) != NULL)
+			rx = strtoull(s, NULL, 10);
+		else if ((s = _match_prefix(bol, "tx_bytes ")) != NULL)
+			tx = strtoull(s, NULL, 10);
+		else if ((s = _match_prefix(bol, "is_authorized ")) != NULL)
 			is_authorized = atoi(s);
+		else if ((s = _match_prefix(bol, "seq ")) != NULL)
+			seq = strtoull(s, NULL, 10);
 	} while (eol++ != NULL);
 
-	host = host_create(name, port, visits);
-	host->rx = rx;
-	host->tx = tx;
+	if (name == NULL) {
+		free(pattern);
+		return NULL;
+	}
+
+	host = host_create(name, port, 0);
+	_set_counters(host, visits, rx, tx);
 	host->is_authorized = is_authorized;
-	host->pattern = pattern;
+	_set_pattern(host, pattern);
+	host->seq = seq;
 
 	return host;
 }
@@ -90,27 +206,160 @@ host_serialize(struct host *self, char *dst, size_t szdst)
 	if ((snprintf(dst, szdst,
 	    "host %s\n"
 	    "port %d\n"
-	    "visits %d\n"
-	    "rx_bytes %d\n"
-	    "tx_bytes %d\n"
+	    "visits %llu\n"
+	    "rx_bytes %llu\n"
+	    "tx_bytes %llu\n"
 	    "is_authorized %d\n"
-	    "pattern %s\n",
-	    self->name, self->port, self->visits, self->rx, self->tx,
-	    self->is_authorized, self->pattern)) >=
+	    "pattern %s\n"
+	    "seq %llu\n",
+	    host_name(self), self->port, host_visits(self), host_rx_bytes(self),
+	    host_tx_bytes(self),
+	    self->is_authorized, self->pattern != NULL ? self->pattern : "",
+	    self->seq)) >=
 	    (int) szdst)
 		errx(1, "host_serialize: truncated");
 
 	return dst;
 }
 
+/*
+ * Fixed-size part of a packed host, followed by the NUL terminated name
+ * and pattern, padded to HOST_PACK_ALIGN. Fields are in host byte order;
+ * the snapshot header carries a version to catch incompatible files.
+ */
+struct host_record
+{
+	uint64_t seq;
+	uint64_t visits;
+	uint64_t rx;
+	uint64_t tx;
+	int32_t port;
+	int32_t is_authorized;
+	uint16_t namelen;
+	uint16_t patternlen;
+	uint32_t reserved;
+};
+
+#define HOST_PACK_ALIGN		8
+#define HOST_PACK_ROUND(n)	\
+	(((n) + HOST_PACK_ALIGN - 1) & ~(size_t) (HOST_PACK_ALIGN - 1))
+
+/*
+ * Packs the host into dst in the binary snapshot format. Returns the
+ * number of bytes used, or 0 if dst is too small.
+ */
+size_t
+host_pack(struct host *self, char *dst, size_t szdst)
+{
+	struct host_record r;
+	size_t namelen, patternlen, len;
+
+	namelen = strlen(self->name);
+	patternlen = self->pattern != NULL ? strlen(self->pattern) : 0;
+	if (namelen > UINT16_MAX || patternlen > UINT16_MAX)
+		return 0;
+
+	len = HOST_PACK_ROUND(sizeof(r) + namelen + 1 + patternlen + 1);
+	if (len > szdst)
+		return 0;
+
+	memset(&r, 0, sizeof(r));
+	r.seq = self->seq;
+	r.port = self->port;
+	r.visits = host_visits(self);
+	r.rx = host_rx_bytes(self);
+	r.tx = host_tx_bytes(self);
+	r.is_authorized = self->is_authorized;
+	r.namelen = namelen;
+	r.patternlen = patternlen;
+
+	memset(dst, 0, len);
+	memcpy(dst, &r, sizeof(r));
+	memcpy(dst + sizeof(r), self->name, namelen);
+	if (patternlen > 0)
+		memcpy(dst + sizeof(r) + namelen + 1, self->pattern,
+		    patternlen);
+
+	return len;
+}
+
+/*
+ * Creates a host from a record made by host_pack(). Returns NULL and
+ * sets *used to 0 if the record is truncated or malformed.
+ */
+struct host *
+host_unpack(const char *src, size_t szsrc, size_t *used)
+{
+	struct host_record r;
+	struct host *host;
+	const char *name, *pattern;
+	char *s;
+	size_t len;
+
+	*used = 0;
+	if (szsrc < sizeof(r))
+		return NULL;
+	memcpy(&r, src, sizeof(r));
+
+	len = HOST_PACK_ROUND(sizeof(r) + r.namelen + 1 + r.patternlen + 1);
+	if (len > szsrc)
+		return NULL;
+
+	name = src + sizeof(r);
+	pattern = name + r.namelen + 1;
+	if (name[r.namelen] != '\0' || pattern[r.patternlen] != '\0')
+		return NULL;
+
+	host = host_create(name, r.port, 0);
+	_set_counters(host, r.visits, r.rx, r.tx);
+	host->is_authorized = r.is_authorized;
+	host->seq = r.seq;
+	if (r.patternlen > 0) {
+		if ((s = strdup(pattern)) == NULL)
+			err(1, "host_unpack");
+		_set_pattern(host, s);
+	}
+
+	*used = len;
+	return host;
+}
+
+/*
+ * Returns the memory used by the host.
+ */
+size_t
+host_size(struct host *self)
+{
+	return sizeof(struct host) + strlen(self->name) + 1 +
+	    (self->pattern != NULL ? strlen(self->pattern) + 1 : 0) +
+	    (self->tcp != NULL ? sizeof(struct host_tcp) : 0);
+}
+
 void
 host_free(struct host *self)
 {
+	mem_account(MEM_HOSTDB, -(long) host_size(self));
 	free(self->name);
 	free(self->pattern);
+	free(self->tcp);
 	free(self);
 }
 
+/*
+ * Replaces the pattern with s, which the host takes over, keeping the
+ * accounting in step.
+ */
+static void
+_set_pattern(struct host *self, char *s)
+{
+	if (self->pattern != NULL) {
+		mem_account(MEM_HOSTDB, -(long) (strlen(self->pattern) + 1));
+		free(self->pattern);
+	}
+	if ((self->pattern = s) != NULL)
+		mem_account(MEM_HOSTDB, strlen(s) + 1);
+}
+
 const char *
 host_name(struct host *self)
 {
@@ -123,48 +372,113 @@ host_port(struct host *self)
 	return self->port;
 }
 
-int
+unsigned long long
 host_visits(struct host *self)
 {
-	return self->visits;
+	unsigned long long n = 0;
+	int i;
+
+	for (i = 0; i < HOST_COUNTER_SHARDS; i++)
+		n += self->counters[i].visits;
+	return n;
 }
 
 void
 host_incr_visits(struct host *self)
 {
-	self->visits++;
+	self->counters[_shard].visits++;
 }
 
 void
-host_add_rx_bytes(struct host *self, int bytes)
+host_add_rx_bytes(struct host *self, size_t bytes)
 {
-	self->rx += bytes;
+	self->counters[_shard].rx += bytes;
 }
 
 void
-host_add_tx_bytes(struct host *self, int bytes)
+host_add_tx_bytes(struct host *self, size_t bytes)
 {
-	self->tx += bytes;
+	self->counters[_shard].tx += bytes;
 }
 
-int
+/*
+ * Adds a sample of a target connection: its round trip time in usec,
+ * and when it closes, its retransmits and delivery rate. Samples taken
+ * earlier in the life of a connection pass 0 for both.
+ */
+void
+host_add_tcp_sample(struct host *self, unsigned rtt_usec,
+    unsigned retransmits, unsigned long long delivery_rate)
+{
+	struct host_tcp *t;
+
+	if ((t = self->tcp) == NULL) {
+		if ((t = calloc(1, sizeof(*t))) == NULL)
+			return;
+		mem_account(MEM_HOSTDB, sizeof(*t));
+		self->tcp = t;
+	}
+
+	t->samples++;
+	t->rtt_sum += rtt_usec;
+	if (rtt_usec > t->rtt_max)
+		t->rtt_max = rtt_usec;
+	t->retransmits += retransmits;
+	if (delivery_rate > 0) {
+		t->rates++;
+		t->rate_sum += delivery_rate;
+	}
+}
+
+void
+host_get_tcp_stats(struct host *self, struct host_tcp_stats *stats)
+{
+	struct host_tcp *t;
+
+	memset(stats, 0, sizeof(*stats));
+	if ((t = self->tcp) == NULL)
+		return;
+	stats->samples = t->samples;
+	stats->rtt_usec = t->samples > 0 ? t->rtt_sum / t->samples : 0;
+	stats->rtt_max_usec = t->rtt_max;
+	stats->retransmits = t->retransmits;
+	stats->delivery_rate = t->rates > 0 ? t->rate_sum / t->rates : 0;
+}
+
+unsigned long long
 host_rx_bytes(struct host *self)
 {
-	return self->rx;
+	unsigned long long n = 0;
+	int i;
+
+	for (i = 0; i < HOST_COUNTER_SHARDS; i++)
+		n += self->counters[i].rx;
+	return n;
 }
 
-int
+unsigned long long
 host_tx_bytes(struct host *self)
 {
-	return self->tx;
+	unsigned long long n = 0;
+	int i;
+
+	for (i = 0; i < HOST_COUNTER_SHARDS; i++)
+		n += self->counters[i].tx;
+	return n;
 }
 
 void
 host_authorize(struct host *self, const char *pattern)
 {
+	char *s;
+
 	self->is_authorized = 1;
-	if (pattern != NULL)
-		self->pattern = strdup(pattern);
+	if (pattern != NULL && (self->pattern == NULL ||
+	    strcmp(self->pattern, pattern) != 0)) {
+		if ((s = strdup(pattern)) == NULL)
+			err(1, "host_authorize");
+		_set_pattern(self, s);
+	}
 }
 
 void
@@ -191,6 +505,18 @@ host_is_held(struct host *self)
 	return (self->is_authorized == 0);
 }
 
+time_t
+host_held_since(struct host *self)
+{
+	return self->held_since;
+}
+
+void
+host_set_held_since(struct host *self, time_t t)
+{
+	self->held_since = t;
+}
+
 void
 host_ref(struct host *self)
 {
@@ -208,3 +534,47 @@ host_ref_count(struct host *self)
 {
 	return self->active;
 }
+
+int
+host_is_dirty(struct host *self)
+{
+	return self->dirty;
+}
+
+void
+host_set_dirty(struct host *self, int dirty)
+{
+	self->dirty = dirty;
+}
+
+unsigned long long
+host_seq(struct host *self)
+{
+	return self->seq;
+}
+
+void
+host_set_seq(struct host *self, unsigned long long seq)
+{
+	self->seq = seq;
+}
+
+/*
+ * Returns 1 and the cached matching rule (or NULL for no match) if the
+ * cache is from policy generation gen.
+ */
+int
+host_policy_cached(struct host *self, unsigned long gen, const char **rule)
+{
+	if (self->policy_gen != gen)
+		return 0;
+	*rule = self->policy_rule;
+	return 1;
+}
+
+void
+host_set_policy(struct host *self, unsigned long gen, const char *rule)
+{
+	self->policy_gen = gen;
+	self->policy_rule = rule;
+}
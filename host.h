@@ -2,35 +2,78 @@
 #define HOST_H
 
 #include <stddef.h>
+#include <time.h>
+
+/*
+ * Number of per-worker shards of the traffic counters.
+ */
+#ifndef HOST_COUNTER_SHARDS
+#define HOST_COUNTER_SHARDS	1
+#endif
 
 struct host;
 
-struct host *host_create(const char *, int, int);
+/*
+ * Upstream TCP statistics, from samples of the target connections.
+ */
+struct host_tcp_stats
+{
+	unsigned long samples;
+	unsigned rtt_usec;		/* Mean */
+	unsigned rtt_max_usec;
+	unsigned long long retransmits;	/* Over closed connections */
+	unsigned long long delivery_rate; /* Mean at close, bytes/s */
+};
+
+struct host *host_create(const char *, int, unsigned long long);
 struct host *host_create_from_data(char *);
 
 void         host_free(struct host *);
+size_t       host_size(struct host *);
 
 const char  *host_name(struct host *);
 int          host_port(struct host *);
-int          host_visits(struct host *);
-int          host_rx_bytes(struct host *);
-int          host_tx_bytes(struct host *);
+unsigned long long
+             host_visits(struct host *);
+unsigned long long
+             host_rx_bytes(struct host *);
+unsigned long long
+             host_tx_bytes(struct host *);
 
 void         host_authorize(struct host *, const char *);
 void         host_unauthorize(struct host *);
 int          host_is_authorized(struct host *);
 int          host_is_held(struct host *);
+time_t       host_held_since(struct host *);
+void         host_set_held_since(struct host *, time_t);
 
 const char  *host_pattern(struct host *);
 
+int          host_policy_cached(struct host *, unsigned long,
+                 const char **);
+void         host_set_policy(struct host *, unsigned long, const char *);
+
 void         host_incr_visits(struct host *);
-void         host_add_rx_bytes(struct host *, int bytes);
-void         host_add_tx_bytes(struct host *, int bytes);
+void         host_add_rx_bytes(struct host *, size_t);
+void         host_add_tx_bytes(struct host *, size_t);
+void         host_set_counter_shard(int);
+
+void         host_add_tcp_sample(struct host *, unsigned, unsigned,
+                 unsigned long long);
+void         host_get_tcp_stats(struct host *, struct host_tcp_stats *);
 
 void         host_ref(struct host *);
 void         host_unref(struct host *);
 int          host_ref_count(struct host *);
 
 const char  *host_serialize(struct host *, char *, size_t);
+size_t       host_pack(struct host *, char *, size_t);
+struct host *host_unpack(const char *, size_t, size_t *);
+
+int          host_is_dirty(struct host *);
+void         host_set_dirty(struct host *, int);
+unsigned long long
+             host_seq(struct host *);
+void         host_set_seq(struct host *, unsigned long long);
 
 #endif
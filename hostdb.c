@@ -1,35 +1,198 @@
 #include "hostdb.h"
 #include "host.h"
+#include "mem.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
 #include <err.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/*
+ * Hosts are kept in a linked list in insertion order (newest first)
+ * for hostdb_iterate, and indexed by an open-addressing hash table
+ * keyed by (case-folded name, port) for hostdb_find. The table holds
+ * pointers to hostnodes, so struct host pointers stay stable.
+ *
+ * Growing the table is incremental: the old table is kept around and
+ * a few of its slots are copied to the new table on every operation,
+ * so no single lookup pays for rehashing the whole database. The old
+ * table is left untouched while it drains, so probing it stays valid
+ * and a lookup simply falls back to it on a miss.
+ *
+ * Persistence is a binary snapshot (known_hosts.db) plus an append-only
+ * journal of changed hosts. Callers mark a host with hostdb_touch()
+ * after changing it, and hostdb_flush() appends the dirty hosts to the
+ * journal in one batch. The journal uses the host_serialize() text
+ * format, and every record carries a sequence number, so replaying a
+ * record that is older than what was already loaded is a no-op.
+ *
+ * The snapshot is a header followed by host_pack() records. It is
+ * mapped and walked once at startup, with the hash table sized up
+ * front. The text format (known_hosts) is still read if there is no
+ * snapshot yet, and hostdb_import()/hostdb_export() use it too.
+ *
+ * When the journal has grown larger than the database, it is rotated
+ * aside and a forked child writes a fresh snapshot and renames it into
+ * place, then removes the rotated journal.
+ *
+ * Memory can be capped with hostdb_set_max_bytes(). Once over the cap,
+ * adding a host evicts cold hosts with the CLOCK algorithm: a hand
+ * sweeps the list, clearing the referenced bit that lookups set, and
+ * evicts the first host whose bit was already clear, that was never
+ * decided on and that is not in use by a client. Authorized and denied
+ * hosts are never evicted: they are the policy. An eviction is written
+ * to the journal as an "evicted" record so that a replay drops the
+ * host as well.
+ *
+ * Each host is also on the doubly linked list of its state (active,
+ * authorized or unauthorized), a secondary index for listing one state
+ * at a time. Callers call hostdb_refile() after changing what the state
+ * depends on or growing the host, which is then counted again. Cursors
+ * over these lists may be held across calls: a node leaving a list
+ * moves the cursors standing on it along. Each list has a generation,
+ * bumped when a host joins or leaves it or one of its hosts is touched,
+ * so that what was rendered from it can be cached.
+ */
+
+#define HOSTDB_SNAPSHOT		"known_hosts.db"
+#define HOSTDB_SNAPSHOT_TMP	"known_hosts.db.tmp"
+#define HOSTDB_TEXT		"known_hosts"
+#define HOSTDB_JOURNAL		"known_hosts.journal"
+#define HOSTDB_JOURNAL_OLD	"known_hosts.journal.old"
+
+#define HOSTDB_COMPACT_SLACK	1024
+
+#define HOSTDB_MAGIC		"webgwhdb"
+#define HOSTDB_VERSION		2
+
+#define HOSTTAB_INITIAL_SIZE	64
+#define HOSTTAB_MIGRATE_STEP	8
+
+#define HOSTDB_EVICTED		"evicted "
+#define HOSTDB_EVICT_SCAN	256	/* Nodes the hand may pass per add */
 
 struct hostnode
 {
-	struct host *host;
+	struct host *host;	/* NULL if dropped by a replayed eviction */
+	uint32_t hash;
+	uint32_t size;		/* Bytes accounted for this host */
 	struct hostnode *next;
+	int referenced;		/* For the CLOCK hand */
+
+	struct hostnode *snext;	/* On the list of its state */
+	struct hostnode *sprev;
+	int state;
+};
+
+struct hostdb_cursor
+{
+	struct hostnode *node;	/* Next to return */
+	struct hostdb_cursor *next;
+};
+
+struct hostdb_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t nhosts;
+	uint64_t seq;
+};
+
+struct hosttab
+{
+	struct hostnode **slot;
+	size_t size;		/* Power of two */
+	size_t used;
 };
 
 struct hostdb
 {
 	struct hostnode *head;
+	struct hosttab tab;
+	struct hosttab old;	/* Being drained into tab, if slot != NULL */
+	size_t migrate;		/* Next slot in old to move */
 	int loaded;
+
+	size_t nhosts;
+
+	struct host **dirty;	/* Hosts waiting for hostdb_flush() */
+	size_t ndirty;
+	size_t maxdirty;
+
+	FILE *journal;
+	size_t journal_records;
+	unsigned long long seq;
+	pid_t compact_pid;
+
+	size_t bytes;		/* Approximate memory used by the hosts */
+	size_t max_bytes;	/* 0 if unlimited */
+	struct hostnode **hand;	/* Link to the next node to consider */
+	unsigned long evictions;
+	int ndropped;		/* Nodes waiting for _sweep() */
+
+	struct hostnode *shead[HOSTDB_NSTATES];
+	struct hostnode *stail[HOSTDB_NSTATES];
+	size_t nstate[HOSTDB_NSTATES];
+	unsigned long gen[HOSTDB_NSTATES];
+	struct hostdb_cursor *cursors;
 };
 
+static struct host     *_find(struct hostdb *, const char *, int, int);
 static struct hostnode *_add_new_host(struct hostdb *, struct host *);
+static void             _index_host(struct hostdb *, struct hostnode *);
 static void             _free_hostnode(struct hostnode *);
+static void             _account(struct hostdb *, struct hostnode *);
+static void             _evict(struct hostdb *, struct host *, size_t);
+static int              _evictable(struct host *);
+static void             _drop(struct hostdb *, const char *);
+static void             _sweep(struct hostdb *);
+
+static int              _state(struct host *);
+static void             _file(struct hostdb *, struct hostnode *, int);
+static void             _unfile(struct hostdb *, struct hostnode *);
+static struct hostnode *_node(struct hostdb *, struct host *);
 
-static void             _load_hostdb(struct hostdb *);
-static void             _save_hostdb(struct hostdb *);
+static uint32_t         _hash(const char *, int);
+static struct hostnode *_tab_lookup(struct hosttab *, uint32_t,
+                            const char *, int);
+static void             _tab_insert(struct hosttab *, struct hostnode *);
+static void             _tab_reserve(struct hostdb *, size_t);
+static void             _tab_grow(struct hostdb *);
+static void             _tab_migrate(struct hostdb *, size_t);
+static void             _tab_remove(struct hosttab *, struct hostnode *);
+
+static int              _load_snapshot(struct hostdb *);
+static void             _replay(struct hostdb *, const char *, int);
+static void             _merge_host(struct hostdb *, struct host *, int);
+static void             _undirty(struct hostdb *, struct host *);
+static void             _open_journal(struct hostdb *);
+static void             _compact(struct hostdb *);
+static int              _write_snapshot(struct hostdb *);
 
 struct hostdb*
 hostdb_create()
 {
 	struct hostdb *self;
 
-	if ((self = calloc(1, sizeof(struct hostdb))) == NULL)
+	if ((self = mem_calloc(MEM_HOSTDB, 1, sizeof(struct hostdb))) == NULL)
+		err(1, "hostdb_create");
+
+	self->tab.size = HOSTTAB_INITIAL_SIZE;
+	if ((self->tab.slot = mem_calloc(MEM_HOSTDB, self->tab.size,
+	    sizeof(struct hostnode *))) == NULL)
 		err(1, "hostdb_create");
+	self->hand = &self->head;
 
 	return self;
 }
@@ -38,6 +201,7 @@ void
 hostdb_free(struct hostdb *self)
 {
 	struct hostnode *np, *next;
+	struct hostdb_cursor *c, *cnext;
 
 	for (np = self->head; np != NULL; np = next) {
 		host_free(np->host);
@@ -45,35 +209,218 @@ hostdb_free(struct hostdb *self)
 		_free_hostnode(np);
 	}
 	self->head = NULL;
-	free(self);
+	for (c = self->cursors; c != NULL; c = cnext) {
+		cnext = c->next;
+		mem_free(c);
+	}
+	mem_free(self->tab.slot);
+	mem_free(self->old.slot);
+	mem_free(self->dirty);
+	if (self->journal != NULL)
+		fclose(self->journal);
+	mem_free(self);
 }
 
+/*
+ * Returns the host, adding it if it is not known, and counts a visit.
+ */
 struct host*
 hostdb_find(struct hostdb *self, const char *name, int port)
 {
-	struct hostnode *np;
-	struct host *host;
+	return _find(self, name, port, 1);
+}
 
-	if (self->loaded == 0) {
-		_load_hostdb(self);
-		self->loaded = 1;
-	}
+/*
+ * Like hostdb_find(), but does not count a visit to a host that is
+ * already known.
+ */
+struct host *
+hostdb_get(struct hostdb *self, const char *name, int port)
+{
+	return _find(self, name, port, 0);
+}
 
-	for (np = self->head; np != NULL; np = np->next) {
-		host = np->host;
+static struct host *
+_find(struct hostdb *self, const char *name, int port, int visit)
+{
+	struct host *host;
 
-		if (strcmp(host_name(host), name) == 0 &&
-		    host_port(host) == port) {
+	if ((host = hostdb_lookup(self, name, port)) != NULL) {
+		if (visit) {
 			host_incr_visits(host);
-			return host;
+			hostdb_touch(self, host);
 		}
+		return host;
 	}
 
 	host = host_create(name, port, 0);
 	_add_new_host(self, host);
+	hostdb_touch(self, host);
+
+	if (self->max_bytes > 0 && self->bytes > self->max_bytes)
+		_evict(self, host, HOSTDB_EVICT_SCAN);
+
 	return host;
 }
 
+/*
+ * Like hostdb_find(), but neither adds the host nor counts a visit.
+ * Returns NULL if the host is not known.
+ */
+struct host *
+hostdb_lookup(struct hostdb *self, const char *name, int port)
+{
+	struct hostnode *np;
+	uint32_t hash;
+
+	if (self->old.slot != NULL)
+		_tab_migrate(self, HOSTTAB_MIGRATE_STEP);
+
+	hash = _hash(name, port);
+	np = _tab_lookup(&self->tab, hash, name, port);
+	if (np == NULL && self->old.slot != NULL)
+		np = _tab_lookup(&self->old, hash, name, port);
+	if (np == NULL)
+		return NULL;
+
+	np->referenced = 1;
+	return np->host;
+}
+
+/*
+ * Caps the memory used by hosts. Takes effect on the next load or
+ * added host; 0 means no limit.
+ */
+void
+hostdb_set_max_bytes(struct hostdb *self, size_t max_bytes)
+{
+	self->max_bytes = max_bytes;
+}
+
+void
+hostdb_get_stats(struct hostdb *self, struct hostdb_stats *stats)
+{
+	stats->nhosts = self->nhosts;
+	stats->bytes = self->bytes;
+	stats->max_bytes = self->max_bytes;
+	stats->evictions = self->evictions;
+}
+
+/*
+ * Loads the snapshot, or the text known_hosts if there is no snapshot
+ * yet, and replays the journals on top of it.
+ */
+void
+hostdb_load(struct hostdb *self)
+{
+	if (self->loaded)
+		return;
+	self->loaded = 1;
+
+	if (_load_snapshot(self) == -1) {
+		_replay(self, HOSTDB_TEXT, 0);
+		if (self->nhosts > 0 && (_write_snapshot(self) == -1 ||
+		    rename(HOSTDB_SNAPSHOT_TMP, HOSTDB_SNAPSHOT) == -1))
+			warn("hostdb_load: writing %s", HOSTDB_SNAPSHOT);
+	}
+	_replay(self, HOSTDB_JOURNAL_OLD, 0);
+	_replay(self, HOSTDB_JOURNAL, 0);
+
+	if (self->max_bytes > 0 && self->bytes > self->max_bytes)
+		_evict(self, NULL, 2 * self->nhosts + 2);
+}
+
+/*
+ * Merges hosts from a file in the text format. Imported records win
+ * over existing ones and are written to the journal on the next flush.
+ */
+void
+hostdb_import(struct hostdb *self, const char *file)
+{
+	_replay(self, file, 1);
+}
+
+int
+hostdb_export(struct hostdb *self, const char *file)
+{
+	FILE *fp;
+	struct hostnode *np;
+	char dst[1024];
+
+	if ((fp = fopen(file, "w")) == NULL)
+		return -1;
+
+	for (np = self->head; np != NULL; np = np->next)
+		fprintf(fp, "%s\n",
+		    host_serialize(np->host, dst, sizeof(dst)));
+
+	return fclose(fp);
+}
+
+void
+hostdb_touch(struct hostdb *self, struct host *host)
+{
+	self->gen[_state(host)]++;
+
+	if (host_is_dirty(host))
+		return;
+
+	if (self->ndirty == self->maxdirty) {
+		self->maxdirty = self->maxdirty ? self->maxdirty * 2 : 64;
+		if ((self->dirty = mem_reallocarray(MEM_HOSTDB, self->dirty,
+		    self->maxdirty, sizeof(struct host *))) == NULL)
+			err(1, "hostdb_touch");
+	}
+	self->dirty[self->ndirty++] = host;
+	host_set_dirty(host, 1);
+}
+
+/*
+ * Append every host changed since the last flush to the journal.
+ * Cost is proportional to the number of changed hosts, not to the
+ * size of the database.
+ */
+void
+hostdb_flush(struct hostdb *self)
+{
+	struct host *host;
+	char dst[1024];
+	size_t i;
+	int status;
+
+	if (self->compact_pid > 0 &&
+	    waitpid(self->compact_pid, &status, WNOHANG) == self->compact_pid) {
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			syslog(LOG_ERR, "hostdb compaction failed");
+		self->compact_pid = 0;
+	}
+
+	if (self->ndirty == 0)
+		return;
+
+	if (self->journal == NULL)
+		_open_journal(self);
+
+	for (i = 0; i < self->ndirty; i++) {
+		host = self->dirty[i];
+		host_set_dirty(host, 0);
+		host_set_seq(host, ++self->seq);
+		if (self->journal != NULL)
+			fprintf(self->journal, "%s\n",
+			    host_serialize(host, dst, sizeof(dst)));
+	}
+	self->journal_records += self->ndirty;
+	self->ndirty = 0;
+
+	if (self->journal == NULL)
+		return;
+	if (fflush(self->journal) == EOF)
+		syslog(LOG_ERR, "hostdb_flush: %s: %m", HOSTDB_JOURNAL);
+
+	if (self->journal_records > self->nhosts + HOSTDB_COMPACT_SLACK)
+		_compact(self);
+}
+
 struct host*
 hostdb_iterate(struct hostdb *self, struct hostnode **n)
 {
@@ -88,6 +435,228 @@ hostdb_iterate(struct hostdb *self, struct hostnode **n)
 		return (*n)->host;
 }
 
+/*
+ * Moves the host to the list of its current state, if it is not there
+ * already. Cheap when nothing changed. It is also called when a client
+ * takes or drops the host; one that stays active then bumps the active
+ * list's generation, as the listing of that shows the clients. The
+ * host is counted again, as it may have grown since it was filed.
+ */
+void
+hostdb_refile(struct hostdb *self, struct host *host)
+{
+	struct hostnode *np;
+
+	if ((np = _node(self, host)) == NULL)
+		return;
+	self->bytes -= np->size;
+	_account(self, np);
+	if (np->state == _state(host)) {
+		if (np->state == HOSTDB_ACTIVE)
+			self->gen[HOSTDB_ACTIVE]++;
+		return;
+	}
+
+	_unfile(self, np);
+	_file(self, np, 0);
+}
+
+size_t
+hostdb_count(struct hostdb *self, int state)
+{
+	return self->nstate[state];
+}
+
+unsigned long
+hostdb_generation(struct hostdb *self, int state)
+{
+	return self->gen[state];
+}
+
+/*
+ * Opens a cursor over the hosts in state, most recently filed first.
+ * Hosts filed after opening may or may not be seen, and a host that
+ * changes state while the cursor is open may be seen twice or not at
+ * all, but a cursor never points at a freed host.
+ */
+struct hostdb_cursor *
+hostdb_cursor_open(struct hostdb *self, int state)
+{
+	struct hostdb_cursor *c;
+
+	if ((c = mem_calloc(MEM_HOSTDB, 1, sizeof(*c))) == NULL)
+		err(1, "hostdb_cursor_open");
+	c->node = self->shead[state];
+	c->next = self->cursors;
+	self->cursors = c;
+
+	return c;
+}
+
+struct host *
+hostdb_cursor_next(struct hostdb *self, struct hostdb_cursor *c)
+{
+	struct hostnode *np;
+
+	if ((np = c->node) == NULL)
+		return NULL;
+	c->node = np->snext;
+
+	return np->host;
+}
+
+void
+hostdb_cursor_close(struct hostdb *self, struct hostdb_cursor *c)
+{
+	struct hostdb_cursor **link;
+
+	for (link = &self->cursors; *link != NULL; link = &(*link)->next)
+		if (*link == c) {
+			*link = c->next;
+			break;
+		}
+	mem_free(c);
+}
+
+/*
+ * FNV-1a over the case-folded name, with the port mixed in last.
+ */
+static uint32_t
+_hash(const char *name, int port)
+{
+	uint32_t h = 2166136261u;
+	const unsigned char *p;
+
+	for (p = (const unsigned char *) name; *p != '\0'; p++) {
+		h ^= tolower(*p);
+		h *= 16777619u;
+	}
+	h ^= (uint32_t) port;
+	h *= 16777619u;
+	h ^= h >> 16;
+
+	return h;
+}
+
+static struct hostnode*
+_tab_lookup(struct hosttab *tab, uint32_t hash, const char *name, int port)
+{
+	struct hostnode *np;
+	size_t i, mask;
+
+	mask = tab->size - 1;
+	for (i = hash & mask; (np = tab->slot[i]) != NULL; i = (i + 1) & mask)
+		if (np->hash == hash && host_port(np->host) == port &&
+		    strcasecmp(host_name(np->host), name) == 0)
+			return np;
+
+	return NULL;
+}
+
+static void
+_tab_insert(struct hosttab *tab, struct hostnode *np)
+{
+	size_t i, mask;
+
+	mask = tab->size - 1;
+	for (i = np->hash & mask; tab->slot[i] != NULL; i = (i + 1) & mask)
+		;
+	tab->slot[i] = np;
+	tab->used++;
+}
+
+/*
+ * Sizes an empty table for n hosts, so a bulk load does not resize.
+ */
+static void
+_tab_reserve(struct hostdb *self, size_t n)
+{
+	size_t size;
+
+	if (self->tab.used != 0 || self->old.slot != NULL)
+		return;
+
+	for (size = self->tab.size; size < n * 2 + 2; size *= 2)
+		;
+	if (size == self->tab.size)
+		return;
+
+	mem_free(self->tab.slot);
+	self->tab.size = size;
+	if ((self->tab.slot = mem_calloc(MEM_HOSTDB, self->tab.size,
+	    sizeof(struct hostnode *))) == NULL)
+		err(1, "_tab_reserve");
+}
+
+/*
+ * Start moving to a table twice the size. If a previous resize is
+ * still in progress, it is finished first.
+ */
+static void
+_tab_grow(struct hostdb *self)
+{
+	if (self->old.slot != NULL)
+		_tab_migrate(self, self->old.size);
+
+	self->old = self->tab;
+	self->migrate = 0;
+
+	self->tab.size = self->old.size * 2;
+	self->tab.used = 0;
+	if ((self->tab.slot = mem_calloc(MEM_HOSTDB, self->tab.size,
+	    sizeof(struct hostnode *))) == NULL)
+		err(1, "_tab_grow");
+}
+
+static void
+_tab_migrate(struct hostdb *self, size_t nslots)
+{
+	struct hostnode *np;
+
+	while (nslots-- > 0 && self->migrate < self->old.size) {
+		if ((np = self->old.slot[self->migrate]) != NULL)
+			_tab_insert(&self->tab, np);
+		self->migrate++;
+	}
+
+	if (self->migrate == self->old.size) {
+		mem_free(self->old.slot);
+		memset(&self->old, 0, sizeof(self->old));
+		self->migrate = 0;
+	}
+}
+
+/*
+ * Removes np from a linear probing table, moving later entries of the
+ * probe chain back so that lookups still find them.
+ */
+static void
+_tab_remove(struct hosttab *tab, struct hostnode *np)
+{
+	size_t i, j, home, mask;
+
+	mask = tab->size - 1;
+	for (i = np->hash & mask; tab->slot[i] != np; i = (i + 1) & mask)
+		if (tab->slot[i] == NULL)
+			return;
+	tab->slot[i] = NULL;
+	tab->used--;
+
+	for (j = (i + 1) & mask; tab->slot[j] != NULL; j = (j + 1) & mask) {
+		home = tab->slot[j]->hash & mask;
+		/*
+		 * The entry at j may fill the hole at i unless its home
+		 * slot lies cyclically in (i, j].
+		 */
+		if ((i <= j) ? (i < home && home <= j) :
+		    (i < home || home <= j))
+			continue;
+		tab->slot[i] = tab->slot[j];
+		tab->slot[j] = NULL;
+		i = j;
+	}
+}
+
 static struct hostnode*
 _add_new_host(struct hostdb *hostdb, struct host *host)
 {
@@ -95,39 +664,355 @@ _add_new_host(struct hostdb *hostdb, struct host *host)
 
 	if ((self = calloc(1, sizeof(struct hostnode))) == NULL)
 		err(1, "hostnode_create");
+	mem_account(MEM_HOSTDB, sizeof(struct hostnode));
 	self->host = host;
 	self->next = hostdb->head;
 	hostdb->head = self;
 
-	_save_hostdb(hostdb);
+	_index_host(hostdb, self);
+	_file(hostdb, self, 0);
 
 	return self;
 }
 
+static void
+_index_host(struct hostdb *hostdb, struct hostnode *np)
+{
+	np->hash = _hash(host_name(np->host), host_port(np->host));
+
+	if (hostdb->old.slot != NULL)
+		_tab_migrate(hostdb, HOSTTAB_MIGRATE_STEP);
+	if ((hostdb->tab.used + 1) * 2 > hostdb->tab.size)
+		_tab_grow(hostdb);
+	_tab_insert(&hostdb->tab, np);
+	hostdb->nhosts++;
+	_account(hostdb, np);
+}
+
+/*
+ * Nodes, like hosts, are many and all the same size, so they are
+ * allocated without a mem_malloc() header and accounted by count.
+ */
 static void
 _free_hostnode(struct hostnode *self)
 {
+	mem_account(MEM_HOSTDB, -(long) sizeof(struct hostnode));
 	free(self);
 }
 
+/*
+ * Counts the host, its node and its share of the hash table, which is
+ * kept at most half full.
+ */
+static void
+_account(struct hostdb *self, struct hostnode *np)
+{
+	np->size = sizeof(struct hostnode) + 2 * sizeof(struct hostnode *) +
+	    host_size(np->host);
+	self->bytes += np->size;
+}
+
+static int
+_evictable(struct host *host)
+{
+	return host_is_held(host) && host_ref_count(host) <= 0;
+}
+
+/*
+ * Advances the CLOCK hand at most scan nodes, evicting until the hosts
+ * fit in max_bytes again. The host keep is not evicted; it is the one
+ * just added, which the caller still holds.
+ */
+static void
+_evict(struct hostdb *self, struct host *keep, size_t scan)
+{
+	struct hostnode *np;
+	struct host *host;
+
+	/*
+	 * Removing from the table is only done on a table that is not
+	 * being drained. The drain is stepped as far as the scan would
+	 * go, and eviction waits for a later add if that does not finish
+	 * it; as each add also steps it, hosts added meanwhile go over
+	 * the cap by a small fraction of the table at most.
+	 */
+	if (self->old.slot != NULL) {
+		_tab_migrate(self, scan);
+		if (self->old.slot != NULL)
+			return;
+	}
+
+	for (; scan > 0 && self->bytes > self->max_bytes; scan--) {
+		if ((np = *self->hand) == NULL) {
+			self->hand = &self->head;
+			continue;
+		}
+		host = np->host;
+		if (host == keep || !_evictable(host) || np->referenced) {
+			np->referenced = 0;
+			self->hand = &np->next;
+			continue;
+		}
+
+		/*
+		 * A host that never reached the journal needs no record
+		 * of its eviction either.
+		 */
+		if (host_seq(host) != 0) {
+			if (self->journal == NULL)
+				_open_journal(self);
+			if (self->journal != NULL) {
+				fprintf(self->journal, HOSTDB_EVICTED
+				    "%s %d %llu\n\n", host_name(host),
+				    host_port(host), ++self->seq);
+				self->journal_records++;
+			}
+		}
+		if (host_is_dirty(host))
+			_undirty(self, host);
+
+		_unfile(self, np);
+		_tab_remove(&self->tab, np);
+		*self->hand = np->next;
+		self->bytes -= np->size;
+		self->nhosts--;
+		self->evictions++;
+		host_free(host);
+		_free_hostnode(np);
+	}
+}
+
+/*
+ * Replays an eviction record. The node stays in the list with a NULL
+ * host until _sweep() unlinks it, so that a replay does not walk the
+ * list for every record.
+ */
+static void
+_drop(struct hostdb *self, const char *record)
+{
+	struct hostnode *np;
+	char name[256];
+	unsigned long long seq;
+	int port;
+
+	if (sscanf(record, HOSTDB_EVICTED "%255s %d %llu", name, &port,
+	    &seq) != 3)
+		return;
+	if (seq > self->seq)
+		self->seq = seq;
+
+	if (self->old.slot != NULL)
+		_tab_migrate(self, self->old.size);
+	np = _tab_lookup(&self->tab, _hash(name, port), name, port);
+	if (np == NULL || host_seq(np->host) > seq)
+		return;
+
+	if (host_is_dirty(np->host))
+		_undirty(self, np->host);
+	_unfile(self, np);
+	_tab_remove(&self->tab, np);
+	self->bytes -= np->size;
+	self->nhosts--;
+	host_free(np->host);
+	np->host = NULL;
+	self->ndropped++;
+}
+
+static void
+_sweep(struct hostdb *self)
+{
+	struct hostnode **link, *np;
+
+	for (link = &self->head; (np = *link) != NULL; ) {
+		if (np->host == NULL) {
+			*link = np->next;
+			_free_hostnode(np);
+		} else
+			link = &np->next;
+	}
+	self->ndropped = 0;
+	self->hand = &self->head;
+}
+
+static int
+_state(struct host *host)
+{
+	if (host_ref_count(host) > 0)
+		return HOSTDB_ACTIVE;
+	if (host_is_authorized(host))
+		return HOSTDB_AUTHORIZED;
+	return HOSTDB_UNAUTHORIZED;
+}
+
+/*
+ * Puts the node on the list of its host's state, at the head, or at
+ * the tail when loading in list order.
+ */
 static void
-_load_hostdb(struct hostdb *self)
+_file(struct hostdb *self, struct hostnode *np, int tail)
+{
+	int state;
+
+	np->state = state = _state(np->host);
+	if (tail) {
+		np->snext = NULL;
+		np->sprev = self->stail[state];
+		if (np->sprev != NULL)
+			np->sprev->snext = np;
+		else
+			self->shead[state] = np;
+		self->stail[state] = np;
+	} else {
+		np->sprev = NULL;
+		np->snext = self->shead[state];
+		if (np->snext != NULL)
+			np->snext->sprev = np;
+		else
+			self->stail[state] = np;
+		self->shead[state] = np;
+	}
+	self->nstate[state]++;
+	self->gen[state]++;
+}
+
+static void
+_unfile(struct hostdb *self, struct hostnode *np)
+{
+	struct hostdb_cursor *c;
+
+	for (c = self->cursors; c != NULL; c = c->next)
+		if (c->node == np)
+			c->node = np->snext;
+
+	if (np->sprev != NULL)
+		np->sprev->snext = np->snext;
+	else
+		self->shead[np->state] = np->snext;
+	if (np->snext != NULL)
+		np->snext->sprev = np->sprev;
+	else
+		self->stail[np->state] = np->sprev;
+	np->snext = np->sprev = NULL;
+	self->nstate[np->state]--;
+	self->gen[np->state]++;
+}
+
+/*
+ * Finds the node of host, or of a host with the same name and port.
+ */
+static struct hostnode *
+_node(struct hostdb *self, struct host *host)
+{
+	struct hostnode *np;
+	uint32_t hash;
+
+	hash = _hash(host_name(host), host_port(host));
+	np = _tab_lookup(&self->tab, hash, host_name(host), host_port(host));
+	if (np == NULL && self->old.slot != NULL)
+		np = _tab_lookup(&self->old, hash, host_name(host),
+		    host_port(host));
+
+	return np;
+}
+
+/*
+ * Maps the binary snapshot and adds its hosts in file order. Returns -1
+ * if there is no usable snapshot.
+ */
+static int
+_load_snapshot(struct hostdb *self)
+{
+	struct hostdb_header hdr;
+	struct hostnode *np, *tail;
+	struct host *host;
+	struct stat sb;
+	const char *base;
+	size_t off, used;
+	uint64_t i;
+	int fd;
+
+	if ((fd = open(HOSTDB_SNAPSHOT, O_RDONLY)) == -1) {
+		if (errno != ENOENT)
+			warn("_load_snapshot: %s", HOSTDB_SNAPSHOT);
+		return -1;
+	}
+	if (fstat(fd, &sb) == -1 || (size_t) sb.st_size < sizeof(hdr)) {
+		warnx("_load_snapshot: %s: short file", HOSTDB_SNAPSHOT);
+		close(fd);
+		return -1;
+	}
+	base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		warn("_load_snapshot: mmap %s", HOSTDB_SNAPSHOT);
+		return -1;
+	}
+
+	memcpy(&hdr, base, sizeof(hdr));
+	if (memcmp(hdr.magic, HOSTDB_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != HOSTDB_VERSION) {
+		warnx("_load_snapshot: %s: unknown format", HOSTDB_SNAPSHOT);
+		munmap((void *) base, sb.st_size);
+		return -1;
+	}
+
+	_tab_reserve(self, hdr.nhosts);
+	if (hdr.seq > self->seq)
+		self->seq = hdr.seq;
+
+	for (tail = self->head; tail != NULL && tail->next != NULL;
+	    tail = tail->next)
+		;
+
+	off = sizeof(hdr);
+	for (i = 0; i < hdr.nhosts; i++) {
+		host = host_unpack(base + off, sb.st_size - off, &used);
+		if (host == NULL) {
+			warnx("_load_snapshot: %s: truncated at host %llu",
+			    HOSTDB_SNAPSHOT, (unsigned long long) i);
+			break;
+		}
+		off += used;
+
+		if ((np = calloc(1, sizeof(struct hostnode))) == NULL)
+			err(1, "_load_snapshot");
+		mem_account(MEM_HOSTDB, sizeof(struct hostnode));
+		np->host = host;
+		if (tail == NULL)
+			self->head = np;
+		else
+			tail->next = np;
+		tail = np;
+
+		_index_host(self, np);
+		_file(self, np, 1);
+	}
+
+	munmap((void *) base, sb.st_size);
+	return 0;
+}
+
+static void
+_replay(struct hostdb *self, const char *file, int import)
 {
 	FILE *fp;
-	const char *file = "known_hosts";
 	struct host *host;
 	char line[256], buf[1024];
 
 	if ((fp = fopen(file, "r")) == NULL) {
-		warn("_load_hostdb: %s", file);
+		if (errno != ENOENT)
+			warn("_load_hostdb: %s", file);
 		return;
 	}
 
 	buf[0] = '\0';
 	while (fgets(line, sizeof(line), fp) != NULL) {
 		if (line[0] == '\n') {
-			host = host_create_from_data(buf);
-			_add_new_host(self, host);
+			if (strncmp(buf, HOSTDB_EVICTED,
+			    strlen(HOSTDB_EVICTED)) == 0)
+				_drop(self, buf);
+			else if ((host = host_create_from_data(buf)) != NULL)
+				_merge_host(self, host, import);
 			buf[0] = '\0';
 		} else {
 			if (strlcat(buf, line, sizeof(buf)) >= sizeof(buf))
@@ -136,22 +1021,161 @@ _load_hostdb(struct hostdb *self)
 	}
 
 	fclose(fp);
+
+	if (self->ndropped > 0)
+		_sweep(self);
 }
 
+/*
+ * Adds a loaded host, or replaces an already loaded one if the record
+ * is newer or imported. Only used before the event loop starts, when
+ * nobody holds host pointers.
+ */
 static void
-_save_hostdb(struct hostdb *self)
+_merge_host(struct hostdb *self, struct host *host, int import)
+{
+	struct hostnode *np;
+
+	if (host_seq(host) > self->seq)
+		self->seq = host_seq(host);
+
+	if ((np = _node(self, host)) == NULL)
+		_add_new_host(self, host);
+	else if (import || host_seq(host) > host_seq(np->host)) {
+		if (host_is_dirty(np->host))
+			_undirty(self, np->host);
+		host_free(np->host);
+		np->host = host;
+		self->bytes -= np->size;
+		_account(self, np);
+		self->gen[np->state]++;
+		if (np->state != _state(host)) {
+			_unfile(self, np);
+			_file(self, np, 0);
+		}
+	} else {
+		host_free(host);
+		return;
+	}
+
+	if (import)
+		hostdb_touch(self, host);
+}
+
+static void
+_undirty(struct hostdb *self, struct host *host)
+{
+	size_t i;
+
+	for (i = 0; i < self->ndirty; i++)
+		if (self->dirty[i] == host) {
+			self->dirty[i] = self->dirty[--self->ndirty];
+			break;
+		}
+	host_set_dirty(host, 0);
+}
+
+static void
+_open_journal(struct hostdb *self)
+{
+	if ((self->journal = fopen(HOSTDB_JOURNAL, "a")) == NULL)
+		syslog(LOG_ERR, "_open_journal: %s: %m", HOSTDB_JOURNAL);
+}
+
+/*
+ * Rotates the journal aside and lets a child write the snapshot. If an
+ * earlier rotated journal is still around (its compaction failed), the
+ * current journal is left in place; sequence numbers keep the replay
+ * correct either way.
+ */
+static void
+_compact(struct hostdb *self)
+{
+	pid_t pid;
+
+	if (self->compact_pid > 0)
+		return;
+
+	fclose(self->journal);
+	self->journal = NULL;
+
+	if (access(HOSTDB_JOURNAL_OLD, F_OK) == -1 &&
+	    rename(HOSTDB_JOURNAL, HOSTDB_JOURNAL_OLD) == -1)
+		syslog(LOG_ERR, "_compact: rename %s: %m", HOSTDB_JOURNAL);
+
+	switch (pid = fork()) {
+	case -1:
+		syslog(LOG_ERR, "_compact: fork: %m");
+		break;
+	case 0:
+		if (_write_snapshot(self) == -1 ||
+		    rename(HOSTDB_SNAPSHOT_TMP, HOSTDB_SNAPSHOT) == -1 ||
+		    unlink(HOSTDB_JOURNAL_OLD) == -1)
+			_exit(1);
+		_exit(0);
+	default:
+		self->compact_pid = pid;
+		self->journal_records = 0;
+		break;
+	}
+
+	_open_journal(self);
+}
+
+/*
+ * Writes the snapshot to HOSTDB_SNAPSHOT_TMP for the caller to rename
+ * into place. On failure the partial file is removed and -1 returned,
+ * with errno set.
+ */
+static int
+_write_snapshot(struct hostdb *self)
 {
 	FILE *fp;
-	const char *file = "known_hosts";
+	struct hostdb_header hdr;
 	struct hostnode *np;
-	char dst[1024];
+	char dst[2048];
+	size_t len;
+	int saved_errno;
 
-	if ((fp = fopen(file, "w")) == NULL)
-		err(1, "_save_hostdb: %s", file);
+	if ((fp = fopen(HOSTDB_SNAPSHOT_TMP, "w")) == NULL)
+		return -1;
 
-	for (np = self->head; np != NULL; np = np->next)
-		fprintf(fp, "%s\n",
-		    host_serialize(np->host, dst, sizeof(dst)));
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, HOSTDB_MAGIC, sizeof(hdr.magic));
+	hdr.version = HOSTDB_VERSION;
+	hdr.seq = self->seq;
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		goto fail;
+
+	/*
+	 * Hosts with absurdly long names are left out; the count in the
+	 * header is fixed up afterwards.
+	 */
+	for (np = self->head; np != NULL; np = np->next) {
+		if ((len = host_pack(np->host, dst, sizeof(dst))) == 0)
+			continue;
+		if (fwrite(dst, len, 1, fp) != 1)
+			goto fail;
+		hdr.nhosts++;
+	}
+
+	if (fseek(fp, 0, SEEK_SET) == -1 ||
+	    fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    fflush(fp) == EOF || fsync(fileno(fp)) == -1)
+		goto fail;
+
+	if (fclose(fp) == EOF) {
+		saved_errno = errno;
+		unlink(HOSTDB_SNAPSHOT_TMP);
+		errno = saved_errno;
+		return -1;
+	}
+	return 0;
 
+ fail:
+	saved_errno = errno;
 	fclose(fp);
+	unlink(HOSTDB_SNAPSHOT_TMP);
+	errno = saved_errno;
+	return -1;
 }
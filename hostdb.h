@@ -1,15 +1,59 @@
 #ifndef HOSTDB_H
 #define HOSTDB_H
 
+#include <stddef.h>
+
 struct hostnode;
 struct hostdb;
+struct hostdb_cursor;
 struct host;
 
+/*
+ * Every host is also on the list of its state, so the hosts in one
+ * state can be listed without walking the others.
+ */
+enum hostdb_state
+{
+	HOSTDB_ACTIVE,		/* In use by a client */
+	HOSTDB_AUTHORIZED,
+	HOSTDB_UNAUTHORIZED,
+	HOSTDB_NSTATES
+};
+
+struct hostdb_stats
+{
+	size_t nhosts;
+	size_t bytes;		/* Approximate memory used by the hosts */
+	size_t max_bytes;	/* 0 if unlimited */
+	unsigned long evictions;
+};
+
 struct hostdb *hostdb_create  (void);
 void           hostdb_free    (struct hostdb *);
 
+void           hostdb_load    (struct hostdb *);
+void           hostdb_import  (struct hostdb *, const char *);
+int            hostdb_export  (struct hostdb *, const char *);
+
 struct host   *hostdb_find    (struct hostdb *, const char *, int);
+struct host   *hostdb_get     (struct hostdb *, const char *, int);
+struct host   *hostdb_lookup  (struct hostdb *, const char *, int);
 
 struct host   *hostdb_iterate (struct hostdb *, struct hostnode **);
 
+void           hostdb_refile  (struct hostdb *, struct host *);
+size_t         hostdb_count   (struct hostdb *, int);
+unsigned long  hostdb_generation (struct hostdb *, int);
+
+struct hostdb_cursor
+              *hostdb_cursor_open  (struct hostdb *, int);
+struct host   *hostdb_cursor_next  (struct hostdb *, struct hostdb_cursor *);
+void           hostdb_cursor_close (struct hostdb *, struct hostdb_cursor *);
+
+void           hostdb_touch   (struct hostdb *, struct host *);
+void           hostdb_flush   (struct hostdb *);
+
+void           hostdb_set_max_bytes (struct hostdb *, size_t);
+void           hostdb_get_stats     (struct hostdb *, struct hostdb_stats *);
+
 #endif
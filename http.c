@@ -3,10 +3,15 @@
 #include <assert.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
 #include "extern.h"
 #include "http.h"
+#include "log.h"
+#include "mem.h"
 
 int http_parse_hostport(char *, char **, int *);
+static int hexval(int);
 static int parse_url(char *, char **, int *, char **);
 static int parse_startline(char *, char **, char **);
 
@@ -44,6 +49,117 @@ http_parse_hostport(char *hostport, char **host_out, int *port_out)
 	return 0;
 }
 
+/*
+ * Returns the value of the header named key, or NULL if the request
+ * did not have one.
+ */
+const char *
+http_header_value(struct http_parser *parser, const char *key)
+{
+	int i;
+
+	for (i = 0; i < parser->n_header; i++)
+		if (strcasecmp(parser->header[i].key, key) == 0)
+			return parser->header[i].value;
+
+	return NULL;
+}
+
+/*
+ * Returns the decoded value of the field name in an
+ * application/x-www-form-urlencoded body, allocated with mem_malloc().
+ * Returns NULL if there is no such field or on allocation failure.
+ */
+char *
+http_form_value(const char *body, const char *name)
+{
+	const char *p, *end;
+	char *value, *q;
+	size_t namelen;
+
+	namelen = strlen(name);
+	for (p = body; p != NULL; p = (*end == '&') ? end + 1 : NULL) {
+		end = p + strcspn(p, "&");
+		if (strncmp(p, name, namelen) != 0 || p[namelen] != '=')
+			continue;
+
+		p += namelen + 1;
+		if ((value = mem_malloc(MEM_ADMIN, end - p + 1)) == NULL)
+			return NULL;
+		for (q = value; p < end; p++) {
+			if (*p == '+')
+				*q++ = ' ';
+			else if (*p == '%' && end - p > 2 &&
+			    hexval(p[1]) != -1 && hexval(p[2]) != -1) {
+				*q++ = hexval(p[1]) << 4 | hexval(p[2]);
+				p += 2;
+			} else
+				*q++ = *p;
+		}
+		*q = '\0';
+		return value;
+	}
+
+	return NULL;
+}
+
+const char *
+http_status(int code)
+{
+	static const struct { int code; char *msg; } status[] = {
+		{ .code = 200, .msg = "Connection Established" },
+		{ .code = 400, .msg = "Bad Request" },
+		{ .code = 403, .msg = "Forbidden" },
+		{ .code = 500, .msg = "Internal Error" },
+		{ .code = 502, .msg = "Proxy Failed Connection" },
+		{ .code = 503, .msg = "Service Unavailable" },
+	};
+	int i;
+
+	for (i = 0; i < sizeof(status) / sizeof(status[0]); i++)
+		if (status[i].code == code)
+			return status[i].msg;
+
+	assert(0);
+	return "Unknown Error";
+}
+
+/*
+ * Formats the plain text response sent for an error code into buf and
+ * returns its length, as snprintf(3) does.
+ */
+int
+http_format_error(char *buf, size_t size, int code, const char *text)
+{
+	char datebuf[80];
+	time_t t;
+
+	t = time(0);
+	strftime(datebuf, sizeof(datebuf), "%a, %d %b %Y %T %Z", gmtime(&t));
+
+	return snprintf(buf, size,
+	    "HTTP/1.1 %d %s\r\n"
+	    "Server: webgw/1.0\r\n"
+	    "Date: %s\r\n"
+	    "Content-Type: text/plain;charset=us-ascii\r\n"
+	    "Content-Length: %zu\r\n"
+	    "Via: 1.1 spirit (webgw/1.0)\r\n"
+	    "Connection: close\r\n\r\n"
+	    "%s", code, http_status(code), datebuf, strlen(text), text);
+}
+
+static int
+hexval(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
 /*
  * Parse 'http://host:port/path' to host, port and path.
  * Modifies the original string and uses its memory. Returns -1 on failure.
@@ -107,7 +223,7 @@ parse_startline_line(struct http_parser *parser, const char *line)
 	strlcpy(parser->startline, line, sizeof(parser->startline));
 	parser->state = HTTP_HEADERS;
 
-	syslog(LOG_INFO, "%s", parser->startline);
+	log_msg(LOG_DEBUG, "%s", parser->startline);
 	if (parse_startline(parser->startline, &parser->method,
 	    &parser->uri) == -1) {
 		parser->error_state = HTTP_STARTLINE_PARSE_ERROR;
@@ -115,7 +231,7 @@ parse_startline_line(struct http_parser *parser, const char *line)
 	}
 
 #if 1
-	syslog(LOG_INFO, "Method: '%s' Uri: '%s'", parser->method,
+	log_msg(LOG_DEBUG, "Method: '%s' Uri: '%s'", parser->method,
 	    parser->uri);
 #endif
 			
@@ -127,7 +243,7 @@ parse_startline_line(struct http_parser *parser, const char *line)
 			return;
 		}
 	} else if (parser->uri != NULL && parser->uri[0] == '/') {
-		syslog(LOG_INFO, "local URL");
+		log_msg(LOG_DEBUG, "local URL");
 		parser->path = parser->uri;
 	} else {
 		if (parse_url(parser->uri, &parser->host,
@@ -138,7 +254,7 @@ parse_startline_line(struct http_parser *parser, const char *line)
 		}
 	}
 #if 1
-	syslog(LOG_INFO, "host: %s, port: %d path: %s",
+	log_msg(LOG_DEBUG, "host: %s, port: %d path: %s",
 	    parser->host, parser->port, parser->path);
 #endif
 
@@ -1,6 +1,14 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include <stddef.h>
+
+struct http_parser;
+
 int http_parse_hostport(char *hostport, char **host_out, int *port_out);
+const char *http_header_value(struct http_parser *, const char *);
+char *http_form_value(const char *, const char *);
+const char *http_status(int);
+int http_format_error(char *, size_t, int, const char *);
 
 #endif
@@ -0,0 +1,562 @@
+/*
+ * Load generator for webgw. Each thread runs one request at a time
+ * through the proxy, back to back, of a kind picked at random by the
+ * mix:
+ *
+ *	connect	CONNECT to the echo server, then size bytes echoed through
+ *	get	GET of size bytes from the origin server
+ *	held	GET from a host the proxy has not seen, which it parks;
+ *		given up on after the hold wait
+ *	denied	GET from a host unauthorized beforehand, answered 403
+ *
+ * The origin and echo server are reached by names the proxy is told
+ * about with -r, as in
+ *
+ *	origin.bench.test:80	127.0.0.1:18080
+ *	echo.bench.test:443	127.0.0.1:18443
+ *
+ * and which loadgen authorizes on the admin server before it starts,
+ * unauthorizing the denied host. At the end it prints the results as
+ * JSON: rates, latencies of all but held requests, and the CPU time,
+ * its own and the proxy's from /metrics, per request.
+ *
+ * Usage: loadgen [-c conns] [-d secs] [-m mix] [-p proxy] [-A admin]
+ *                [-s size] [-w hold_msec]
+ */
+
+#include "hist.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <err.h>
+
+#define ORIGIN_HOST	"origin.bench.test"
+#define ECHO_HOST	"echo.bench.test"
+#define DENIED_HOST	"denied.bench.test"
+#define HELD_DOMAIN	"held.bench.test"
+
+#define LOADGEN_TIMEOUT_SEC	10	/* For anything but held requests */
+#define LOADGEN_BUF	65536
+
+enum kind
+{
+	KIND_CONNECT,
+	KIND_GET,
+	KIND_HELD,
+	KIND_DENIED,
+	NKINDS
+};
+
+static const char *kind_name[NKINDS] = {
+	[KIND_CONNECT]	= "connect",
+	[KIND_GET]	= "get",
+	[KIND_HELD]	= "held",
+	[KIND_DENIED]	= "denied",
+};
+
+struct worker
+{
+	pthread_t tid;
+	int id;
+	uint64_t rand;
+	unsigned long seq;		/* Held hosts asked for */
+	char buf[LOADGEN_BUF];
+
+	unsigned long requests[NKINDS];
+	unsigned long errors[NKINDS];
+	unsigned long long bytes;	/* Payload, both ways */
+	struct hist latency[NKINDS];	/* In usec */
+};
+
+static struct sockaddr_in proxy;
+static struct timespec deadline;
+static unsigned weight[NKINDS];
+static unsigned weight_total;
+static long size = 16384;
+static int hold_msec = 100;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: loadgen [-c conns] [-d secs] [-m mix] "
+	    "[-p proxy] [-A admin]\n"
+	    "               [-s size] [-w hold_msec]\n");
+	exit(1);
+}
+
+static void
+parse_addr(const char *s, struct sockaddr_in *sa)
+{
+	char host[64];
+	const char *colon;
+
+	if ((colon = strrchr(s, ':')) == NULL ||
+	    (size_t) (colon - s) >= sizeof(host))
+		errx(1, "%s: expected address:port", s);
+	memcpy(host, s, colon - s);
+	host[colon - s] = '\0';
+
+	memset(sa, 0, sizeof(*sa));
+	sa->sin_family = AF_INET;
+	sa->sin_port = htons(atoi(colon + 1));
+	if (inet_pton(AF_INET, host, &sa->sin_addr) != 1 ||
+	    sa->sin_port == 0)
+		errx(1, "%s: expected address:port", s);
+}
+
+/*
+ * Takes "kind=weight,..." with the kinds not given weighing 0.
+ */
+static void
+parse_mix(char *s)
+{
+	char *item, *eq;
+	int i;
+
+	memset(weight, 0, sizeof(weight));
+	weight_total = 0;
+	for (item = strtok(s, ","); item != NULL; item = strtok(NULL, ",")) {
+		if ((eq = strchr(item, '=')) == NULL)
+			errx(1, "%s: expected kind=weight", item);
+		*eq = '\0';
+		for (i = 0; i < NKINDS; i++)
+			if (strcmp(item, kind_name[i]) == 0)
+				break;
+		if (i == NKINDS)
+			errx(1, "%s: not connect, get, held or denied", item);
+		weight[i] = strtoul(eq + 1, NULL, 10);
+		weight_total += weight[i];
+	}
+	if (weight_total == 0)
+		errx(1, "the mix is empty");
+}
+
+static int
+past(const struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec > t->tv_sec ||
+	    (now.tv_sec == t->tv_sec && now.tv_nsec >= t->tv_nsec);
+}
+
+static enum kind
+pick(struct worker *w)
+{
+	unsigned r;
+	int i;
+
+	/* xorshift64 */
+	w->rand ^= w->rand << 13;
+	w->rand ^= w->rand >> 7;
+	w->rand ^= w->rand << 17;
+	r = w->rand % weight_total;
+	for (i = 0; i < NKINDS - 1; i++) {
+		if (r < weight[i])
+			break;
+		r -= weight[i];
+	}
+	return i;
+}
+
+static int
+dial(const struct sockaddr_in *sa, int timeout_msec)
+{
+	struct timeval tv;
+	int fd, one = 1;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		return -1;
+	tv.tv_sec = timeout_msec / 1000;
+	tv.tv_usec = timeout_msec % 1000 * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(fd, (const struct sockaddr *) sa, sizeof(*sa)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int
+write_all(int fd, const char *buf, size_t n)
+{
+	ssize_t nw;
+
+	for (; n > 0; buf += nw, n -= nw)
+		if ((nw = write(fd, buf, n)) <= 0)
+			return -1;
+	return 0;
+}
+
+/*
+ * Reads until the end of the response head, into buf, and returns the
+ * bytes read, or -1 with errno set. Anything past the head is left at
+ * *body.
+ */
+static ssize_t
+read_head(int fd, char *buf, size_t bufsize, char **body)
+{
+	size_t off;
+	ssize_t nr;
+	char *end;
+
+	for (off = 0; off < bufsize - 1; off += nr) {
+		if ((nr = read(fd, buf + off, bufsize - 1 - off)) == 0)
+			errno = ECONNRESET;
+		if (nr <= 0)
+			return -1;
+		buf[off + nr] = '\0';
+		if ((end = strstr(buf, "\r\n\r\n")) != NULL) {
+			*body = end + 4;
+			return off + nr;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Returns the status code of a response head, or -1.
+ */
+static int
+status(const char *head)
+{
+	int major, minor, code;
+
+	if (sscanf(head, "HTTP/%d.%d %d", &major, &minor, &code) != 3)
+		return -1;
+	return code;
+}
+
+/*
+ * Sends a GET for path on host and returns the status, counting the
+ * body in w->bytes, or -1 if the exchange failed. A held request times
+ * out, which returns 0.
+ */
+static int
+get(struct worker *w, int fd, const char *host, const char *path)
+{
+	char *body;
+	ssize_t n, nr;
+	long received;
+	int len, code;
+
+	len = snprintf(w->buf, sizeof(w->buf),
+	    "GET http://%s%s HTTP/1.1\r\nHost: %s\r\n"
+	    "Connection: close\r\n\r\n", host, path, host);
+	if (write_all(fd, w->buf, len) == -1)
+		return -1;
+	if ((n = read_head(fd, w->buf, sizeof(w->buf), &body)) == -1)
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+	if ((code = status(w->buf)) == -1)
+		return -1;
+
+	received = n - (body - w->buf);
+	while ((nr = read(fd, w->buf, sizeof(w->buf))) > 0)
+		received += nr;
+	if (nr == -1)
+		return -1;
+	w->bytes += received;
+	if (code == 200 && received != size)
+		return -1;
+	return code;
+}
+
+/*
+ * Opens a tunnel to the echo server and sends size bytes through it,
+ * a buffer at a time, reading each back before the next.
+ */
+static int
+tunnel(struct worker *w, int fd)
+{
+	char *body;
+	long left;
+	size_t chunk, got;
+	ssize_t nr;
+	int len;
+
+	len = snprintf(w->buf, sizeof(w->buf),
+	    "CONNECT %s:443 HTTP/1.1\r\nHost: %s:443\r\n\r\n",
+	    ECHO_HOST, ECHO_HOST);
+	if (write_all(fd, w->buf, len) == -1)
+		return -1;
+	if (read_head(fd, w->buf, sizeof(w->buf), &body) == -1 ||
+	    status(w->buf) != 200)
+		return -1;
+
+	memset(w->buf, 'x', sizeof(w->buf));
+	for (left = size; left > 0; left -= chunk) {
+		chunk = left < (long) sizeof(w->buf) ? left : sizeof(w->buf);
+		if (write_all(fd, w->buf, chunk) == -1)
+			return -1;
+		for (got = 0; got < chunk; got += nr)
+			if ((nr = read(fd, w->buf, chunk - got)) <= 0)
+				return -1;
+		w->bytes += 2 * chunk;
+	}
+	return 0;
+}
+
+static void
+run(struct worker *w, enum kind kind)
+{
+	struct timespec t0, t1;
+	char host[128], path[64];
+	int fd, ok;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if ((fd = dial(&proxy, kind == KIND_HELD ? hold_msec :
+	    LOADGEN_TIMEOUT_SEC * 1000)) == -1) {
+		w->errors[kind]++;
+		return;
+	}
+
+	switch (kind) {
+	case KIND_CONNECT:
+		ok = tunnel(w, fd) == 0;
+		break;
+	case KIND_GET:
+		snprintf(path, sizeof(path), "/bytes/%ld", size);
+		ok = get(w, fd, ORIGIN_HOST, path) == 200;
+		break;
+	case KIND_HELD:
+		snprintf(host, sizeof(host), "h%lu.t%d." HELD_DOMAIN,
+		    w->seq++, w->id);
+		ok = get(w, fd, host, "/") == 0;
+		break;
+	case KIND_DENIED:
+	default:
+		ok = get(w, fd, DENIED_HOST, "/") == 403;
+		break;
+	}
+	close(fd);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (!ok) {
+		w->errors[kind]++;
+		return;
+	}
+	w->requests[kind]++;
+	hist_record(&w->latency[kind], hist_usec(&t0, &t1));
+}
+
+static void *
+worker(void *arg)
+{
+	struct worker *w = arg;
+
+	while (!past(&deadline))
+		run(w, pick(w));
+	return NULL;
+}
+
+/*
+ * Asks the admin server for path and returns the response, or NULL.
+ */
+static char *
+admin_get(const struct sockaddr_in *admin, const char *path)
+{
+	char *buf, req[256];
+	size_t off, bufsize;
+	ssize_t nr;
+	int fd, len;
+
+	if ((fd = dial(admin, LOADGEN_TIMEOUT_SEC * 1000)) == -1)
+		return NULL;
+	len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\n"
+	    "Host: admin\r\nConnection: close\r\n\r\n", path);
+	if (write_all(fd, req, len) == -1) {
+		close(fd);
+		return NULL;
+	}
+
+	bufsize = 65536;
+	if ((buf = malloc(bufsize)) == NULL)
+		err(1, NULL);
+	for (off = 0; (nr = read(fd, buf + off, bufsize - 1 - off)) > 0;) {
+		off += nr;
+		if (off == bufsize - 1 &&
+		    (buf = realloc(buf, bufsize *= 2)) == NULL)
+			err(1, NULL);
+	}
+	close(fd);
+	if (nr == -1) {
+		free(buf);
+		return NULL;
+	}
+	buf[off] = '\0';
+	return buf;
+}
+
+/*
+ * Returns the CPU seconds the proxy reports, or -1.
+ */
+static double
+proxy_cpu(const struct sockaddr_in *admin)
+{
+	char *text, *s;
+	double cpu = -1;
+
+	if ((text = admin_get(admin, "/metrics")) == NULL)
+		return -1;
+	if ((s = strstr(text, "\nprocess_cpu_seconds_total ")) != NULL)
+		cpu = strtod(s + strlen("\nprocess_cpu_seconds_total "), NULL);
+	free(text);
+	return cpu;
+}
+
+static double
+cpu_self(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+	    (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static void
+print_latency(const char *indent, const struct hist *h)
+{
+	printf("%s\"latency_ms\": {\"p50\": %.3f, \"p99\": %.3f, "
+	    "\"p999\": %.3f, \"max\": %.3f, \"mean\": %.3f}",
+	    indent, hist_percentile(h, 0.5) / 1e3,
+	    hist_percentile(h, 0.99) / 1e3, hist_percentile(h, 0.999) / 1e3,
+	    h->max / 1e3, hist_mean(h) / 1e3);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static struct hist latency[NKINDS], all;
+	struct sockaddr_in admin;
+	struct timespec t0, t1;
+	struct worker *w;
+	unsigned long requests[NKINDS], errors[NKINDS], total;
+	unsigned long long bytes;
+	double secs, cpu0, cpu1, proxy0, proxy1;
+	char mix[] = "connect=40,get=40,held=10,denied=10", *s;
+	int nworker = 8, duration = 10, ch, i, k;
+
+	parse_addr("127.0.0.1:8081", &proxy);
+	parse_addr("127.0.0.1:8080", &admin);
+	parse_mix(mix);
+	while ((ch = getopt(argc, argv, "A:c:d:m:p:s:w:")) != -1) {
+		switch (ch) {
+		case 'A':
+			parse_addr(optarg, &admin);
+			break;
+		case 'c':
+			if ((nworker = atoi(optarg)) <= 0)
+				usage();
+			break;
+		case 'd':
+			if ((duration = atoi(optarg)) <= 0)
+				usage();
+			break;
+		case 'm':
+			parse_mix(optarg);
+			break;
+		case 'p':
+			parse_addr(optarg, &proxy);
+			break;
+		case 's':
+			if ((size = strtol(optarg, NULL, 10)) < 0)
+				usage();
+			break;
+		case 'w':
+			if ((hold_msec = atoi(optarg)) <= 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc != optind)
+		usage();
+
+	signal(SIGPIPE, SIG_IGN);
+	if ((s = admin_get(&admin, "/authorize/" ORIGIN_HOST ":80")) == NULL)
+		warnx("admin server not answering, targets not authorized");
+	free(s);
+	free(admin_get(&admin, "/authorize/" ECHO_HOST ":443"));
+	free(admin_get(&admin, "/unauthorize/" DENIED_HOST ":80"));
+
+	if ((w = calloc(nworker, sizeof(*w))) == NULL)
+		err(1, NULL);
+	proxy0 = proxy_cpu(&admin);
+	cpu0 = cpu_self();
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	deadline = t0;
+	deadline.tv_sec += duration;
+	for (i = 0; i < nworker; i++) {
+		w[i].id = i;
+		w[i].rand = 0x9e3779b97f4a7c15ULL * (i + 1);
+		if ((errno = pthread_create(&w[i].tid, NULL, worker,
+		    &w[i])) != 0)
+			err(1, "pthread_create");
+	}
+	for (i = 0; i < nworker; i++)
+		pthread_join(w[i].tid, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	cpu1 = cpu_self();
+	proxy1 = proxy_cpu(&admin);
+
+	secs = hist_usec(&t0, &t1) / 1e6;
+	memset(requests, 0, sizeof(requests));
+	memset(errors, 0, sizeof(errors));
+	bytes = 0;
+	for (i = 0; i < nworker; i++) {
+		for (k = 0; k < NKINDS; k++) {
+			requests[k] += w[i].requests[k];
+			errors[k] += w[i].errors[k];
+			hist_merge(&latency[k], &w[i].latency[k]);
+			if (k != KIND_HELD)
+				hist_merge(&all, &w[i].latency[k]);
+		}
+		bytes += w[i].bytes;
+	}
+	for (total = 0, k = 0; k < NKINDS; k++)
+		total += requests[k];
+
+	printf("{\n  \"duration_s\": %.3f,\n  \"connections\": %d,\n"
+	    "  \"size\": %ld,\n", secs, nworker, size);
+	printf("  \"requests\": %lu,\n  \"errors\": %lu,\n",
+	    total, errors[0] + errors[1] + errors[2] + errors[3]);
+	printf("  \"requests_per_s\": %.1f,\n  \"gbit_per_s\": %.4f,\n",
+	    total / secs, bytes * 8 / secs / 1e9);
+	print_latency("  ", &all);
+	printf(",\n  \"cpu_us_per_request\": {\"loadgen\": %.2f, "
+	    "\"proxy\": ", total > 0 ? (cpu1 - cpu0) * 1e6 / total : 0);
+	if (proxy0 >= 0 && proxy1 >= 0 && total > 0)
+		printf("%.2f},\n", (proxy1 - proxy0) * 1e6 / total);
+	else
+		printf("null},\n");
+	printf("  \"kinds\": {\n");
+	for (k = 0; k < NKINDS; k++) {
+		printf("    \"%s\": {\"weight\": %u, \"requests\": %lu, "
+		    "\"errors\": %lu,\n", kind_name[k], weight[k],
+		    requests[k], errors[k]);
+		print_latency("      ", &latency[k]);
+		printf("}%s\n", k < NKINDS - 1 ? "," : "");
+	}
+	printf("  }\n}\n");
+
+	free(w);
+	return 0;
+}
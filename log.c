@@ -0,0 +1,271 @@
+#include "log.h"
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <err.h>
+
+/*
+ * Messages from the event loop go into a ring of fixed size lines and
+ * are written out by a thread of their own, so the loop never waits on
+ * the syslog socket or the disk. The event loop is the only producer
+ * and the drainer thread the only consumer: each moves its own index
+ * and reads the other's, so neither takes a lock. When the ring is full
+ * the message is dropped and counted, and the drainer reports the
+ * count.
+ *
+ * Messages above the level are thrown away before being formatted.
+ * Other threads and forked children must use syslog(3) directly, and so
+ * does everything before log_init().
+ */
+
+struct entry
+{
+	struct timespec ts;
+	int priority;
+	char line[LOG_LINE_MAX];
+};
+
+static struct entry _ring[LOG_RING_SLOTS];
+static unsigned long _head;	/* Next slot to fill, moved by the loop */
+static unsigned long _tail;	/* Next slot to drain, moved by the drainer */
+static unsigned long _dropped;
+static unsigned long _written;
+
+static int _level = LOG_INFO;
+static int _running;
+static pid_t _pid;
+static FILE *_fp;		/* NULL for syslog */
+static pthread_mutex_t _drain_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static const struct
+{
+	const char *name;
+	int level;
+} _levels[] = {
+	{ "emerg", LOG_EMERG },
+	{ "alert", LOG_ALERT },
+	{ "crit", LOG_CRIT },
+	{ "err", LOG_ERR },
+	{ "warning", LOG_WARNING },
+	{ "notice", LOG_NOTICE },
+	{ "info", LOG_INFO },
+	{ "debug", LOG_DEBUG },
+};
+
+static void *_drain_thread(void *);
+static int   _drain(void);
+static void  _write(struct entry *);
+
+/*
+ * Starts the drainer, writing to file if given and to syslog otherwise.
+ */
+void
+log_init(const char *file)
+{
+	sigset_t set, oset;
+	pthread_t tid;
+	int error;
+
+	if (file != NULL && (_fp = fopen(file, "a")) == NULL)
+		err(1, "%s", file);
+
+	/*
+	 * The drainer never takes SIGPROF, which the profiler only
+	 * handles on the event loop's stack.
+	 */
+	sigemptyset(&set);
+	sigaddset(&set, SIGPROF);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+	_pid = getpid();
+	error = pthread_create(&tid, NULL, _drain_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	if (error != 0)
+		errx(1, "log_init: pthread_create: %s", strerror(error));
+	_running = 1;
+	atexit(log_flush);
+}
+
+/*
+ * Writes out what is in the ring.
+ */
+void
+log_flush(void)
+{
+	if (!_running || getpid() != _pid)
+		return;
+
+	pthread_mutex_lock(&_drain_mtx);
+	_drain();
+	pthread_mutex_unlock(&_drain_mtx);
+}
+
+void
+log_msg(int priority, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	log_vmsg(priority, NULL, fmt, ap);
+	va_end(ap);
+}
+
+/*
+ * Queues a message, after prefix if not NULL. Long messages are cut
+ * short with "...".
+ */
+void
+log_vmsg(int priority, const char *prefix, const char *fmt, va_list ap)
+{
+	struct entry *e;
+	unsigned long head;
+	size_t len;
+
+	if (priority > __atomic_load_n(&_level, __ATOMIC_RELAXED))
+		return;
+
+	if (!_running) {
+		if (prefix != NULL) {
+			char line[LOG_LINE_MAX];
+
+			vsnprintf(line, sizeof(line), fmt, ap);
+			syslog(priority, "%s%s", prefix, line);
+		} else
+			vsyslog(priority, fmt, ap);
+		return;
+	}
+
+	head = _head;
+	if (head - __atomic_load_n(&_tail, __ATOMIC_ACQUIRE) ==
+	    LOG_RING_SLOTS) {
+		__atomic_add_fetch(&_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	e = &_ring[head % LOG_RING_SLOTS];
+	clock_gettime(CLOCK_REALTIME, &e->ts);
+	e->priority = priority;
+	len = 0;
+	if (prefix != NULL)
+		len = strlcpy(e->line, prefix, sizeof(e->line));
+	if (len < sizeof(e->line) &&
+	    vsnprintf(e->line + len, sizeof(e->line) - len, fmt, ap) >=
+	    (int) (sizeof(e->line) - len))
+		len = sizeof(e->line);
+	if (len >= sizeof(e->line))
+		memcpy(e->line + sizeof(e->line) - 4, "...", 4);
+
+	__atomic_store_n(&_head, head + 1, __ATOMIC_RELEASE);
+}
+
+int
+log_level(void)
+{
+	return __atomic_load_n(&_level, __ATOMIC_RELAXED);
+}
+
+void
+log_set_level(int level)
+{
+	__atomic_store_n(&_level, level, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns the level called name, as in syslog.conf(5), or -1.
+ */
+int
+log_level_from_name(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(_levels) / sizeof(_levels[0]); i++)
+		if (strcasecmp(name, _levels[i].name) == 0)
+			return _levels[i].level;
+	return -1;
+}
+
+void
+log_get_stats(struct log_stats *stats)
+{
+	stats->written = __atomic_load_n(&_written, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&_dropped, __ATOMIC_RELAXED);
+}
+
+static void *
+_drain_thread(void *arg)
+{
+	struct timespec ts;
+	int n;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = LOG_DRAIN_MSEC * 1000000L;
+
+	for (;;) {
+		pthread_mutex_lock(&_drain_mtx);
+		n = _drain();
+		pthread_mutex_unlock(&_drain_mtx);
+		if (n == 0)
+			nanosleep(&ts, NULL);
+	}
+
+	return NULL;
+}
+
+/*
+ * Writes out every message queued so far, as one batch, and how many
+ * were dropped since the last time. Returns how many were written.
+ * Called with _drain_mtx held.
+ */
+static int
+_drain(void)
+{
+	static unsigned long reported;
+	struct entry *e, note;
+	unsigned long head, tail, dropped;
+	int n;
+
+	head = __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+	for (tail = _tail, n = 0; tail != head; tail++, n++) {
+		e = &_ring[tail % LOG_RING_SLOTS];
+		_write(e);
+		__atomic_store_n(&_tail, tail + 1, __ATOMIC_RELEASE);
+	}
+
+	dropped = __atomic_load_n(&_dropped, __ATOMIC_RELAXED);
+	if (dropped != reported) {
+		clock_gettime(CLOCK_REALTIME, &note.ts);
+		note.priority = LOG_WARNING;
+		snprintf(note.line, sizeof(note.line),
+		    "log: %lu messages dropped", dropped - reported);
+		_write(&note);
+		reported = dropped;
+	}
+
+	if (_fp != NULL)
+		fflush(_fp);
+	__atomic_add_fetch(&_written, n, __ATOMIC_RELAXED);
+
+	return n;
+}
+
+static void
+_write(struct entry *e)
+{
+	char datebuf[32];
+	struct tm tm;
+
+	if (_fp == NULL) {
+		syslog(e->priority, "%s", e->line);
+		return;
+	}
+	localtime_r(&e->ts.tv_sec, &tm);
+	strftime(datebuf, sizeof(datebuf), "%b %e %T", &tm);
+	fprintf(_fp, "%s.%03ld %s\n", datebuf, e->ts.tv_nsec / 1000000,
+	    e->line);
+}
@@ -0,0 +1,25 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdarg.h>
+
+struct log_stats
+{
+	unsigned long written;
+	unsigned long dropped;	/* Ring was full */
+};
+
+void log_init       (const char *);
+void log_flush      (void);
+
+void log_msg        (int, const char *, ...)
+                        __attribute__((format(printf, 2, 3)));
+void log_vmsg       (int, const char *, const char *, va_list);
+
+int  log_level      (void);
+void log_set_level  (int);
+int  log_level_from_name (const char *);
+
+void log_get_stats  (struct log_stats *);
+
+#endif
@@ -0,0 +1,254 @@
+#include "mem.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef MEM_DEBUG
+#include <pthread.h>
+#endif
+
+/*
+ * Precedes every block. The union keeps the memory after it aligned
+ * for any type, as malloc(3) would.
+ */
+union mem_header
+{
+	struct
+	{
+		size_t size;
+		unsigned short tag;
+		unsigned short site;	/* Index in _site, with MEM_DEBUG */
+	} h;
+	long double align;
+};
+
+/*
+ * The rules are compiled on a thread of their own, so the counters are
+ * updated atomically.
+ */
+static struct mem_stats _stats[NMEMTAGS];
+
+static const char *_tag_name[NMEMTAGS] = {
+	[MEM_CLIENT]	= "client",
+	[MEM_HOSTDB]	= "hostdb",
+	[MEM_RULES]	= "rules",
+	[MEM_DENYSET]	= "denyset",
+	[MEM_DYNSTR]	= "dynstr",
+	[MEM_ADMIN]	= "admin",
+	[MEM_DNS]	= "dns",
+	[MEM_LOG]	= "log",
+};
+
+#ifdef MEM_DEBUG
+/*
+ * Allocation sites by file and line. Slot 0 collects whatever does not
+ * fit.
+ */
+#define MEM_SITES	1024
+
+static struct mem_site _site[MEM_SITES];
+static pthread_mutex_t _site_mtx = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void *_account(void *, int, size_t, const char *, int);
+static void  _unaccount(union mem_header *);
+
+void *
+mem_malloc_site(int tag, size_t size, const char *file, int line)
+{
+	return _account(malloc(sizeof(union mem_header) + size), tag, size,
+	    file, line);
+}
+
+void *
+mem_calloc_site(int tag, size_t n, size_t size, const char *file, int line)
+{
+	if (size != 0 && n > (SIZE_MAX - sizeof(union mem_header)) / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return _account(calloc(1, sizeof(union mem_header) + n * size), tag,
+	    n * size, file, line);
+}
+
+/*
+ * Like reallocarray(3). A block keeps the tag it was allocated with.
+ */
+void *
+mem_reallocarray_site(int tag, void *p, size_t n, size_t size,
+    const char *file, int line)
+{
+	union mem_header *hdr;
+
+	if (size != 0 && n > (SIZE_MAX - sizeof(union mem_header)) / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (p == NULL)
+		return mem_malloc_site(tag, n * size, file, line);
+
+	hdr = (union mem_header *) p - 1;
+	tag = hdr->h.tag;
+	if ((hdr = realloc(hdr, sizeof(union mem_header) + n * size)) == NULL)
+		return NULL;
+	_unaccount(hdr);
+	return _account(hdr, tag, n * size, file, line);
+}
+
+char *
+mem_strdup_site(int tag, const char *s, const char *file, int line)
+{
+	size_t len;
+	char *p;
+
+	len = strlen(s) + 1;
+	if ((p = mem_malloc_site(tag, len, file, line)) != NULL)
+		memcpy(p, s, len);
+	return p;
+}
+
+void
+mem_free(void *p)
+{
+	union mem_header *hdr;
+
+	if (p == NULL)
+		return;
+	hdr = (union mem_header *) p - 1;
+	_unaccount(hdr);
+	free(hdr);
+}
+
+/*
+ * Accounts memory allocated by others, such as libraries: an allocation
+ * of delta bytes if positive, a free if negative.
+ */
+void
+mem_account(int tag, long delta)
+{
+	struct mem_stats *st = &_stats[tag];
+	size_t live, peak;
+
+	if (delta < 0) {
+		__atomic_sub_fetch(&st->live, -delta, __ATOMIC_RELAXED);
+		return;
+	}
+
+	__atomic_add_fetch(&st->allocs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&st->bytes, delta, __ATOMIC_RELAXED);
+	live = __atomic_add_fetch(&st->live, delta, __ATOMIC_RELAXED);
+	peak = __atomic_load_n(&st->peak, __ATOMIC_RELAXED);
+	while (live > peak && !__atomic_compare_exchange_n(&st->peak, &peak,
+	    live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void
+mem_get_stats(int tag, struct mem_stats *stats)
+{
+	stats->live = __atomic_load_n(&_stats[tag].live, __ATOMIC_RELAXED);
+	stats->peak = __atomic_load_n(&_stats[tag].peak, __ATOMIC_RELAXED);
+	stats->allocs = __atomic_load_n(&_stats[tag].allocs,
+	    __ATOMIC_RELAXED);
+	stats->bytes = __atomic_load_n(&_stats[tag].bytes, __ATOMIC_RELAXED);
+}
+
+const char *
+mem_tag_name(int tag)
+{
+	return tag >= 0 && tag < NMEMTAGS ? _tag_name[tag] : "unknown";
+}
+
+/*
+ * Fills sites with up to n allocation sites, the most live bytes first,
+ * and returns how many. Without MEM_DEBUG there are none.
+ */
+size_t
+mem_top_sites(struct mem_site *sites, size_t n)
+{
+#ifdef MEM_DEBUG
+	struct mem_site s;
+	size_t i, j, count;
+
+	count = 0;
+	pthread_mutex_lock(&_site_mtx);
+	for (i = 0; i < MEM_SITES; i++) {
+		if (_site[i].allocs == 0)
+			continue;
+		s = _site[i];
+		if (count == n && s.live <= sites[n - 1].live)
+			continue;
+		if (count < n)
+			count++;
+		for (j = count - 1; j > 0 && sites[j - 1].live < s.live; j--)
+			sites[j] = sites[j - 1];
+		sites[j] = s;
+	}
+	pthread_mutex_unlock(&_site_mtx);
+	return count;
+#else
+	(void) sites;
+	(void) n;
+	return 0;
+#endif
+}
+
+static void *
+_account(void *p, int tag, size_t size, const char *file, int line)
+{
+	union mem_header *hdr = p;
+#ifdef MEM_DEBUG
+	uintptr_t i, hash;
+#endif
+
+	if (hdr == NULL)
+		return NULL;
+	hdr->h.size = size;
+	hdr->h.tag = tag;
+	hdr->h.site = 0;
+	mem_account(tag, size);
+
+#ifdef MEM_DEBUG
+	/*
+	 * __FILE__ is the same string throughout a file, so the pointer
+	 * identifies it.
+	 */
+	hash = ((uintptr_t) file >> 4) * 31 + line;
+	pthread_mutex_lock(&_site_mtx);
+	for (i = 0; i < MEM_SITES; i++) {
+		hdr->h.site = 1 + (hash + i) % (MEM_SITES - 1);
+		if (_site[hdr->h.site].file == file &&
+		    _site[hdr->h.site].line == line)
+			break;
+		if (_site[hdr->h.site].file == NULL) {
+			_site[hdr->h.site].file = file;
+			_site[hdr->h.site].line = line;
+			break;
+		}
+	}
+	if (i == MEM_SITES) {
+		hdr->h.site = 0;
+		_site[0].file = "(other)";
+	}
+	_site[hdr->h.site].live += size;
+	_site[hdr->h.site].allocs++;
+	pthread_mutex_unlock(&_site_mtx);
+#else
+	(void) file;
+	(void) line;
+#endif
+
+	return hdr + 1;
+}
+
+static void
+_unaccount(union mem_header *hdr)
+{
+	mem_account(hdr->h.tag, -(long) hdr->h.size);
+#ifdef MEM_DEBUG
+	pthread_mutex_lock(&_site_mtx);
+	_site[hdr->h.site].live -= hdr->h.size;
+	pthread_mutex_unlock(&_site_mtx);
+#endif
+}
@@ -0,0 +1,74 @@
+#ifndef MEM_H
+#define MEM_H
+
+#include <stddef.h>
+
+/*
+ * Allocation wrappers that account memory to the subsystem that holds
+ * it. Memory from these is freed with mem_free() and only with it, as
+ * each block starts with a header giving its size and tag. Objects too
+ * many for a header each, such as hosts, are allocated directly and
+ * reported with mem_account().
+ *
+ * Built with -DMEM_DEBUG, every block also records the file and line
+ * it was allocated at, for mem_top_sites().
+ */
+enum mem_tag
+{
+	MEM_CLIENT,		/* struct client */
+	MEM_HOSTDB,		/* Hosts, host nodes, the table */
+	MEM_RULES,
+	MEM_DENYSET,
+	MEM_DYNSTR,		/* Buffers of every dynstr */
+	MEM_ADMIN,		/* Admin responses and their cache */
+	MEM_DNS,		/* The resolvmap */
+	MEM_LOG,
+	NMEMTAGS
+};
+
+struct mem_stats
+{
+	size_t live;			/* Bytes allocated and not freed */
+	size_t peak;			/* Most live ever */
+	unsigned long long allocs;	/* Allocations, ever */
+	unsigned long long bytes;	/* Bytes allocated, ever */
+};
+
+struct mem_site
+{
+	const char *file;
+	int line;
+	size_t live;
+	unsigned long long allocs;
+};
+
+#ifdef MEM_DEBUG
+#define MEM_SITE	__FILE__, __LINE__
+#else
+#define MEM_SITE	NULL, 0
+#endif
+
+#define mem_malloc(tag, size) \
+	mem_malloc_site((tag), (size), MEM_SITE)
+#define mem_calloc(tag, n, size) \
+	mem_calloc_site((tag), (n), (size), MEM_SITE)
+#define mem_realloc(tag, p, size) \
+	mem_reallocarray_site((tag), (p), 1, (size), MEM_SITE)
+#define mem_reallocarray(tag, p, n, size) \
+	mem_reallocarray_site((tag), (p), (n), (size), MEM_SITE)
+#define mem_strdup(tag, s) \
+	mem_strdup_site((tag), (s), MEM_SITE)
+
+void       *mem_malloc_site       (int, size_t, const char *, int);
+void       *mem_calloc_site       (int, size_t, size_t, const char *, int);
+void       *mem_reallocarray_site (int, void *, size_t, size_t,
+                                   const char *, int);
+char       *mem_strdup_site       (int, const char *, const char *, int);
+void        mem_free              (void *);
+
+void        mem_account     (int, long);
+void        mem_get_stats   (int, struct mem_stats *);
+const char *mem_tag_name    (int);
+size_t      mem_top_sites   (struct mem_site *, size_t);
+
+#endif
@@ -0,0 +1,338 @@
+#include "extern.h"
+#include "metrics.h"
+#include "client.h"
+#include "dynstr.h"
+#include "hostdb.h"
+#include "host.h"
+#include "hist.h"
+#include "log.h"
+#include "server.h"
+#include "mem.h"
+#include "rules.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Renders the state of the proxy in the Prometheus text format, for
+ * /metrics on the admin server. Every scrape gets its own buffer, so
+ * it is always rendered fresh however long other scrapes take to be
+ * written. Buffers are handed back to a few spares kept for the next
+ * ones, so once they have grown to size a scrape allocates nothing.
+ *
+ * Histograms are given with one bucket per power of two of struct hist,
+ * which is coarser than what is recorded but keeps the bucket bounds
+ * the same on every scrape.
+ */
+
+static const char *conn_states[NCONNSTATES] = {
+	[CONN_READING]		= "reading",
+	[CONN_PARKED]		= "parked",
+	[CONN_RESOLVING]	= "resolving",
+	[CONN_CONNECTING]	= "connecting",
+	[CONN_TUNNELLING]	= "tunnelling",
+	[CONN_ADMIN]		= "admin",
+};
+
+static struct dynstr *_spare[METRICS_SPARES];
+static int _nspare;
+static struct dynstr *_out;	/* Being rendered into */
+
+static void _render(struct webgw *);
+static void _head(const char *, const char *, const char *);
+static void _upstream(struct webgw *);
+static void _hist(const char *, const char *, const char *,
+                  const struct hist *, double);
+
+/*
+ * Returns a buffer with the text, or NULL if out of memory. The caller
+ * owns it until it is handed to metrics_release().
+ */
+struct dynstr *
+metrics_render(struct webgw *ctx)
+{
+	struct dynstr *d;
+
+	if (_nspare > 0)
+		d = _spare[--_nspare];
+	else if ((d = dynstr_create()) == NULL)
+		return NULL;
+
+	_out = d;
+	_render(ctx);
+	_out = NULL;
+	if (dynstr_get(d) == NULL) {
+		dynstr_free(d);
+		return NULL;
+	}
+	return d;
+}
+
+void
+metrics_release(struct dynstr *d)
+{
+	if (d == NULL)
+		return;
+	if (_nspare < METRICS_SPARES)
+		_spare[_nspare++] = d;
+	else
+		dynstr_free(d);
+}
+
+static void
+_render(struct webgw *ctx)
+{
+	struct hostdb_stats hs;
+	struct log_stats ls;
+	struct mem_stats ms;
+	struct rules_stats rs;
+	struct rusage ru;
+	int i;
+
+	dynstr_clear(_out);
+
+	_head("webgw_connections", "gauge",
+	    "Connections open, by state.");
+	for (i = 0; i < NCONNSTATES; i++)
+		dynstr_add(_out, "webgw_connections{state=\"%s\"} %d\n",
+		    conn_states[i], ctx->nconn[i]);
+	_head("webgw_connections_max", "gauge",
+	    "Connections accepted before new ones are dropped.");
+	dynstr_add(_out, "webgw_connections_max %d\n", MAX_CLIENTS);
+
+	_head("webgw_relayed_bytes_total", "counter",
+	    "Bytes relayed between clients and targets.");
+	dynstr_add(_out,
+	    "webgw_relayed_bytes_total{direction=\"upstream\"} %llu\n"
+	    "webgw_relayed_bytes_total{direction=\"downstream\"} %llu\n",
+	    ctx->bytes_upstream, ctx->bytes_downstream);
+
+	_head("webgw_denials_total", "counter",
+	    "Requests refused, by where they were caught.");
+	dynstr_add(_out,
+	    "webgw_denials_total{reason=\"denyset\"} %lu\n"
+	    "webgw_denials_total{reason=\"policy\"} %lu\n"
+	    "webgw_denials_total{reason=\"port\"} %lu\n",
+	    ctx->fastreject_total, ctx->denied_policy, ctx->denied_port);
+
+	_head("webgw_dns_failures_total", "counter",
+	    "Name lookups that failed.");
+	dynstr_add(_out, "webgw_dns_failures_total %lu\n",
+	    ctx->dns_failures);
+
+	hostdb_get_stats(ctx->hostdb, &hs);
+	_upstream(ctx);
+
+	_head("webgw_hostdb_hosts", "gauge", "Hosts in the hostdb.");
+	for (i = 0; i < HOSTDB_NSTATES; i++)
+		dynstr_add(_out, "webgw_hostdb_hosts{state=\"%s\"} %zu\n",
+		    i == HOSTDB_ACTIVE ? "active" :
+		    i == HOSTDB_AUTHORIZED ? "authorized" : "unauthorized",
+		    hostdb_count(ctx->hostdb, i));
+	_head("webgw_hostdb_bytes", "gauge",
+	    "Approximate memory used by the hostdb.");
+	dynstr_add(_out, "webgw_hostdb_bytes %zu\n", hs.bytes);
+	_head("webgw_hostdb_evictions_total", "counter",
+	    "Hosts evicted to keep the hostdb under its limit.");
+	dynstr_add(_out, "webgw_hostdb_evictions_total %lu\n",
+	    hs.evictions);
+
+	rules_get_stats(&rs);
+	_head("webgw_rules", "gauge", "Rules in the current rule set.");
+	dynstr_add(_out, "webgw_rules %zu\n", rs.nrules);
+	_head("webgw_rules_reloads_total", "counter",
+	    "Rule sets posted and compiled.");
+	dynstr_add(_out, "webgw_rules_reloads_total %lu\n", rs.reloads);
+	_head("webgw_rules_reload_seconds", "gauge",
+	    "Time from posting rules to their use, last and slowest.");
+	dynstr_add(_out,
+	    "webgw_rules_reload_seconds{reload=\"last\"} %.6f\n"
+	    "webgw_rules_reload_seconds{reload=\"max\"} %.6f\n",
+	    rs.last_reload_ms / 1000, rs.max_reload_ms / 1000);
+
+	_head("webgw_admin_cache_total", "counter",
+	    "Admin page sections served from cache, and rendered.");
+	dynstr_add(_out,
+	    "webgw_admin_cache_total{result=\"hit\"} %lu\n"
+	    "webgw_admin_cache_total{result=\"miss\"} %lu\n",
+	    ctx->admin_cache_hits, ctx->admin_cache_misses);
+
+	_head("webgw_memory_live_bytes", "gauge",
+	    "Memory held, by subsystem.");
+	for (i = 0; i < NMEMTAGS; i++) {
+		mem_get_stats(i, &ms);
+		dynstr_add(_out,
+		    "webgw_memory_live_bytes{subsystem=\"%s\"} %zu\n",
+		    mem_tag_name(i), ms.live);
+	}
+	_head("webgw_memory_peak_bytes", "gauge",
+	    "Most memory ever held, by subsystem.");
+	for (i = 0; i < NMEMTAGS; i++) {
+		mem_get_stats(i, &ms);
+		dynstr_add(_out,
+		    "webgw_memory_peak_bytes{subsystem=\"%s\"} %zu\n",
+		    mem_tag_name(i), ms.peak);
+	}
+	_head("webgw_memory_allocations_total", "counter",
+	    "Allocations, by subsystem.");
+	for (i = 0; i < NMEMTAGS; i++) {
+		mem_get_stats(i, &ms);
+		dynstr_add(_out,
+		    "webgw_memory_allocations_total{subsystem=\"%s\"} %llu\n",
+		    mem_tag_name(i), ms.allocs);
+	}
+	_head("webgw_memory_allocated_bytes_total", "counter",
+	    "Bytes allocated, by subsystem.");
+	for (i = 0; i < NMEMTAGS; i++) {
+		mem_get_stats(i, &ms);
+		dynstr_add(_out,
+		    "webgw_memory_allocated_bytes_total{subsystem=\"%s\"} "
+		    "%llu\n", mem_tag_name(i), ms.bytes);
+	}
+
+	log_get_stats(&ls);
+	_head("webgw_log_messages_total", "counter",
+	    "Log messages written, and dropped with the log ring full.");
+	dynstr_add(_out,
+	    "webgw_log_messages_total{result=\"written\"} %lu\n"
+	    "webgw_log_messages_total{result=\"dropped\"} %lu\n",
+	    ls.written, ls.dropped);
+	_head("webgw_log_level", "gauge",
+	    "Most verbose syslog priority logged.");
+	dynstr_add(_out, "webgw_log_level %d\n", log_level());
+
+	getrusage(RUSAGE_SELF, &ru);
+	_head("process_cpu_seconds_total", "counter",
+	    "User and system CPU time of all threads.");
+	dynstr_add(_out, "process_cpu_seconds_total %.6f\n",
+	    ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+	    (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6);
+
+	_head("webgw_phase_seconds", "histogram",
+	    "Time spent in each phase of a proxied connection.");
+	for (i = 0; i < NPHASES; i++)
+		if (i != PHASE_REQUEST_SIZE)
+			_hist("webgw_phase_seconds", "phase", phase_name(i),
+			    &ctx->phase[i], 1e-6);
+	_head("webgw_request_size_bytes", "histogram",
+	    "Size of requests read from clients.");
+	_hist("webgw_request_size_bytes", NULL, NULL,
+	    &ctx->phase[PHASE_REQUEST_SIZE], 1);
+
+	_head("webgw_callback_seconds", "histogram",
+	    "Time spent in each kind of event callback.");
+	for (i = 0; i < NCALLBACKS; i++)
+		_hist("webgw_callback_seconds", "callback",
+		    server_callback_name(i), &ctx->callback[i], 1e-6);
+	_head("webgw_loop_lag_seconds", "histogram",
+	    "Time to run one batch of events, which is how long an event "
+	    "arriving meanwhile waits.");
+	_hist("webgw_loop_lag_seconds", NULL, NULL, &ctx->loop_lag, 1e-6);
+	_head("webgw_loop_stalls_total", "counter",
+	    "Batches of events that took over the stall threshold.");
+	dynstr_add(_out, "webgw_loop_stalls_total %lu\n", ctx->loop_stalls);
+}
+
+/*
+ * Upstream TCP statistics: overall, and for each host with connections
+ * open, which keeps the number of series bounded by MAX_CLIENTS.
+ */
+static void
+_upstream(struct webgw *ctx)
+{
+	struct hostdb_cursor *cur;
+	struct host_tcp_stats ts;
+	struct host *h;
+	const char *name;
+	int pass;
+
+	_head("webgw_upstream_rtt_seconds", "histogram",
+	    "Round trip time to targets, sampled at connect and close.");
+	_hist("webgw_upstream_rtt_seconds", NULL, NULL, &ctx->upstream_rtt,
+	    1e-6);
+	_head("webgw_upstream_retransmits_total", "counter",
+	    "Segments retransmitted to targets, over closed connections.");
+	dynstr_add(_out, "webgw_upstream_retransmits_total %llu\n",
+	    ctx->upstream_retransmits);
+
+	for (pass = 0; pass < 3; pass++) {
+		if (pass == 0)
+			_head("webgw_host_rtt_seconds", "gauge",
+			    "Mean round trip time to an active host.");
+		else if (pass == 1)
+			_head("webgw_host_retransmits_total", "counter",
+			    "Segments retransmitted to an active host.");
+		else
+			_head("webgw_host_delivery_rate_bytes", "gauge",
+			    "Mean delivery rate to an active host.");
+
+		cur = hostdb_cursor_open(ctx->hostdb, HOSTDB_ACTIVE);
+		while ((h = hostdb_cursor_next(ctx->hostdb, cur)) != NULL) {
+			host_get_tcp_stats(h, &ts);
+			name = host_name(h);
+			if (ts.samples == 0 || strpbrk(name, "\"\\\n") != NULL)
+				continue;
+			if (pass == 0)
+				dynstr_add(_out,
+				    "webgw_host_rtt_seconds{host=\"%s:%d\"} "
+				    "%.6f\n", name, host_port(h),
+				    ts.rtt_usec / 1e6);
+			else if (pass == 1)
+				dynstr_add(_out,
+				    "webgw_host_retransmits_total"
+				    "{host=\"%s:%d\"} %llu\n", name,
+				    host_port(h), ts.retransmits);
+			else if (ts.delivery_rate > 0)
+				dynstr_add(_out,
+				    "webgw_host_delivery_rate_bytes"
+				    "{host=\"%s:%d\"} %llu\n", name,
+				    host_port(h), ts.delivery_rate);
+		}
+		hostdb_cursor_close(ctx->hostdb, cur);
+	}
+}
+
+static void
+_head(const char *name, const char *type, const char *help)
+{
+	dynstr_add(_out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name,
+	    type);
+}
+
+/*
+ * Writes the buckets, sum and count of h, labelled key=value if a key
+ * is given, and with values multiplied by scale.
+ */
+static void
+_hist(const char *name, const char *key, const char *value,
+    const struct hist *h, double scale)
+{
+	char label[64], labels[64];
+	uint64_t n;
+	size_t i;
+
+	label[0] = labels[0] = '\0';
+	if (key != NULL) {
+		snprintf(label, sizeof(label), "%s=\"%s\",", key, value);
+		snprintf(labels, sizeof(labels), "{%s=\"%s\"}", key, value);
+	}
+
+	for (i = 0, n = 0; i < HIST_NBUCKETS - 1; i++) {
+		n += h->bucket[i];
+		if ((i + 1) % HIST_SUB == 0)
+			dynstr_add(_out, "%s_bucket{%sle=\"%.9g\"} %llu\n",
+			    name, label, hist_bucket_max(i) * scale,
+			    (unsigned long long) n);
+	}
+	dynstr_add(_out,
+	    "%s_bucket{%sle=\"+Inf\"} %llu\n"
+	    "%s_sum%s %.9g\n"
+	    "%s_count%s %llu\n",
+	    name, label, (unsigned long long) h->count,
+	    name, labels, h->sum * scale,
+	    name, labels, (unsigned long long) h->count);
+}
@@ -0,0 +1,12 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+
+struct dynstr;
+struct webgw;
+
+struct dynstr *metrics_render  (struct webgw *);
+void           metrics_release (struct dynstr *);
+
+#endif
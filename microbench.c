@@ -0,0 +1,703 @@
+/*
+ * Microbenchmarks for webgw internals that can be run without the
+ * network or an event loop. Besides time per operation, most give the
+ * allocations per operation made through mem.c, which is all of them
+ * in the code measured.
+ *
+ * Usage: microbench [benchmark ...]
+ */
+
+#include "extern.h"
+#include "hostdb.h"
+#include "host.h"
+#include "http.h"
+#include "rules.h"
+#include "dynstr.h"
+#include "mem.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <err.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+static double
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static unsigned long long
+allocs(void)
+{
+	struct mem_stats ms;
+	unsigned long long n;
+	int i;
+
+	for (n = 0, i = 0; i < NMEMTAGS; i++) {
+		mem_get_stats(i, &ms);
+		n += ms.allocs;
+	}
+	return n;
+}
+
+static void
+report(const char *name, size_t n, double ms, unsigned long long nalloc,
+    size_t ops)
+{
+	printf("%-28s %10zu %12.1f ns/op %8.2f allocs/op\n", name, n,
+	    ms * 1e6 / ops, (double) nalloc / ops);
+}
+
+/*
+ * Startup cost of the host database: first from the text format (which
+ * also writes the binary snapshot), then from the snapshot alone.
+ */
+static void
+bench_hostdb_load(size_t nhosts)
+{
+	struct hostdb *hostdb;
+	char name[256];
+	double t0;
+	size_t i;
+
+	unlink("known_hosts");
+	unlink("known_hosts.db");
+	unlink("known_hosts.journal");
+	unlink("known_hosts.journal.old");
+
+	hostdb = hostdb_create();
+	for (i = 0; i < nhosts; i++) {
+		snprintf(name, sizeof(name), "h%zu.cdn%zu.example.com",
+		    i, i % 97);
+		hostdb_find(hostdb, name, (i % 2) ? 443 : 80);
+	}
+	if (hostdb_export(hostdb, "known_hosts") == -1)
+		err(1, "known_hosts");
+	hostdb_free(hostdb);
+
+	t0 = now_ms();
+	hostdb = hostdb_create();
+	hostdb_load(hostdb);
+	printf("%-28s %10zu %12.3f ms\n", "hostdb_load (text)", nhosts,
+	    now_ms() - t0);
+	hostdb_free(hostdb);
+
+	t0 = now_ms();
+	hostdb = hostdb_create();
+	hostdb_load(hostdb);
+	printf("%-28s %10zu %12.3f ms\n", "hostdb_load (snapshot)", nhosts,
+	    now_ms() - t0);
+	hostdb_free(hostdb);
+}
+
+static size_t
+heap_bytes(void)
+{
+#ifdef __GLIBC__
+	return mallinfo2().uordblks;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Memory per host for names shaped like real traffic: CDN and cloud
+ * hosts under a few shared suffixes, plus one-off tracker domains. The
+ * heap figure includes allocator overhead and is only available with
+ * glibc.
+ */
+static void
+bench_hostdb_memory(size_t nhosts)
+{
+	struct hostdb_stats hs;
+	struct hostdb *hostdb;
+	char name[256];
+	size_t i, heap;
+
+	heap = heap_bytes();
+	hostdb = hostdb_create();
+	for (i = 0; i < nhosts; i++) {
+		switch (i % 4) {
+		case 0:
+			snprintf(name, sizeof(name), "d%08zx.cloudfront.net",
+			    i * 2654435761u % 0xffffffff);
+			break;
+		case 1:
+			snprintf(name, sizeof(name),
+			    "bucket%zu.s3.eu-west-1.amazonaws.com", i);
+			break;
+		case 2:
+			snprintf(name, sizeof(name), "px%zu.tracker%zu.com",
+			    i, i % 1000);
+			break;
+		default:
+			snprintf(name, sizeof(name), "www.site%zu.example.org",
+			    i);
+			break;
+		}
+		hostdb_find(hostdb, name, 443);
+	}
+	hostdb_get_stats(hostdb, &hs);
+	heap = heap_bytes() - heap;
+
+	printf("%-28s %10zu %12.1f B/host\n", "hostdb_memory (accounted)",
+	    nhosts, (double) hs.bytes / hs.nhosts);
+	if (heap > 0)
+		printf("%-28s %10zu %12.1f B/host\n", "hostdb_memory (heap)",
+		    nhosts, (double) heap / hs.nhosts);
+	hostdb_free(hostdb);
+}
+
+/*
+ * Rules of every shape the matcher distinguishes: literal, "*suffix",
+ * "prefix*" and general globs.
+ */
+static char *
+mk_rules(size_t nrules, char ***patterns)
+{
+	struct dynstr dn = { 0 };
+	char **v, *data, *p;
+	size_t i;
+
+	for (i = 0; i < nrules; i++) {
+		switch (i % 5) {
+		case 0:
+			dynstr_add(&dn, "*.d%zu.example.com:443\n", i);
+			break;
+		case 1:
+			dynstr_add(&dn, "www.s%zu.example.org:443\n", i);
+			break;
+		case 2:
+			dynstr_add(&dn, "api%zu.example.net:*\n", i);
+			break;
+		case 3:
+			dynstr_add(&dn, "*.d%zu.example.com:*\n", i);
+			break;
+		default:
+			if (i % 50 == 4)
+				dynstr_add(&dn, "cdn%zu-?.[a-c]*.net:44?\n", i);
+			else
+				dynstr_add(&dn, "*.t%zu.example.com:80\n", i);
+			break;
+		}
+	}
+	if ((data = strdup(dynstr_get(&dn))) == NULL)
+		err(1, "mk_rules");
+	dynstr_clear(&dn);
+	mem_free(dn.buf);
+
+	/*
+	 * Same patterns in match order (newest first) for the reference
+	 * fnmatch() loop.
+	 */
+	if ((v = calloc(nrules + 1, sizeof(char *))) == NULL ||
+	    (p = strdup(data)) == NULL)
+		err(1, "mk_rules");
+	for (i = nrules; i > 0; i--) {
+		v[i - 1] = p;
+		p += strcspn(p, "\n");
+		*p++ = '\0';
+	}
+	*patterns = v;
+
+	return data;
+}
+
+static const char *
+ref_match(char **patterns, const char *host, int port)
+{
+	char hostport[1024];
+
+	snprintf(hostport, sizeof(hostport), "%s:%d", host, port);
+	for (; *patterns != NULL; patterns++)
+		if (fnmatch(*patterns, hostport, 0) != FNM_NOMATCH)
+			return *patterns;
+
+	return NULL;
+}
+
+/*
+ * rules_match() against the plain fnmatch() loop it replaced. Results
+ * are checked to be identical for every query.
+ */
+static void
+bench_rules(size_t nrules)
+{
+	static const char *fmt[] = {
+		"a.d%zu.example.com", "www.s%zu.example.org",
+		"api%zu.example.net", "x.y.d%zu.example.com",
+		"cdn%zu-x.b.net", "q.t%zu.example.com", "nomatch%zu.org"
+	};
+	static const int ports[] = { 443, 80, 8080 };
+	char **patterns, *data, host[256];
+	const char *a, *b;
+	unsigned long long a0;
+	size_t i, nq, n;
+	double t0, t_ref, t_new;
+
+	data = mk_rules(nrules, &patterns);
+	rules_load_from_data(data);
+
+	nq = 200000;
+	a0 = allocs();
+	n = nrules > 0 ? nrules : 1;
+	t_ref = t_new = 0;
+	for (i = 0; i < nq; i++) {
+		snprintf(host, sizeof(host), fmt[i % 7], (i * 7919) % n);
+
+		t0 = now_ms();
+		a = rules_match(host, ports[i % 3]);
+		t_new += now_ms() - t0;
+
+		/*
+		 * The reference loop is linear; sample it at high counts.
+		 */
+		if (nrules > 1000 && i % 100 != 0)
+			continue;
+		t0 = now_ms();
+		b = ref_match(patterns, host, ports[i % 3]);
+		t_ref += now_ms() - t0;
+
+		if ((a == NULL) != (b == NULL) ||
+		    (a != NULL && strcmp(a, b) != 0))
+			errx(1, "rules_match(%s:%d): %s, fnmatch: %s",
+			    host, ports[i % 3], a ? a : "-", b ? b : "-");
+	}
+
+	report("rules_match", nrules, t_new, allocs() - a0, nq);
+	printf("%-28s %10zu %12.1f ns/op\n", "rules_match (fnmatch loop)",
+	    nrules, t_ref * 1e6 / (nrules > 1000 ? nq / 100 : nq));
+
+	free(patterns[nrules > 0 ? nrules - 1 : 0]);
+	free(patterns);
+	free(data);
+}
+
+#define RULES_FUZZ_MAX	30	/* Rules in a random set */
+
+/*
+ * Random rule sets over the characters the glob matcher treats
+ * specially, "*", "?", "[]", "!", "-" and "\\", checked query by query
+ * against the fnmatch() loop. Exits on the first difference, with the
+ * rules that produced it.
+ */
+static void
+bench_rules_fuzz(size_t nrounds)
+{
+	static const char pchars[] = "ab.:1*?[]\\!-";
+	static const char hchars[] = "ab.:1-[";
+	struct dynstr dn = { 0 };
+	char *patterns[RULES_FUZZ_MAX + 1], pat[RULES_FUZZ_MAX][16];
+	char host[16], *data;
+	const char *a, *b;
+	size_t round, i, j, len, nq, nrules;
+	double t0;
+	int port;
+
+	srandom(1);
+	nq = 0;
+	t0 = now_ms();
+	for (round = 0; round < nrounds; round++) {
+		nrules = 1 + random() % RULES_FUZZ_MAX;
+		dynstr_clear(&dn);
+		for (i = 0; i < nrules; i++) {
+			len = random() % sizeof(pat[i]);
+			for (j = 0; j < len; j++)
+				pat[i][j] = pchars[random() %
+				    (sizeof(pchars) - 1)];
+			pat[i][len] = '\0';
+			dynstr_add(&dn, "%s%s", i > 0 ? "\n" : "", pat[i]);
+			patterns[nrules - 1 - i] = pat[i];
+		}
+		patterns[nrules] = NULL;
+		if ((data = strdup(dynstr_get(&dn))) == NULL)
+			err(1, "rules_fuzz");
+		rules_load_from_data(data);
+
+		for (i = 0; i < 200; i++, nq++) {
+			len = random() % 8;
+			for (j = 0; j < len; j++)
+				host[j] = hchars[random() %
+				    (sizeof(hchars) - 1)];
+			host[len] = '\0';
+			port = random() % 3 ? 1 : 11;
+
+			a = rules_match(host, port);
+			b = ref_match(patterns, host, port);
+			if ((a == NULL) == (b == NULL) &&
+			    (a == NULL || strcmp(a, b) == 0))
+				continue;
+			fprintf(stderr, "rules:\n%s\n", dynstr_get(&dn));
+			errx(1, "rules_match(%s:%d): %s, fnmatch: %s",
+			    host, port, a ? a : "-", b ? b : "-");
+		}
+		free(data);
+	}
+	printf("%-28s %10zu %12.1f ns/op\n", "rules_fuzz", nrounds,
+	    (now_ms() - t0) * 1e6 / nq);
+
+	dynstr_clear(&dn);
+	mem_free(dn.buf);
+}
+
+/*
+ * Requests as clients send them: a browser with a full set of headers,
+ * the CONNECT that starts every HTTPS page, and a bare API client.
+ */
+static const struct {
+	const char *name;
+	const char *text;
+} corpus[] = {
+	{ "browser",
+	    "GET http://www.example.com/news/index.html?id=42 HTTP/1.1\r\n"
+	    "Host: www.example.com\r\n"
+	    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) "
+	    "Gecko/20100101 Firefox/128.0\r\n"
+	    "Accept: text/html,application/xhtml+xml,application/xml;"
+	    "q=0.9,*/*;q=0.8\r\n"
+	    "Accept-Language: en-US,en;q=0.5\r\n"
+	    "Accept-Encoding: gzip, deflate\r\n"
+	    "Referer: http://www.example.com/\r\n"
+	    "Cookie: session=6f1c2a9e0b7d4e3f; prefs=dark; consent=1\r\n"
+	    "Connection: keep-alive\r\n"
+	    "Proxy-Connection: keep-alive\r\n"
+	    "Upgrade-Insecure-Requests: 1\r\n"
+	    "Priority: u=0, i\r\n"
+	    "\r\n" },
+	{ "connect",
+	    "CONNECT www.example.com:443 HTTP/1.1\r\n"
+	    "Host: www.example.com:443\r\n"
+	    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) "
+	    "Gecko/20100101 Firefox/128.0\r\n"
+	    "Proxy-Connection: keep-alive\r\n"
+	    "\r\n" },
+	{ "curl",
+	    "GET http://api.example.net:8080/v1/items HTTP/1.1\r\n"
+	    "Host: api.example.net:8080\r\n"
+	    "User-Agent: curl/8.5.0\r\n"
+	    "Accept: */*\r\n"
+	    "\r\n" },
+};
+
+/*
+ * parseline() splitting a request off the read buffer as the proxy
+ * does, and http_parse() on the lines it gives. The buffer is refilled
+ * for every request, which is counted in with parseline().
+ */
+static void
+bench_http_parse(const char *name, const char *text)
+{
+	static struct http_parser parser;
+	static char buf[4096], line[4096], lines[32][4096];
+	char label[64];
+	unsigned long long a0;
+	size_t i, len, nlines, nq;
+	double t0;
+	int j;
+
+	nq = 200000;
+	len = strlen(text);
+
+	a0 = allocs();
+	t0 = now_ms();
+	for (i = 0; i < nq; i++) {
+		memcpy(buf, text, len + 1);
+		while (parseline(buf, line, sizeof(line)) != (size_t) -1)
+			;
+	}
+	snprintf(label, sizeof(label), "parseline (%s)", name);
+	report(label, len, now_ms() - t0, allocs() - a0, nq);
+
+	memcpy(buf, text, len + 1);
+	for (nlines = 0; nlines < 32 &&
+	    parseline(buf, lines[nlines], sizeof(lines[0])) != (size_t) -1;
+	    nlines++)
+		;
+
+	a0 = allocs();
+	t0 = now_ms();
+	for (i = 0; i < nq; i++) {
+		parser.type = HTTP_REQUEST;
+		parser.state = HTTP_STARTLINE;
+		parser.error_state = HTTP_NO_ERROR;
+		parser.n_header = 0;
+		parser.host = parser.path = NULL;
+		parser.port = 0;
+		for (j = 0; j < nlines && parser.state != HTTP_BODY; j++)
+			http_parse(&parser, lines[j]);
+		if (parser.state != HTTP_BODY)
+			errx(1, "http_parse (%s): state %d, error %d", name,
+			    parser.state, parser.error_state);
+	}
+	snprintf(label, sizeof(label), "http_parse (%s)", name);
+	report(label, nlines, now_ms() - t0, allocs() - a0, nq);
+}
+
+#define QUERIES	4096
+
+/*
+ * hostdb_find() inserting nhosts hosts, then finding hosts already
+ * there, and host_serialize() on them, as the journal does. Names are
+ * made ahead of the clock, QUERIES at a time.
+ */
+static void
+bench_hostdb_find(size_t nhosts)
+{
+	static char names[QUERIES][64], dst[1024];
+	static struct host *hosts[QUERIES];
+	static int ports[QUERIES];
+	struct hostdb *hostdb;
+	unsigned long long a0, nalloc;
+	size_t i, j, n, nq;
+	double t0, ms;
+
+	unlink("known_hosts");
+	unlink("known_hosts.db");
+	unlink("known_hosts.journal");
+	hostdb = hostdb_create();
+
+	ms = 0;
+	a0 = allocs();
+	for (i = 0; i < nhosts; i += n) {
+		n = nhosts - i < QUERIES ? nhosts - i : QUERIES;
+		for (j = 0; j < n; j++)
+			snprintf(names[j], sizeof(names[j]),
+			    "h%zu.cdn%zu.example.com", i + j, (i + j) % 97);
+		t0 = now_ms();
+		for (j = 0; j < n; j++)
+			hostdb_find(hostdb, names[j], (i + j) % 2 ? 443 : 80);
+		ms += now_ms() - t0;
+	}
+	report("hostdb_find (insert)", nhosts, ms, allocs() - a0, nhosts);
+
+	for (j = 0; j < QUERIES; j++) {
+		i = (j * 2654435761u) % nhosts;
+		snprintf(names[j], sizeof(names[j]), "h%zu.cdn%zu.example.com",
+		    i, i % 97);
+		ports[j] = i % 2 ? 443 : 80;
+		hosts[j] = hostdb_find(hostdb, names[j], ports[j]);
+	}
+
+	nq = 1000000;
+	a0 = allocs();
+	t0 = now_ms();
+	for (i = 0; i < nq; i++) {
+		j = i % QUERIES;
+		if (hostdb_find(hostdb, names[j], ports[j]) != hosts[j])
+			errx(1, "hostdb_find(%s): another host", names[j]);
+	}
+	report("hostdb_find (hit)", nhosts, now_ms() - t0, allocs() - a0,
+	    nq);
+
+	a0 = allocs();
+	t0 = now_ms();
+	for (i = 0; i < nq; i++)
+		host_serialize(hosts[i % QUERIES], dst, sizeof(dst));
+	nalloc = allocs() - a0;
+	report("host_serialize", nhosts, now_ms() - t0, nalloc, nq);
+
+	hostdb_free(hostdb);
+}
+
+/*
+ * dynstr_add() rendering rows like those of the admin host listing,
+ * into a dynstr that is cleared and reused between pages, as the admin
+ * server does.
+ */
+static void
+bench_dynstr(size_t nrows)
+{
+	struct dynstr ds = { 0 };
+	unsigned long long a0;
+	size_t i, rep, nrep;
+	double t0;
+
+	nrep = 1000000 / nrows;
+	a0 = allocs();
+	t0 = now_ms();
+	for (rep = 0; rep < nrep; rep++) {
+		dynstr_clear(&ds);
+		for (i = 0; i < nrows; i++)
+			dynstr_add(&ds, "<tr><td>h%zu.cdn%zu.example.com:%d"
+			    "</td><td>%llu</td><td>%llu</td><td>%llu</td>"
+			    "<td>%s</td></tr>\n", i, i % 97,
+			    i % 2 ? 443 : 80, (unsigned long long) i * 3,
+			    (unsigned long long) i * 1500,
+			    (unsigned long long) i * 700,
+			    i % 3 ? "authorized" : "held");
+	}
+	if (dynstr_get(&ds) == NULL)
+		errx(1, "dynstr_add: out of memory");
+	report("dynstr_add", nrows, now_ms() - t0, allocs() - a0,
+	    nrep * nrows);
+	mem_free(ds.buf);
+}
+
+/*
+ * The error responses write_error() sends, without the write.
+ */
+static void
+bench_write_error(void)
+{
+	static const int codes[] = { 400, 403, 500, 502, 503 };
+	static const char text[] = "Proxy failed to resolve host.\r\n";
+	static char buf[4096];
+	unsigned long long a0;
+	size_t i, nq;
+	double t0;
+
+	nq = 1000000;
+	a0 = allocs();
+	t0 = now_ms();
+	for (i = 0; i < nq; i++)
+		if (http_format_error(buf, sizeof(buf), codes[i % 5], text) >=
+		    (int) sizeof(buf))
+			errx(1, "http_format_error: truncated");
+	report("write_error (format)", strlen(text), now_ms() - t0,
+	    allocs() - a0, nq);
+}
+
+static void
+run_hostdb_load(void)
+{
+	static const size_t sizes[] = { 1000, 100000, 1000000 };
+	size_t i;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		bench_hostdb_load(sizes[i]);
+}
+
+static void
+run_hostdb_memory(void)
+{
+	static const size_t sizes[] = { 1000, 100000, 1000000 };
+	size_t i;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		bench_hostdb_memory(sizes[i]);
+}
+
+static void
+run_rules_match(void)
+{
+	static const size_t sizes[] = { 10, 1000, 100000 };
+	size_t i;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		bench_rules(sizes[i]);
+}
+
+static void
+run_rules_fuzz(void)
+{
+	bench_rules_fuzz(5000);
+}
+
+static void
+run_http_parse(void)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i++)
+		bench_http_parse(corpus[i].name, corpus[i].text);
+}
+
+static void
+run_hostdb_find(void)
+{
+	static const size_t sizes[] = { 1000, 100000, 1000000 };
+	size_t i;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		bench_hostdb_find(sizes[i]);
+}
+
+static void
+run_dynstr(void)
+{
+	static const size_t sizes[] = { 100, 10000, 1000000 };
+	size_t i;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		bench_dynstr(sizes[i]);
+}
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} benchmarks[] = {
+	{ "hostdb_load", run_hostdb_load },
+	{ "hostdb_memory", run_hostdb_memory },
+	{ "rules_match", run_rules_match },
+	{ "rules_fuzz", run_rules_fuzz },
+	{ "http_parse", run_http_parse },
+	{ "hostdb_find", run_hostdb_find },
+	{ "dynstr_add", run_dynstr },
+	{ "write_error", bench_write_error },
+};
+
+static void
+usage(void)
+{
+	size_t i;
+
+	fprintf(stderr, "usage: microbench [benchmark ...]\nbenchmarks:");
+	for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++)
+		fprintf(stderr, " %s", benchmarks[i].name);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char dir[] = "/tmp/microbench.XXXXXXXXXX";
+	size_t i;
+	int ch, j;
+
+	while ((ch = getopt(argc, argv, "")) != -1)
+		usage();
+	argc -= optind;
+	argv += optind;
+
+	for (j = 0; j < argc; j++) {
+		for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]);
+		    i++)
+			if (strcmp(argv[j], benchmarks[i].name) == 0)
+				break;
+		if (i == sizeof(benchmarks) / sizeof(benchmarks[0]))
+			usage();
+	}
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	/*
+	 * hostdb works on files in the current directory.
+	 */
+	if (mkdtemp(dir) == NULL || chdir(dir) == -1)
+		err(1, "%s", dir);
+
+	for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+		for (j = 0; j < argc; j++)
+			if (strcmp(argv[j], benchmarks[i].name) == 0)
+				break;
+		if (argc == 0 || j < argc)
+			benchmarks[i].run();
+	}
+
+	unlink("known_hosts");
+	unlink("known_hosts.db");
+	unlink("known_hosts.journal");
+	rmdir(dir);
+
+	return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * Stand-in origin server for load tests. Every request is answered
+ * with a body of the size its path asks for, "/bytes/N", or else of
+ * the default size, and the connection is closed after it.
+ *
+ * Usage: origin [-a addr] [-p port] [-s size] [-t threads]
+ */
+
+#include "extern.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define ORIGIN_PORT	18080
+#define ORIGIN_SIZE	16384
+#define ORIGIN_THREADS	64
+#define ORIGIN_REQ_MAX	8192
+
+#define BAD_REQUEST \
+	"HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n"
+
+static char body[65536];
+static long default_size = ORIGIN_SIZE;
+static int serverfd;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: origin [-a addr] [-p port] [-s size] "
+	    "[-t threads]\n");
+	exit(1);
+}
+
+static int
+write_all(int fd, const char *buf, size_t n)
+{
+	ssize_t nw;
+
+	for (; n > 0; buf += nw, n -= nw)
+		if ((nw = write(fd, buf, n)) <= 0)
+			return -1;
+	return 0;
+}
+
+/*
+ * Reads the request head and answers it.
+ */
+static void
+serve(int fd)
+{
+	char req[ORIGIN_REQ_MAX], head[256], method[16], path[1024];
+	size_t off;
+	ssize_t nr;
+	long size, n;
+	int len;
+
+	for (off = 0; off < sizeof(req) - 1; off += nr) {
+		if ((nr = read(fd, req + off, sizeof(req) - 1 - off)) <= 0)
+			return;
+		req[off + nr] = '\0';
+		if (strstr(req, "\r\n\r\n") != NULL)
+			break;
+	}
+	if (sscanf(req, "%15s %1023s", method, path) != 2) {
+		write_all(fd, BAD_REQUEST, strlen(BAD_REQUEST));
+		return;
+	}
+
+	size = default_size;
+	if (strncmp(path, "/bytes/", 7) == 0)
+		size = strtol(path + 7, NULL, 10);
+	if (size < 0)
+		size = 0;
+	len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n"
+	    "Content-Type: application/octet-stream\r\n"
+	    "Content-Length: %ld\r\n"
+	    "Connection: close\r\n\r\n", size);
+	if (write_all(fd, head, len) == -1)
+		return;
+	for (; size > 0; size -= n) {
+		n = size < (long) sizeof(body) ? size : (long) sizeof(body);
+		if (write_all(fd, body, n) == -1)
+			return;
+	}
+}
+
+static void *
+worker(void *arg)
+{
+	int fd;
+
+	(void) arg;
+	for (;;) {
+		if ((fd = accept(serverfd, NULL, NULL)) == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			err(1, "accept");
+		}
+		serve(fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *addr = "127.0.0.1";
+	pthread_t tid;
+	int port = ORIGIN_PORT, nthread = ORIGIN_THREADS, ch, i;
+
+	while ((ch = getopt(argc, argv, "a:p:s:t:")) != -1) {
+		switch (ch) {
+		case 'a':
+			addr = optarg;
+			break;
+		case 'p':
+			if ((port = atoi(optarg)) <= 0)
+				usage();
+			break;
+		case 's':
+			if ((default_size = strtol(optarg, NULL, 10)) < 0)
+				usage();
+			break;
+		case 't':
+			if ((nthread = atoi(optarg)) <= 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc != optind)
+		usage();
+
+	signal(SIGPIPE, SIG_IGN);
+	memset(body, 'x', sizeof(body));
+	if ((serverfd = tcpbind(addr, port)) == -1)
+		err(1, "listening on TCP %s:%d", addr, port);
+
+	for (i = 1; i < nthread; i++)
+		if ((errno = pthread_create(&tid, NULL, worker, NULL)) != 0)
+			err(1, "pthread_create");
+	worker(NULL);
+	return 0;
+}
@@ -0,0 +1,416 @@
+#ifdef __linux__
+#define _GNU_SOURCE		/* REG_RIP, dladdr(), pthread_getattr_np() */
+#endif
+
+#include "config.h"
+#include "prof.h"
+#include "dynstr.h"
+#include "mem.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __OpenBSD__
+#include <pthread_np.h>
+#endif
+#include <ucontext.h>
+
+/*
+ * The handler only reserves a slot with an atomic add and writes into
+ * it, so it is async-signal-safe. A slot is complete once its depth is
+ * set. The buffer is static and only touched while profiling.
+ *
+ * Stacks are walked by frame pointer, hence -fno-omit-frame-pointer in
+ * the Makefile. A frame pointer that does not lead up the stack ends
+ * the walk, so a function interrupted before setting up its frame
+ * costs its caller's frame but nothing worse.
+ *
+ * Only the stack of the thread that started the profiler, the event
+ * loop, is walked, and only within its bounds; the other threads are
+ * started with SIGPROF blocked. A signal that still lands elsewhere
+ * keeps just the interrupted pc.
+ */
+
+struct prof_sample
+{
+	int depth;		/* 0 until the handler is done */
+	uintptr_t pc[PROF_DEPTH];	/* Leaf first */
+};
+
+static struct prof_sample _samples[PROF_SAMPLES];
+static unsigned long _count;	/* Slots reserved, may pass PROF_SAMPLES */
+static int _running;
+static int _hz;
+static uintptr_t _stack_lo;	/* Of the thread walked, 0 if unknown */
+static uintptr_t _stack_hi;
+
+/*
+ * A stack as named, with the samples that had it.
+ */
+struct prof_line
+{
+	char *text;
+	unsigned long count;
+};
+
+/*
+ * Folding in progress. Distinct stacks are named a few at a time, and
+ * the named ones merged and written out once all are.
+ */
+struct prof_render
+{
+	struct prof_sample **v;		/* Sorted by stack */
+	unsigned long n;
+	unsigned long next;		/* First sample not yet named */
+	struct prof_line *line;
+	unsigned long nline;
+	unsigned long emit;		/* First line not yet written */
+	struct dynstr *name;
+};
+
+static void _handler(int, siginfo_t *, void *);
+static void _context(void *, uintptr_t *, uintptr_t *, uintptr_t *);
+static void _stack_bounds(void);
+static int  _sample_cmp(const void *, const void *);
+static int  _line_cmp(const void *, const void *);
+static void _frame(struct dynstr *, uintptr_t, int, int);
+
+/*
+ * Discards the samples so far and samples hz times a second of CPU
+ * time, walking the stack of the calling thread. Returns -1 if the
+ * timer or handler cannot be set up.
+ */
+int
+prof_start(int hz)
+{
+	struct sigaction sa;
+	struct itimerval it;
+
+	if (hz <= 0 || hz > 1000)
+		hz = PROF_HZ;
+
+	prof_stop();
+	memset(_samples, 0, sizeof(_samples));
+	_count = 0;
+	_stack_bounds();
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = _handler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGPROF, &sa, NULL) == -1)
+		return -1;
+
+	_hz = hz;
+	__atomic_store_n(&_running, 1, __ATOMIC_SEQ_CST);
+
+	it.it_interval.tv_sec = 0;
+	it.it_interval.tv_usec = 1000000 / hz;
+	it.it_value = it.it_interval;
+	if (setitimer(ITIMER_PROF, &it, NULL) == -1) {
+		__atomic_store_n(&_running, 0, __ATOMIC_SEQ_CST);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Stops sampling, keeping the samples. A signal already on its way is
+ * ignored by the handler.
+ */
+void
+prof_stop(void)
+{
+	struct itimerval it;
+
+	memset(&it, 0, sizeof(it));
+	setitimer(ITIMER_PROF, &it, NULL);
+	__atomic_store_n(&_running, 0, __ATOMIC_SEQ_CST);
+}
+
+void
+prof_get_stats(struct prof_stats *stats)
+{
+	unsigned long count;
+
+	count = __atomic_load_n(&_count, __ATOMIC_ACQUIRE);
+	stats->running = __atomic_load_n(&_running, __ATOMIC_RELAXED);
+	stats->hz = _hz;
+	stats->samples = count < PROF_SAMPLES ? count : PROF_SAMPLES;
+	stats->dropped = count - stats->samples;
+}
+
+/*
+ * Starts folding the samples so far into stacks, or returns NULL if out
+ * of memory. Identical stacks are merged before they are named, so
+ * dladdr(3) runs once per distinct stack, and again after, as stacks
+ * that differ only in where in a function they were interrupted have
+ * the same name. Functions that are not exported are given as
+ * object+offset, for addr2line(1).
+ *
+ * Restarting the profiler before the folding is done mixes the runs.
+ */
+struct prof_render *
+prof_render_begin(void)
+{
+	struct prof_render *self;
+	unsigned long count, i;
+
+	count = __atomic_load_n(&_count, __ATOMIC_ACQUIRE);
+	if (count > PROF_SAMPLES)
+		count = PROF_SAMPLES;
+
+	if ((self = mem_calloc(MEM_ADMIN, 1, sizeof(*self))) == NULL)
+		return NULL;
+	self->v = mem_reallocarray(MEM_ADMIN, NULL, count + 1,
+	    sizeof(*self->v));
+	self->line = mem_reallocarray(MEM_ADMIN, NULL, count + 1,
+	    sizeof(*self->line));
+	self->name = dynstr_create();
+	if (self->v == NULL || self->line == NULL || self->name == NULL) {
+		prof_render_free(self);
+		return NULL;
+	}
+	for (i = 0; i < count; i++)
+		if (__atomic_load_n(&_samples[i].depth, __ATOMIC_ACQUIRE) > 0)
+			self->v[self->n++] = &_samples[i];
+	qsort(self->v, self->n, sizeof(*self->v), _sample_cmp);
+
+	return self;
+}
+
+/*
+ * Names up to PROF_RENDER_STEP distinct stacks or, once all are named,
+ * appends up to as many folded lines to out. Returns 1 while there is
+ * more to do, 0 when done, and -1 if out of memory.
+ */
+int
+prof_render_step(struct prof_render *self, struct dynstr *out)
+{
+	unsigned long i, j, left;
+	const char *s;
+	int k;
+
+	for (left = PROF_RENDER_STEP; left > 0 && self->next < self->n;
+	    left--) {
+		i = self->next;
+		for (j = i + 1; j < self->n &&
+		    _sample_cmp(&self->v[i], &self->v[j]) == 0; j++)
+			;
+		dynstr_clear(self->name);
+		for (k = self->v[i]->depth - 1; k >= 0; k--)
+			_frame(self->name, self->v[i]->pc[k], k > 0, k > 0);
+		if ((s = dynstr_get(self->name)) == NULL ||
+		    (self->line[self->nline].text = mem_strdup(MEM_ADMIN,
+		    s)) == NULL)
+			return -1;
+		self->line[self->nline++].count = j - i;
+		self->next = j;
+		if (self->next == self->n)
+			qsort(self->line, self->nline, sizeof(*self->line),
+			    _line_cmp);
+	}
+
+	for (; left > 0 && self->emit < self->nline &&
+	    self->next == self->n; left--) {
+		i = self->emit;
+		for (j = i + 1; j < self->nline &&
+		    strcmp(self->line[i].text, self->line[j].text) == 0; j++)
+			self->line[i].count += self->line[j].count;
+		dynstr_add(out, "%s %lu\n", self->line[i].text,
+		    self->line[i].count);
+		self->emit = j;
+	}
+
+	return self->next < self->n || self->emit < self->nline;
+}
+
+void
+prof_render_free(struct prof_render *self)
+{
+	unsigned long i;
+
+	if (self == NULL)
+		return;
+	for (i = 0; i < self->nline; i++)
+		mem_free(self->line[i].text);
+	mem_free(self->line);
+	mem_free(self->v);
+	dynstr_free(self->name);
+	mem_free(self);
+}
+
+static void
+_handler(int sig, siginfo_t *si, void *uc)
+{
+	struct prof_sample *s;
+	uintptr_t pc, fp, sp, next, ret;
+	unsigned long i;
+	int n, saved_errno;
+
+	(void) sig;
+	(void) si;
+
+	if (!__atomic_load_n(&_running, __ATOMIC_RELAXED))
+		return;
+	i = __atomic_fetch_add(&_count, 1, __ATOMIC_RELAXED);
+	if (i >= PROF_SAMPLES)
+		return;
+	saved_errno = errno;
+
+	s = &_samples[i];
+	_context(uc, &pc, &fp, &sp);
+	n = 0;
+	if (pc != 0)
+		s->pc[n++] = pc;
+	if (sp < _stack_lo || sp >= _stack_hi)
+		fp = 0;
+	while (n < PROF_DEPTH && fp >= sp &&
+	    fp < _stack_hi - 2 * sizeof(uintptr_t) &&
+	    fp % sizeof(uintptr_t) == 0) {
+		next = ((uintptr_t *) fp)[0];
+		ret = ((uintptr_t *) fp)[1];
+		if (ret == 0)
+			break;
+		s->pc[n++] = ret;
+		if (next <= fp)
+			break;
+		fp = next;
+	}
+	if (n == 0)
+		s->pc[n++] = 0;
+	__atomic_store_n(&s->depth, n, __ATOMIC_RELEASE);
+
+	errno = saved_errno;
+}
+
+/*
+ * The program counter, frame pointer and stack pointer of the
+ * interrupted code. Where the layout of the context is not known, the
+ * walk starts from the handler itself and pc is 0.
+ */
+static void
+_context(void *arg, uintptr_t *pc, uintptr_t *fp, uintptr_t *sp)
+{
+#if defined(__linux__) && defined(__x86_64__)
+	ucontext_t *uc = arg;
+
+	*pc = uc->uc_mcontext.gregs[REG_RIP];
+	*fp = uc->uc_mcontext.gregs[REG_RBP];
+	*sp = uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__linux__) && defined(__aarch64__)
+	ucontext_t *uc = arg;
+
+	*pc = uc->uc_mcontext.pc;
+	*fp = uc->uc_mcontext.regs[29];
+	*sp = uc->uc_mcontext.sp;
+#elif defined(__OpenBSD__) && defined(__amd64__)
+	ucontext_t *uc = arg;
+
+	*pc = uc->sc_rip;
+	*fp = uc->sc_rbp;
+	*sp = uc->sc_rsp;
+#elif defined(__OpenBSD__) && defined(__aarch64__)
+	ucontext_t *uc = arg;
+
+	*pc = uc->sc_elr;
+	*fp = uc->sc_x[29];
+	*sp = uc->sc_sp;
+#else
+	(void) arg;
+	*pc = 0;
+	*fp = (uintptr_t) __builtin_frame_address(0);
+	*sp = *fp;
+#endif
+}
+
+/*
+ * Finds the stack of the calling thread, leaving the bounds at 0 where
+ * they cannot be found, so that nothing is walked.
+ */
+static void
+_stack_bounds(void)
+{
+#if defined(__linux__)
+	pthread_attr_t attr;
+	void *addr;
+	size_t size;
+
+	_stack_lo = _stack_hi = 0;
+	if (pthread_getattr_np(pthread_self(), &attr) != 0)
+		return;
+	if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+		_stack_lo = (uintptr_t) addr;
+		_stack_hi = (uintptr_t) addr + size;
+	}
+	pthread_attr_destroy(&attr);
+#elif defined(__OpenBSD__)
+	stack_t ss;
+
+	_stack_lo = _stack_hi = 0;
+	if (pthread_stackseg_np(pthread_self(), &ss) == 0) {
+		_stack_hi = (uintptr_t) ss.ss_sp;
+		_stack_lo = _stack_hi - ss.ss_size;
+	}
+#else
+	_stack_lo = _stack_hi = 0;
+#endif
+}
+
+static int
+_sample_cmp(const void *a, const void *b)
+{
+	const struct prof_sample *x = *(struct prof_sample * const *) a;
+	const struct prof_sample *y = *(struct prof_sample * const *) b;
+	int i;
+
+	if (x->depth != y->depth)
+		return x->depth < y->depth ? -1 : 1;
+	for (i = 0; i < x->depth; i++)
+		if (x->pc[i] != y->pc[i])
+			return x->pc[i] < y->pc[i] ? -1 : 1;
+	return 0;
+}
+
+static int
+_line_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct prof_line *) a)->text,
+	    ((const struct prof_line *) b)->text);
+}
+
+/*
+ * Names the frame at pc, in ds, followed by a ';' if more are to
+ * come. Return addresses point past the call, so all but the leaf are
+ * looked up one byte back, inside it.
+ */
+static void
+_frame(struct dynstr *ds, uintptr_t pc, int caller, int more)
+{
+	Dl_info info;
+	const char *obj;
+
+	if (caller)
+		pc--;
+	if (pc == 0 || pc == (uintptr_t) -1)
+		dynstr_add(ds, "[unknown]");
+	else if (dladdr((void *) pc, &info) == 0)
+		dynstr_add(ds, "0x%lx", (unsigned long) pc);
+	else if (info.dli_sname != NULL)
+		dynstr_add(ds, "%s", info.dli_sname);
+	else {
+		obj = info.dli_fname != NULL ? info.dli_fname : "?";
+		if (strrchr(obj, '/') != NULL)
+			obj = strrchr(obj, '/') + 1;
+		dynstr_add(ds, "%s+0x%lx", obj,
+		    (unsigned long) (pc - (uintptr_t) info.dli_fbase));
+	}
+	if (more)
+		dynstr_add(ds, ";");
+}
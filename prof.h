@@ -0,0 +1,34 @@
+#ifndef PROF_H
+#define PROF_H
+
+#include <stddef.h>
+
+/*
+ * Sampling profiler. While running, SIGPROF arrives hz times a second
+ * of CPU time and its handler copies the interrupted stack, by its
+ * frame pointers, into a buffer set aside for it. prof_render_step()
+ * folds the stacks, a few at a time, into the "frame;frame;leaf count"
+ * lines flame graph tools read.
+ */
+
+struct dynstr;
+struct prof_render;
+
+struct prof_stats
+{
+	int running;
+	int hz;
+	unsigned long samples;		/* Kept since the last start */
+	unsigned long dropped;		/* With the buffer full */
+};
+
+int         prof_start     (int);
+void        prof_stop      (void);
+void        prof_get_stats (struct prof_stats *);
+
+struct prof_render
+           *prof_render_begin (void);
+int         prof_render_step  (struct prof_render *, struct dynstr *);
+void        prof_render_free  (struct prof_render *);
+
+#endif
@@ -28,12 +28,19 @@
 #include "host.h"
 #include "rules.h"
 #include "client.h"
+#include "http.h"
+#include "log.h"
+#include "trace.h"
+#include "resolvmap.h"
 
 static void			 readclient(struct webgw *, struct client *);
 static void			 resolv(struct webgw *, struct client *);
+static void			 connect_target(struct webgw *, struct client *,
+				    const struct sockaddr_in *);
 static void			 readtarget(struct webgw *, struct client *);
 static void			 reprocess_body(struct webgw *,
 				    struct client *);
+static void			 fast_reject(struct webgw *, struct client *);
 static void			 dotimer(struct webgw *, struct client *);
 static void			 connect_completed(struct webgw *,
 				    struct client *);
@@ -77,6 +84,9 @@ initclient(struct client *client, int fd, struct webgw *ctx)
 	client->fd = fd;
 	client->targetfd = -1;
 	client->request_size = 0;
+	client->state = CONN_READING;
+	ctx->nconn[CONN_READING]++;
+	client->sampled = trace_sample();
 	client->parser.n_header = 0;
 
 	clock_gettime(CLOCK_MONOTONIC, &client->ts_begin);
@@ -91,20 +101,27 @@ initclient(struct client *client, int fd, struct webgw *ctx)
 
 	client->clientcallback.client = client;
 	client->clientcallback.readfunc = readclient;
+	client->clientcallback.readkind = CB_READCLIENT;
 
 	client->targetcallback.client = client;
 	client->targetcallback.readfunc = readtarget;
 	client->targetcallback.writefunc = connect_completed;
+	client->targetcallback.readkind = CB_READTARGET;
+	client->targetcallback.writekind = CB_CONNECT;
 
 	client->resolvcallback.client = client;
 	client->resolvcallback.readfunc = resolv;
 	client->resolvcallback.writefunc = resolv;
+	client->resolvcallback.readkind = CB_RESOLV;
+	client->resolvcallback.writekind = CB_RESOLV;
 
 	client->timercallback.client = client;
 	client->timercallback.readfunc = dotimer;
+	client->timercallback.readkind = CB_TIMEOUT;
 
 	client->reprocesscallback.client = client;
 	client->reprocesscallback.readfunc = reprocess_body;
+	client->reprocesscallback.readkind = CB_REPROCESS;
 
 	EV_SET(&changelist[0], client->fd,
 	    EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0,
@@ -126,6 +143,17 @@ initclient(struct client *client, int fd, struct webgw *ctx)
 static void
 client_resolve(struct webgw *ctx, struct client *client, const char *host)
 {
+	struct sockaddr_in sa;
+
+	client_set_state(ctx, client, CONN_RESOLVING);
+	clock_gettime(CLOCK_MONOTONIC, &client->ts_resolve);
+	if (ctx->resolvmap != NULL && resolvmap_lookup(ctx->resolvmap, host,
+	    client->parser.port, &sa) == 0) {
+		client->ts_resolved = client->ts_resolve;
+		hist_record(&ctx->phase[PHASE_DNS], 0);
+		connect_target(ctx, client, &sa);
+		return;
+	}
 	client->asr_query = gethostbyname_async(host, NULL);
 
 	resolv(ctx, client);
@@ -149,7 +177,7 @@ write_header(struct webgw *ctx, struct client *client,
 
 	len = snprintf(line, sizeof(line), "%s: %s\r\n",
 	    key, value);
-	clientlog(client, LOG_INFO, "write header %s", line);
+	clientlog(client, LOG_DEBUG, "write header %s", line);
 	if (len >= sizeof(line)) {
 		clientlog(client, LOG_ERR, "truncated header line");
 		write_error(client->fd, HTTP_STATUS_INTERNAL_ERROR,
@@ -165,6 +193,7 @@ write_header(struct webgw *ctx, struct client *client,
 		removeclient(ctx, client);
 		return -1;
 	}
+	host_add_tx_bytes(client->target_host, len);
 	return 0;
 }
 
@@ -189,8 +218,12 @@ connect_completed(struct webgw *ctx, struct client *client)
 	clientlog(client, LOG_INFO, "connected %s:%d via %s",
 	    client->parser.host, client->parser.port, client->parser.method);
 	clock_gettime(CLOCK_MONOTONIC, &client->ts_connect);
+	hist_record(&ctx->phase[PHASE_CONNECT],
+	    hist_usec(&client->ts_resolved, &client->ts_connect));
+	client_sample_target(ctx, client, 0);
 
 	client->targetconnected = 1;
+	client_set_state(ctx, client, CONN_TUNNELLING);
 
 	if (fcntl(client->targetfd, F_SETFL, 0) == -1) {
 		clientlog(client, LOG_ERR, "fcntl: %s", strerror(errno));
@@ -217,6 +250,7 @@ connect_completed(struct webgw *ctx, struct client *client)
 			removeclient(ctx, client);
 			return;
 		}
+		host_add_tx_bytes(client->target_host, len);
 		/*
 		 * Write headers.
 		 */
@@ -241,6 +275,8 @@ connect_completed(struct webgw *ctx, struct client *client)
 			removeclient(ctx, client);
 			return;
 		}
+		host_add_tx_bytes(client->target_host, 2);
+		hostdb_touch(ctx->hostdb, client->target_host);
 	} else {
 		for (i = 0; i < client->parser.n_header; i++) {
 			if (strcasecmp(client->parser.header[i].key,
@@ -274,10 +310,6 @@ resolv(struct webgw *ctx, struct client *client)
 	struct asr_result r;
 	struct kevent changelist;
 	struct hostent *h;
-	struct timespec tv_before, tv_after;
-	int usec;
-
-	clock_gettime(CLOCK_MONOTONIC, &tv_before);
 
 	if (asr_run(client->asr_query, &r) == 0) {
 		if (r.ar_cond == ASR_WANT_READ)
@@ -296,8 +328,12 @@ resolv(struct webgw *ctx, struct client *client)
 		struct sockaddr_in sa;
 
 		client->asr_query = NULL;
+		clock_gettime(CLOCK_MONOTONIC, &client->ts_resolved);
+		hist_record(&ctx->phase[PHASE_DNS],
+		    hist_usec(&client->ts_resolve, &client->ts_resolved));
 
 		if (r.ar_h_errno != 0 || r.ar_hostent == NULL) {
+			ctx->dns_failures++;
 			clientlog(client, LOG_WARNING, "resolv %s: %s",
 			    client->parser.host, hstrerror(r.ar_h_errno));
 			write_error(client->fd, HTTP_STATUS_SERVICE_UNAVAILABLE,
@@ -318,53 +354,57 @@ resolv(struct webgw *ctx, struct client *client)
 		    inet_ntoa(*((struct in_addr *)h->h_addr)));
 #endif
 
-		if ((client->targetfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-			clientlog(client, LOG_ERR, "socket: %s",
-			    strerror(errno));
-			write_error(client->fd, HTTP_STATUS_INTERNAL_ERROR,
-			    "Failed to create socket for connection.\r\n");
-			removeclient(ctx, client);
-			return;
-		}
+		connect_target(ctx, client, &sa);
+	}
+}
 
-		if (fcntl(client->targetfd, F_SETFL, O_NONBLOCK) == -1) {
-			clientlog(client, LOG_ERR, "fcntl: %s",
-			    strerror(errno));
-			write_error(client->fd, HTTP_STATUS_INTERNAL_ERROR,
-			    "Failed to set non-blocking socket\r\n");
-			removeclient(ctx, client);			
-			return;
-		}
+/*
+ * Starts connecting to the target at sa. connect_completed() runs when
+ * the connection is up, which on loopback may be straight away.
+ */
+static void
+connect_target(struct webgw *ctx, struct client *client,
+    const struct sockaddr_in *sa)
+{
+	struct kevent changelist;
 
-		if (connect(client->targetfd,
-		    (struct sockaddr *) &sa, sizeof(sa)) < 0 &&
-		    errno != EINPROGRESS) {
-			clientlog(client, LOG_WARNING, "connect %s:%d: %s",
-			    client->parser.host, client->parser.port,
-			    strerror(errno));
-			write_error(client->fd, HTTP_STATUS_FAILED_CONNECTION,
-			    "Failed to connect.\r\n");
-			removeclient(ctx, client);
-			return;
-		}
-		if (errno == EINPROGRESS) {
-			EV_SET(&changelist, client->targetfd,
-			    EVFILT_WRITE, EV_ADD | EV_ENABLE | EV_ONESHOT, 0, 0,
-			    &client->targetcallback);
-			if (kevent(ctx->kq, &changelist, 1, NULL, 0, NULL) == -1)
-				err(1, "adding targetfd to kevent");
-		} else {
-			clientlog(client, LOG_INFO, "immediate connect ok");
-			connect_completed(ctx, client);
-		}
+	client_set_state(ctx, client, CONN_CONNECTING);
+	if ((client->targetfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		clientlog(client, LOG_ERR, "socket: %s", strerror(errno));
+		write_error(client->fd, HTTP_STATUS_INTERNAL_ERROR,
+		    "Failed to create socket for connection.\r\n");
+		removeclient(ctx, client);
+		return;
+	}
+
+	if (fcntl(client->targetfd, F_SETFL, O_NONBLOCK) == -1) {
+		clientlog(client, LOG_ERR, "fcntl: %s", strerror(errno));
+		write_error(client->fd, HTTP_STATUS_INTERNAL_ERROR,
+		    "Failed to set non-blocking socket\r\n");
+		removeclient(ctx, client);
+		return;
 	}
 
-	clock_gettime(CLOCK_MONOTONIC, &tv_after);
-	usec = (tv_after.tv_nsec - tv_before.tv_nsec) / 1000;
-	if (usec > ctx->resolv_max_usec)
-		ctx->resolv_max_usec = usec;
-	ctx->resolv_sum_usec += usec;
-	ctx->resolv_samples++;
+	if (connect(client->targetfd, (const struct sockaddr *) sa,
+	    sizeof(*sa)) == 0) {
+		clientlog(client, LOG_INFO, "immediate connect ok");
+		connect_completed(ctx, client);
+		return;
+	}
+	if (errno != EINPROGRESS) {
+		clientlog(client, LOG_WARNING, "connect %s:%d: %s",
+		    client->parser.host, client->parser.port,
+		    strerror(errno));
+		write_error(client->fd, HTTP_STATUS_FAILED_CONNECTION,
+		    "Failed to connect.\r\n");
+		removeclient(ctx, client);
+		return;
+	}
+	EV_SET(&changelist, client->targetfd,
+	    EVFILT_WRITE, EV_ADD | EV_ENABLE | EV_ONESHOT, 0, 0,
+	    &client->targetcallback);
+	if (kevent(ctx->kq, &changelist, 1, NULL, 0, NULL) == -1)
+		err(1, "adding targetfd to kevent");
 }
 
 static int
@@ -387,6 +427,7 @@ process_body(struct webgw *ctx, struct client *client)
 	if (parser->port != 443 && parser->port != 80 &&
 	    parser->port != 8080) {
 		clientlog(client, LOG_ERR, "Illegal port %d", parser->port);
+		ctx->denied_port++;
 		write_error(client->fd, HTTP_STATUS_FORBIDDEN,
 		    "Illegal port.\r\n");
 		removeclient(ctx, client);
@@ -401,6 +442,7 @@ process_body(struct webgw *ctx, struct client *client)
 			clientlog(client, LOG_WARNING,
 			    "tried to connect: %s (unauthorized)",
 			    parser->host);
+			ctx->denied_policy++;
 			server_unauthorize(ctx, parser->host, parser->port);
 			write_error(client->fd, HTTP_STATUS_FORBIDDEN,
 			    "Illegal host.\r\n");
@@ -408,6 +450,11 @@ process_body(struct webgw *ctx, struct client *client)
 		} else {
 			clientlog(client, LOG_WARNING,
 			    "tried to connect: %s (holding)", parser->host);
+			if (client->state != CONN_PARKED) {
+				client_set_state(ctx, client, CONN_PARKED);
+				clock_gettime(CLOCK_MONOTONIC,
+				    &client->ts_held);
+			}
 			EV_SET(&changelist, client->fd,
 			    EVFILT_TIMER, EV_ADD | EV_ENABLE | EV_ONESHOT,
 			    0, 1000, &client->reprocesscallback);
@@ -438,6 +485,32 @@ process_body(struct webgw *ctx, struct client *client)
 	return 0;
 }
 
+/*
+ * Writes a 403 for a denied host from a prebuilt response. Only the
+ * Date header changes, so the response is rebuilt at most once a
+ * second.
+ */
+static void
+fast_reject(struct webgw *ctx, struct client *client)
+{
+	static char buf[512];
+	static int n;
+	static time_t built;
+	time_t t;
+
+	t = time(0);
+	if (t != built) {
+		n = http_format_error(buf, sizeof(buf), HTTP_STATUS_FORBIDDEN,
+		    "Illegal host.\r\n");
+		built = t;
+	}
+
+	ctx->fastreject_total++;
+	if (write_fd(client->fd, buf, n) == -1)
+		log_msg(LOG_ERR, "fast_reject: %s", strerror(errno));
+	removeclient(ctx, client);
+}
+
 static void
 readclient(struct webgw *ctx, struct client *client)
 {
@@ -445,11 +518,9 @@ readclient(struct webgw *ctx, struct client *client)
 	char *buf;
 	static char line[4096];
 	struct http_parser *parser;
-	struct timespec tv_before, tv_after;
-	int usec;
 	const char *s;
-
-	clock_gettime(CLOCK_MONOTONIC, &tv_before);
+	unsigned long gen;
+	int startline;
 
 	parser = &client->parser;
 
@@ -483,7 +554,21 @@ readclient(struct webgw *ctx, struct client *client)
 		    -1) {
 			client->sz -= parsed;
 			client->request_size += parsed;
+			startline = (parser->state == HTTP_STARTLINE);
 			http_parse(parser, line);
+
+			/*
+			 * Denied hosts are turned away as soon as we know
+			 * the target, before reading any headers.
+			 */
+			if (startline && parser->state == HTTP_HEADERS &&
+			    parser->error_state == HTTP_NO_ERROR &&
+			    parser->host != NULL &&
+			    server_is_denied(ctx, parser->host,
+			    parser->port)) {
+				fast_reject(ctx, client);
+				return;
+			}
 		}
 
 		if (parser->state == HTTP_ERROR) {
@@ -518,15 +603,37 @@ readclient(struct webgw *ctx, struct client *client)
 			return;
 		}
 		if (parser->state == HTTP_BODY) {
+			clock_gettime(CLOCK_MONOTONIC, &client->ts_headers);
+			hist_record(&ctx->phase[PHASE_PARSE],
+			    hist_usec(&client->ts_begin, &client->ts_headers));
+
 			client->target_host = 
 			    hostdb_find(ctx->hostdb, parser->host,
 			    parser->port);
 
 			host_ref(client->target_host);
-
-			if ((s = rules_match(parser->host, parser->port)) !=
-			    NULL)
+			hostdb_refile(ctx->hostdb, client->target_host);
+
+			/*
+			 * The rule verdict is cached on the host until the
+			 * policy generation changes.
+			 */
+			gen = rules_generation();
+			if (!host_policy_cached(client->target_host, gen, &s)) {
+				s = rules_match(parser->host, parser->port);
+				host_set_policy(client->target_host, gen, s);
+			}
+			if (s != NULL &&
+			    !host_is_authorized(client->target_host)) {
 				host_authorize(client->target_host, s);
+				hostdb_touch(ctx->hostdb, client->target_host);
+				hostdb_refile(ctx->hostdb,
+				    client->target_host);
+			}
+
+			clock_gettime(CLOCK_MONOTONIC, &client->ts_policy);
+			hist_record(&ctx->phase[PHASE_POLICY],
+			    hist_usec(&client->ts_headers, &client->ts_policy));
 
 			if (process_body(ctx, client) == -1)
 				return;
@@ -544,17 +651,12 @@ readclient(struct webgw *ctx, struct client *client)
 				removeclient(ctx, client);
 				return;
 			}
+			host_add_tx_bytes(client->target_host, n);
+			hostdb_touch(ctx->hostdb, client->target_host);
+			ctx->bytes_upstream += n;
 			client->sz = 0;
 		}
 	}
-
-	clock_gettime(CLOCK_MONOTONIC, &tv_after);
-
-	usec = (tv_after.tv_nsec - tv_before.tv_nsec) / 1000;
-	if (usec > ctx->client_max_usec)
-		ctx->client_max_usec = usec;
-	ctx->client_sum_usec += usec;
-	ctx->client_samples++;
 }
 
 void
@@ -562,10 +664,6 @@ readtarget(struct webgw *ctx, Client *client)
 {
 	static char buf[READ_BLOCK_SZ];
 	int n;
-	struct timespec tv_before, tv_after;
-	int usec;
-
-	clock_gettime(CLOCK_MONOTONIC, &tv_before);
 
 	if ((n = read(client->targetfd, buf, sizeof(buf))) <= 0) {
 		if (n < 0)
@@ -580,22 +678,18 @@ readtarget(struct webgw *ctx, Client *client)
 
 	if (client->bytes_from_target == 0) {
 		clock_gettime(CLOCK_MONOTONIC, &client->ts_firstbyte);
+		hist_record(&ctx->phase[PHASE_FIRSTBYTE],
+		    hist_usec(&client->ts_connect, &client->ts_firstbyte));
 	}
 	client->bytes_from_target += n;
 
 	host_add_rx_bytes(client->target_host, n);
+	hostdb_touch(ctx->hostdb, client->target_host);
 
 	if ((n = write_fd(client->fd, buf, n)) < 0) {
 		clientlog(client, LOG_ERR, "write: %s", strerror(errno));
 		removeclient(ctx, client);
 		return;
 	}
-
-	clock_gettime(CLOCK_MONOTONIC, &tv_after);
-
-	usec = (tv_after.tv_nsec - tv_before.tv_nsec) / 1000;
-	if (usec > ctx->target_max_usec)
-		ctx->target_max_usec = usec;
-	ctx->target_sum_usec += usec;
-	ctx->target_samples++;
+	ctx->bytes_downstream += n;
 }
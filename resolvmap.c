@@ -0,0 +1,167 @@
+#include "resolvmap.h"
+#include "mem.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+
+/*
+ * The file has a line for each name,
+ *
+ *	name[:port]	address[:port]
+ *
+ * with blank lines and those starting with '#' ignored. Without a port
+ * the name matches whatever port is asked for, and without one the
+ * address keeps the port asked for. The first matching line is taken,
+ * so a line with a port goes before one without for the same name.
+ *
+ * The map is meant for tests and benchmarks, where it is a handful of
+ * lines, and is searched linearly.
+ */
+
+struct resolvmap_entry
+{
+	char *name;
+	int port;		/* 0 for any */
+	struct in_addr addr;
+	int addr_port;		/* 0 for the port asked for */
+};
+
+struct resolvmap
+{
+	struct resolvmap_entry *entry;
+	size_t n;
+};
+
+static int _split_port(char *, int *);
+
+/*
+ * Returns the map in file, or NULL with errno set if it cannot be read
+ * or has a line that does not parse, which is logged.
+ */
+struct resolvmap *
+resolvmap_load(const char *file)
+{
+	struct resolvmap *self;
+	struct resolvmap_entry *e;
+	char *line, *name, *addr, *extra;
+	size_t linesize, lineno;
+	FILE *fp;
+	int saved_errno;
+
+	if ((fp = fopen(file, "r")) == NULL)
+		return NULL;
+	if ((self = mem_calloc(MEM_DNS, 1, sizeof(*self))) == NULL) {
+		fclose(fp);
+		return NULL;
+	}
+
+	line = NULL;
+	linesize = 0;
+	lineno = 0;
+	while (getline(&line, &linesize, fp) != -1) {
+		lineno++;
+		name = strtok(line, " \t\r\n");
+		if (name == NULL || name[0] == '#')
+			continue;
+		addr = strtok(NULL, " \t\r\n");
+		extra = strtok(NULL, " \t\r\n");
+		if (addr == NULL || (extra != NULL && extra[0] != '#'))
+			goto bad;
+
+		e = mem_reallocarray(MEM_DNS, self->entry, self->n + 1,
+		    sizeof(*self->entry));
+		if (e == NULL)
+			goto fail;
+		self->entry = e;
+		e = &self->entry[self->n];
+		if (_split_port(name, &e->port) == -1 ||
+		    _split_port(addr, &e->addr_port) == -1 ||
+		    inet_pton(AF_INET, addr, &e->addr) != 1)
+			goto bad;
+		if ((e->name = mem_strdup(MEM_DNS, name)) == NULL)
+			goto fail;
+		self->n++;
+	}
+	if (ferror(fp))
+		goto fail;
+	free(line);
+	fclose(fp);
+	return self;
+
+ bad:
+	syslog(LOG_ERR, "%s:%zu: expected name[:port] address[:port]",
+	    file, lineno);
+	errno = EINVAL;
+ fail:
+	saved_errno = errno;
+	free(line);
+	fclose(fp);
+	resolvmap_free(self);
+	errno = saved_errno;
+	return NULL;
+}
+
+void
+resolvmap_free(struct resolvmap *self)
+{
+	size_t i;
+
+	if (self == NULL)
+		return;
+	for (i = 0; i < self->n; i++)
+		mem_free(self->entry[i].name);
+	mem_free(self->entry);
+	mem_free(self);
+}
+
+/*
+ * Fills sa with where to connect for host and port, and returns 0, or
+ * returns -1 if the name is not in the map.
+ */
+int
+resolvmap_lookup(const struct resolvmap *self, const char *host, int port,
+    struct sockaddr_in *sa)
+{
+	const struct resolvmap_entry *e;
+	size_t i;
+
+	for (i = 0; i < self->n; i++) {
+		e = &self->entry[i];
+		if ((e->port != 0 && e->port != port) ||
+		    strcasecmp(e->name, host) != 0)
+			continue;
+		memset(sa, 0, sizeof(*sa));
+		sa->sin_family = AF_INET;
+		sa->sin_addr = e->addr;
+		sa->sin_port = htons(e->addr_port != 0 ? e->addr_port : port);
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * Cuts a ":port" off s, storing the port, or 0 if there is none.
+ */
+static int
+_split_port(char *s, int *port)
+{
+	char *colon, *end;
+	long n;
+
+	*port = 0;
+	if ((colon = strrchr(s, ':')) == NULL)
+		return 0;
+	n = strtol(colon + 1, &end, 10);
+	if (colon[1] == '\0' || *end != '\0' || n <= 0 || n > 65535)
+		return -1;
+	*colon = '\0';
+	*port = n;
+	return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef RESOLVMAP_H
+#define RESOLVMAP_H
+
+#include <netinet/in.h>
+
+/*
+ * Names that are not looked up but given an address, and possibly a
+ * port, from a file: as with /etc/hosts, but per port, so that a
+ * request to a port the proxy allows can be sent to another one.
+ */
+struct resolvmap;
+
+struct resolvmap *resolvmap_load   (const char *);
+void              resolvmap_free   (struct resolvmap *);
+
+int               resolvmap_lookup (const struct resolvmap *, const char *,
+                                    int, struct sockaddr_in *);
+
+#endif
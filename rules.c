@@ -1,47 +1,201 @@
 #include "rules.h"
 #include "dynstr.h"
+#include "mem.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <fnmatch.h>
 #include <err.h>
+#include <time.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <signal.h>
 
-struct rules
+/*
+ * Rules are fnmatch(3) patterns matched against "host:port". When
+ * several rules match, the one added last wins, as it always has.
+ *
+ * Instead of running fnmatch() for every rule, patterns are compiled
+ * into a ruleset:
+ *
+ * - literal patterns go to a hash table;
+ * - "*literal" patterns go to a trie of reversed strings, so e.g.
+ *   "*.example.com:443" is found by walking "host:port" backwards;
+ * - "literal*" patterns go to a trie of forward strings;
+ * - "*literal*" patterns go to an Aho-Corasick automaton, which finds
+ *   every one of them occurring in "host:port" in a single pass;
+ * - anything else is a general pattern. Its longest literal run is
+ *   added to the automaton too, and the pattern is tried with fnmatch()
+ *   only when that run occurs in "host:port" and the pattern could
+ *   still beat the best match found so far. Patterns without a usable
+ *   literal run are kept in a list and always tried.
+ *
+ * A match is thus one hash lookup, two trie walks and one automaton
+ * pass, each bounded by the length of "host:port", plus fnmatch() for
+ * the few general patterns whose literal part is present.
+ *
+ * A ruleset is immutable once compiled. rules_reload_async() compiles
+ * a new one on a separate thread and publishes it with an atomic
+ * pointer swap, so the event loop never waits for a reload. Only the
+ * newest data not yet taken up by the thread is kept; data posted
+ * while a reload is running replaces it, and the thread goes on with
+ * it when done, so at most one reload thread runs at a time. The event
+ * loop is the only reader and calls rules_quiesce() between events;
+ * the reload thread frees the old ruleset once it has seen the loop
+ * pass such a quiescent point, as no match can be in progress then.
+ */
+
+#define TRIE_NONE	UINT32_MAX
+
+struct rule
 {
 	char *pattern;
-	struct rules *next;
 };
 
-static void  _add_rule(const char *);
-static char *_mk_hostport_str(char *, size_t, const char *, int);
-static void  _clear_rules(void);
+/*
+ * Node of a trie or of the automaton. fail, dict and general are only
+ * used by the automaton.
+ */
+struct trienode
+{
+	uint32_t child;
+	uint32_t sibling;
+	uint32_t fail;		/* Longest proper suffix that is a node */
+	uint32_t dict;		/* Nearest node on fail chain with general */
+	uint32_t general;	/* First gentry, or TRIE_NONE */
+	int prio;		/* Rule index ending here, or -1 */
+	int best;		/* Highest prio on the fail chain */
+	unsigned char c;
+};
+
+/*
+ * General patterns attached to an automaton node, newest first.
+ */
+struct gentry
+{
+	int prio;
+	uint32_t next;
+};
+
+struct trie
+{
+	struct trienode *node;	/* node[0] is the root */
+	size_t nnode;
+	size_t maxnode;
+};
+
+struct literal
+{
+	const char *pattern;
+	uint32_t hash;
+	int prio;
+};
+
+struct ruleset
+{
+	struct rule *rule;	/* In the order added; index is priority */
+	size_t nrule;
+	size_t maxrule;
+
+	struct literal *literal;	/* Open addressing, power of two */
+	size_t nliteral;
+	size_t literalsz;
+
+	struct trie suffix;
+	struct trie prefix;
+	struct trie ac;
+
+	struct gentry *gen;
+	size_t ngen;
+	size_t maxgen;
+
+	int *general;		/* Unindexed general patterns, in order */
+	size_t ngeneral;
+	size_t maxgeneral;
+};
+
+static struct ruleset *_ruleset_create(void);
+static void            _ruleset_compile(struct ruleset *);
+static void            _ruleset_free(struct ruleset *);
+static void            _add_rule(struct ruleset *, const char *);
+static int             _ruleset_match(struct ruleset *, const char *);
+static char           *_mk_hostport_str(char *, size_t, const char *, int);
+
+static void            _literal_add(struct ruleset *, const char *, int);
+static int             _literal_find(struct ruleset *, const char *);
+static uint32_t        _hash(const char *, size_t);
+
+static void            _trie_init(struct trie *);
+static uint32_t        _trie_add(struct trie *, const char *, size_t, int);
+static uint32_t        _trie_child(struct trie *, uint32_t, unsigned char);
+static int             _trie_walk(struct trie *, const char *, size_t, int,
+                           int);
+static int             _ac_scan(struct ruleset *, const char *, size_t,
+                           int);
+
+struct reload
+{
+	char *data;
+	struct timespec ts_begin;
+};
 
-struct rules *_head;
+static struct ruleset *_publish(struct ruleset *);
+static void           *_reload_thread(void *);
+static void            _reload(struct reload *);
+static int             _save_rules(struct ruleset *);
+
+static struct ruleset *_rules;
+
+/*
+ * Policy generation. Bumped whenever a cached verdict could have become
+ * stale: on every rule reload and on admin changes to hosts. Starts at
+ * 1 so that a zeroed cache is never valid.
+ */
+static unsigned long _generation = 1;
+
+/*
+ * Count of quiescent points passed by the event loop.
+ */
+static unsigned long _quiescent;
+
+/*
+ * Guards the pending reload and whether the reload thread runs. It is
+ * only held to hand data over, never while compiling.
+ */
+static pthread_mutex_t _reload_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct reload _pending;	/* data is NULL when there is none */
+static int _reloading;
+static pthread_mutex_t _stats_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct rules_stats _stats;
 
 const char *
 rules_match(const char *host, int port)
 {
-	struct rules *np;
+	struct ruleset *rs;
 	char hostport[1024];
+	int prio;
+
+	if ((rs = __atomic_load_n(&_rules, __ATOMIC_ACQUIRE)) == NULL)
+		return NULL;
 
 	_mk_hostport_str(hostport, sizeof(hostport), host, port);
 
-	for (np = _head; np != NULL; np = np->next) {
-		if (fnmatch(np->pattern, hostport, 0) == FNM_NOMATCH)
-			continue;
-		return np->pattern;
-	}
+	if ((prio = _ruleset_match(rs, hostport)) == -1)
+		return NULL;
 
-	return NULL;
+	return rs->rule[prio].pattern;
 }
 
 void
 rules_load_from_data(char *buf)
 {
+	struct ruleset *rs;
 	char *eol, *bol;
 
-	_clear_rules();
+	rs = _ruleset_create();
 
 	bol = eol = buf;
 	do {
@@ -50,83 +204,710 @@ rules_load_from_data(char *buf)
 		if (eol != NULL)
 			*eol = '\0';
 
-		_add_rule(bol);
+		_add_rule(rs, bol);
 	} while (eol++ != NULL);	
+
+	_ruleset_compile(rs);
+	_ruleset_free(_publish(rs));
 }
 
 void
 rules_load()
 {
+	struct ruleset *rs;
 	char buf[1024];
 	FILE *fp;
 	const char *file = "rules";
 
-	_clear_rules();
+	rs = _ruleset_create();
 
-	if ((fp = fopen(file, "r")) == NULL) {
+	if ((fp = fopen(file, "r")) == NULL)
 		warn("fopen %s", file);
+	else {
+		while (fgets(buf, sizeof(buf), fp) != NULL) {
+			buf[strcspn(buf, "\r\n")] = '\0';
+			_add_rule(rs, buf);
+		}
+		fclose(fp);
+	}
+
+	_ruleset_compile(rs);
+	pthread_mutex_lock(&_stats_mtx);
+	_stats.nrules = rs->nrule;
+	pthread_mutex_unlock(&_stats_mtx);
+	_ruleset_free(_publish(rs));
+}
+
+/*
+ * Replaces the rules with the newline separated patterns in data, in
+ * the order returned by rules_to_data(). The data must be allocated
+ * with mem_malloc() and is freed. Compiling, publishing,
+ * saving to the rules file and freeing the old rules all happen on a
+ * separate thread, which is started unless it is running already. Data
+ * still waiting for it is dropped in favour of this.
+ */
+void
+rules_reload_async(char *data)
+{
+	pthread_attr_t attr;
+	sigset_t set, oset;
+	pthread_t tid;
+	int error;
+
+	pthread_mutex_lock(&_reload_mtx);
+	mem_free(_pending.data);
+	_pending.data = data;
+	clock_gettime(CLOCK_MONOTONIC, &_pending.ts_begin);
+	if (_reloading) {
+		pthread_mutex_unlock(&_reload_mtx);
 		return;
 	}
 
-	while (fgets(buf, sizeof(buf), fp) != NULL) {
-		buf[strcspn(buf, "\r\n")] = '\0';
-		_add_rule(buf);
+	/*
+	 * The thread is started with SIGPROF blocked, as the profiler
+	 * only walks the event loop's stack.
+	 */
+	sigemptyset(&set);
+	sigaddset(&set, SIGPROF);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+	error = pthread_create(&tid, &attr, _reload_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	if (error != 0) {
+		syslog(LOG_ERR, "rules_reload_async: pthread_create: %s",
+		    strerror(error));
+		mem_free(_pending.data);
+		_pending.data = NULL;
+	} else
+		_reloading = 1;
+	pthread_attr_destroy(&attr);
+	pthread_mutex_unlock(&_reload_mtx);
+}
+
+/*
+ * Called by the event loop whenever it holds no pointers into the
+ * rules, i.e. between events.
+ */
+void
+rules_quiesce()
+{
+	__atomic_add_fetch(&_quiescent, 1, __ATOMIC_SEQ_CST);
+}
+
+void
+rules_get_stats(struct rules_stats *stats)
+{
+	pthread_mutex_lock(&_stats_mtx);
+	*stats = _stats;
+	pthread_mutex_unlock(&_stats_mtx);
+}
+
+unsigned long
+rules_generation()
+{
+	return __atomic_load_n(&_generation, __ATOMIC_SEQ_CST);
+}
+
+void
+rules_invalidate()
+{
+	__atomic_add_fetch(&_generation, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Makes rs the current ruleset and returns the previous one. The
+ * generation is bumped only after the swap, so a reader that sees the
+ * new generation also sees the new rules.
+ */
+static struct ruleset *
+_publish(struct ruleset *rs)
+{
+	struct ruleset *old;
+
+	old = __atomic_exchange_n(&_rules, rs, __ATOMIC_SEQ_CST);
+	rules_invalidate();
+
+	return old;
+}
+
+/*
+ * Takes up the pending data until there is none left.
+ */
+static void *
+_reload_thread(void *arg)
+{
+	struct reload r;
+
+	for (;;) {
+		pthread_mutex_lock(&_reload_mtx);
+		r = _pending;
+		_pending.data = NULL;
+		if (r.data == NULL)
+			_reloading = 0;
+		pthread_mutex_unlock(&_reload_mtx);
+		if (r.data == NULL)
+			return NULL;
+
+		_reload(&r);
+		mem_free(r.data);
 	}
+}
+
+static void
+_reload(struct reload *r)
+{
+	struct ruleset *rs, *old;
+	struct timespec ts_end, ts_wait = { 0, 1000000 };
+	unsigned long q;
+	char *eol, *bol, **line;
+	size_t nline;
+	double ms;
+
+	/*
+	 * The data is in rules_to_data() order, highest priority first,
+	 * so that what the admin interface shows can be posted back.
+	 */
+	line = NULL;
+	nline = 0;
+	bol = eol = r->data;
+	do {
+		bol = eol;
+		eol = strchr(bol, '\n');
+		if (eol != NULL)
+			*eol = '\0';
+		bol[strcspn(bol, "\r")] = '\0';
+		if (*bol == '\0')
+			continue;
+		line = mem_reallocarray(MEM_RULES, line, nline + 1,
+		    sizeof(char *));
+		if (line == NULL)
+			err(1, "reallocarray");
+		line[nline++] = bol;
+	} while (eol++ != NULL);
+
+	rs = _ruleset_create();
+	while (nline > 0)
+		_add_rule(rs, line[--nline]);
+	mem_free(line);
+	_ruleset_compile(rs);
+
+	/*
+	 * The stats are updated before publishing, so that whoever sees
+	 * the new generation also sees them.
+	 */
+	clock_gettime(CLOCK_MONOTONIC, &ts_end);
+	ms = (ts_end.tv_sec - r->ts_begin.tv_sec) * 1000.0 +
+	    (ts_end.tv_nsec - r->ts_begin.tv_nsec) / 1000000.0;
+	pthread_mutex_lock(&_stats_mtx);
+	_stats.reloads++;
+	_stats.nrules = rs->nrule;
+	_stats.last_reload_ms = ms;
+	if (ms > _stats.max_reload_ms)
+		_stats.max_reload_ms = ms;
+	pthread_mutex_unlock(&_stats_mtx);
+
+	old = _publish(rs);
+	syslog(LOG_INFO, "rules reloaded: %zu rules in %.1f ms",
+	    rs->nrule, ms);
 
-	fclose(fp);
+	if (_save_rules(rs) == -1)
+		syslog(LOG_ERR, "saving rules: %m");
+
+	/*
+	 * Wait for the event loop to pass a quiescent point; after that
+	 * nobody can be using the old rules.
+	 */
+	q = __atomic_load_n(&_quiescent, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&_quiescent, __ATOMIC_SEQ_CST) == q)
+		nanosleep(&ts_wait, NULL);
+	_ruleset_free(old);
 }
 
+static int
+_save_rules(struct ruleset *rs)
+{
+	FILE *fp;
+	size_t i;
+
+	if ((fp = fopen("rules.tmp", "w")) == NULL)
+		return -1;
+	for (i = 0; i < rs->nrule; i++)
+		fprintf(fp, "%s\n", rs->rule[i].pattern);
+	if (fclose(fp) == EOF)
+		return -1;
+
+	return rename("rules.tmp", "rules");
+}
+
+/*
+ * Returns the rules one per line, highest priority first, in a string
+ * the caller frees with mem_free(). Returns NULL if out of memory.
+ */
 char *
 rules_to_data()
 {
-	struct rules *np;
-	struct dynstr dn = { 0 };
+	struct dynstr *dn;
+	struct ruleset *rs;
 	const char *s;
 	char *p;
+	size_t i;
 
-	for (np = _head; np != NULL; np = np->next)
-		dynstr_add(&dn, "%s\n", np->pattern);
-
-	if ((s = dynstr_get(&dn)) == NULL)
-		return "";
+	if ((dn = dynstr_create()) == NULL)
+		return NULL;
+	dynstr_clear(dn);
 
-	p = strdup(s);
+	if ((rs = __atomic_load_n(&_rules, __ATOMIC_ACQUIRE)) != NULL)
+		for (i = rs->nrule; i > 0; i--)
+			dynstr_add(dn, "%s\n", rs->rule[i - 1].pattern);
 
-	dynstr_clear(&dn);
+	p = ((s = dynstr_get(dn)) != NULL) ? mem_strdup(MEM_RULES, s) : NULL;
+	dynstr_free(dn);
 
 	return p;
 }
 
+static struct ruleset *
+_ruleset_create()
+{
+	struct ruleset *rs;
+
+	if ((rs = mem_calloc(MEM_RULES, 1, sizeof(struct ruleset))) == NULL)
+		err(1, "_ruleset_create");
+
+	rs->literalsz = 64;
+	if ((rs->literal = mem_calloc(MEM_RULES, rs->literalsz,
+	    sizeof(struct literal))) == NULL)
+		err(1, "_ruleset_create");
+
+	_trie_init(&rs->suffix);
+	_trie_init(&rs->prefix);
+	_trie_init(&rs->ac);
+
+	return rs;
+}
+
 static void
-_add_rule(const char *pattern)
+_ruleset_free(struct ruleset *rs)
 {
-	struct rules *np;
+	size_t i;
 
-	if ((np = calloc(1, sizeof(struct rules))) == NULL)
+	if (rs == NULL)
+		return;
+
+	for (i = 0; i < rs->nrule; i++)
+		mem_free(rs->rule[i].pattern);
+	mem_free(rs->rule);
+	mem_free(rs->literal);
+	mem_free(rs->suffix.node);
+	mem_free(rs->prefix.node);
+	mem_free(rs->ac.node);
+	mem_free(rs->gen);
+	mem_free(rs->general);
+	mem_free(rs);
+}
+
+/*
+ * Returns 1 if the pattern has no fnmatch(3) special characters in
+ * the given range.
+ */
+static int
+_is_literal(const char *s, size_t len)
+{
+	return strcspn(s, "*?[\\") >= len;
+}
+
+/*
+ * Finds the longest run of literal characters that any string matching
+ * the pattern must contain. Only the part before the first bracket
+ * expression is considered, so brackets never need to be parsed.
+ */
+static size_t
+_literal_run(const char *pattern, const char **run)
+{
+	const char *p, *end;
+	size_t n, best;
+
+	best = 0;
+	*run = pattern;
+	for (p = pattern; *p != '\0' && *p != '['; p = end) {
+		n = strcspn(p, "*?[\\");
+		end = p + n;
+		if (n > best) {
+			best = n;
+			*run = p;
+		}
+		if (*end == '\\')
+			end += (end[1] != '\0') ? 2 : 1;
+		else if (*end == '*' || *end == '?')
+			end++;
+	}
+
+	return best;
+}
+
+static void
+_add_rule(struct ruleset *rs, const char *pattern)
+{
+	struct rule *r;
+	struct gentry *g;
+	const char *run;
+	size_t len, runlen;
+	uint32_t n;
+	int prio;
+
+	if (rs->nrule == rs->maxrule) {
+		rs->maxrule = rs->maxrule ? rs->maxrule * 2 : 64;
+		if ((rs->rule = mem_reallocarray(MEM_RULES, rs->rule,
+		    rs->maxrule, sizeof(struct rule))) == NULL)
+			err(1, "_add_rule");
+	}
+	prio = rs->nrule++;
+	r = &rs->rule[prio];
+	if ((r->pattern = mem_strdup(MEM_RULES, pattern)) == NULL)
 		err(1, "_add_rule");
-	printf("_add_rule, pattern=%s\n", pattern);
-	np->next = _head;
-	np->pattern = strdup(pattern);
-	_head = np;
+
+	len = strlen(pattern);
+	if (_is_literal(pattern, len)) {
+		_literal_add(rs, r->pattern, prio);
+		return;
+	}
+
+	if (pattern[0] == '*' && _is_literal(pattern + 1, len - 1)) {
+		n = _trie_add(&rs->suffix, pattern + 1, len - 1, -1);
+		if (prio > rs->suffix.node[n].prio)
+			rs->suffix.node[n].prio = prio;
+		return;
+	}
+
+	if (pattern[len - 1] == '*' && _is_literal(pattern, len - 1)) {
+		n = _trie_add(&rs->prefix, pattern, len - 1, 1);
+		if (prio > rs->prefix.node[n].prio)
+			rs->prefix.node[n].prio = prio;
+		return;
+	}
+
+	if (len > 2 && pattern[0] == '*' && pattern[len - 1] == '*' &&
+	    _is_literal(pattern + 1, len - 2)) {
+		n = _trie_add(&rs->ac, pattern + 1, len - 2, 1);
+		if (prio > rs->ac.node[n].prio)
+			rs->ac.node[n].prio = prio;
+		return;
+	}
+
+	if ((runlen = _literal_run(pattern, &run)) > 0) {
+		n = _trie_add(&rs->ac, run, runlen, 1);
+		if (rs->ngen == rs->maxgen) {
+			rs->maxgen = rs->maxgen ? rs->maxgen * 2 : 16;
+			if ((rs->gen = mem_reallocarray(MEM_RULES, rs->gen,
+			    rs->maxgen, sizeof(struct gentry))) == NULL)
+				err(1, "_add_rule");
+		}
+		g = &rs->gen[rs->ngen];
+		g->prio = prio;
+		g->next = rs->ac.node[n].general;
+		rs->ac.node[n].general = rs->ngen++;
+		return;
+	}
+
+	if (rs->ngeneral == rs->maxgeneral) {
+		rs->maxgeneral = rs->maxgeneral ? rs->maxgeneral * 2 : 16;
+		if ((rs->general = mem_reallocarray(MEM_RULES, rs->general,
+		    rs->maxgeneral, sizeof(int))) == NULL)
+			err(1, "_add_rule");
+	}
+	rs->general[rs->ngeneral++] = prio;
 }
 
-static char *
-_mk_hostport_str(char *dst, size_t dstsz, const char *host, int port)
+/*
+ * Computes the automaton's failure links breadth first, together with
+ * the best "*literal*" priority and the nearest general patterns
+ * reachable through them.
+ */
+static void
+_ruleset_compile(struct ruleset *rs)
 {
-	snprintf(dst, dstsz, "%s:%d", host, port);
+	struct trienode *node;
+	uint32_t *queue, n, c, f;
+	size_t head, tail;
 
-	return dst;
+	node = rs->ac.node;
+	if ((queue = mem_reallocarray(MEM_RULES, NULL, rs->ac.nnode,
+	    sizeof(uint32_t))) == NULL)
+		err(1, "_ruleset_compile");
+
+	node[0].fail = 0;
+	node[0].dict = TRIE_NONE;
+	node[0].best = node[0].prio;
+
+	head = tail = 0;
+	for (c = node[0].child; c != TRIE_NONE; c = node[c].sibling) {
+		node[c].fail = 0;
+		queue[tail++] = c;
+	}
+
+	while (head < tail) {
+		n = queue[head++];
+
+		f = node[n].fail;
+		node[n].best = node[n].prio > node[f].best ?
+		    node[n].prio : node[f].best;
+		node[n].dict = node[f].general != TRIE_NONE ? f : node[f].dict;
+
+		for (c = node[n].child; c != TRIE_NONE; c = node[c].sibling) {
+			f = node[n].fail;
+			while (f != 0 &&
+			    _trie_child(&rs->ac, f, node[c].c) == TRIE_NONE)
+				f = node[f].fail;
+			f = _trie_child(&rs->ac, f, node[c].c);
+			node[c].fail = (f == TRIE_NONE || f == c) ? 0 : f;
+			queue[tail++] = c;
+		}
+	}
+
+	mem_free(queue);
+}
+
+static int
+_ruleset_match(struct ruleset *rs, const char *hostport)
+{
+	size_t len, i;
+	int best, prio;
+
+	len = strlen(hostport);
+
+	best = _literal_find(rs, hostport);
+	best = _trie_walk(&rs->suffix, hostport, len, -1, best);
+	best = _trie_walk(&rs->prefix, hostport, len, 1, best);
+	best = _ac_scan(rs, hostport, len, best);
+
+	/*
+	 * Unindexed patterns were added in increasing priority; walk them
+	 * from the newest and stop as soon as they can no longer win.
+	 */
+	for (i = rs->ngeneral; i > 0; i--) {
+		prio = rs->general[i - 1];
+		if (prio < best)
+			break;
+		if (fnmatch(rs->rule[prio].pattern, hostport, 0) !=
+		    FNM_NOMATCH) {
+			best = prio;
+			break;
+		}
+	}
+
+	return best;
+}
+
+static uint32_t
+_hash(const char *s, size_t len)
+{
+	uint32_t h = 2166136261u;
+
+	while (len-- > 0) {
+		h ^= (unsigned char) *s++;
+		h *= 16777619u;
+	}
+	h ^= h >> 16;
+
+	return h;
 }
 
 static void
-_clear_rules()
+_literal_add(struct ruleset *rs, const char *pattern, int prio)
+{
+	struct literal *old, *l;
+	size_t i, mask, oldsz;
+	uint32_t hash;
+
+	if ((rs->nliteral + 1) * 2 > rs->literalsz) {
+		old = rs->literal;
+		oldsz = rs->literalsz;
+		rs->literalsz *= 2;
+		if ((rs->literal = mem_calloc(MEM_RULES, rs->literalsz,
+		    sizeof(struct literal))) == NULL)
+			err(1, "_literal_add");
+		rs->nliteral = 0;
+		for (i = 0; i < oldsz; i++)
+			if (old[i].pattern != NULL)
+				_literal_add(rs, old[i].pattern, old[i].prio);
+		mem_free(old);
+	}
+
+	hash = _hash(pattern, strlen(pattern));
+	mask = rs->literalsz - 1;
+	for (i = hash & mask; (l = &rs->literal[i])->pattern != NULL;
+	    i = (i + 1) & mask)
+		if (l->hash == hash && strcmp(l->pattern, pattern) == 0) {
+			if (prio > l->prio)
+				l->prio = prio;
+			return;
+		}
+
+	l->pattern = pattern;
+	l->hash = hash;
+	l->prio = prio;
+	rs->nliteral++;
+}
+
+static int
+_literal_find(struct ruleset *rs, const char *s)
+{
+	struct literal *l;
+	size_t i, mask;
+	uint32_t hash;
+
+	hash = _hash(s, strlen(s));
+	mask = rs->literalsz - 1;
+	for (i = hash & mask; (l = &rs->literal[i])->pattern != NULL;
+	    i = (i + 1) & mask)
+		if (l->hash == hash && strcmp(l->pattern, s) == 0)
+			return l->prio;
+
+	return -1;
+}
+
+static void
+_trie_init(struct trie *t)
+{
+	t->maxnode = 64;
+	if ((t->node = mem_calloc(MEM_RULES, t->maxnode,
+	    sizeof(struct trienode))) == NULL)
+		err(1, "_trie_init");
+	t->nnode = 1;
+	t->node[0].child = TRIE_NONE;
+	t->node[0].sibling = TRIE_NONE;
+	t->node[0].general = TRIE_NONE;
+	t->node[0].dict = TRIE_NONE;
+	t->node[0].prio = -1;
+	t->node[0].best = -1;
+}
+
+static uint32_t
+_trie_child(struct trie *t, uint32_t n, unsigned char c)
+{
+	uint32_t i;
+
+	for (i = t->node[n].child; i != TRIE_NONE; i = t->node[i].sibling)
+		if (t->node[i].c == c)
+			break;
+
+	return i;
+}
+
+/*
+ * Adds len bytes of s to the trie, walking forward (dir 1) or from the
+ * end of s backwards (dir -1). Returns the node for the whole string.
+ */
+static uint32_t
+_trie_add(struct trie *t, const char *s, size_t len, int dir)
+{
+	uint32_t n, next;
+	size_t i;
+	unsigned char c;
+
+	n = 0;
+	for (i = 0; i < len; i++) {
+		c = (dir > 0) ? s[i] : s[len - 1 - i];
+		if ((next = _trie_child(t, n, c)) == TRIE_NONE) {
+			if (t->nnode == t->maxnode) {
+				t->maxnode *= 2;
+				if ((t->node = mem_reallocarray(MEM_RULES, t->node,
+				    t->maxnode, sizeof(struct trienode))) ==
+				    NULL)
+					err(1, "_trie_add");
+			}
+			next = t->nnode++;
+			memset(&t->node[next], 0, sizeof(struct trienode));
+			t->node[next].c = c;
+			t->node[next].prio = -1;
+			t->node[next].best = -1;
+			t->node[next].general = TRIE_NONE;
+			t->node[next].dict = TRIE_NONE;
+			t->node[next].child = TRIE_NONE;
+			t->node[next].sibling = t->node[n].child;
+			t->node[n].child = next;
+		}
+		n = next;
+	}
+
+	return n;
+}
+
+/*
+ * Returns the highest priority of any pattern in the trie that is a
+ * prefix (dir 1) or suffix (dir -1) of s, if higher than best.
+ */
+static int
+_trie_walk(struct trie *t, const char *s, size_t len, int dir, int best)
 {
-	struct rules *np, *next;
+	uint32_t n;
+	size_t i;
 
-	for (np = _head; np != NULL; np = next) {
-		next = np->next;
-		free(np->pattern);
-		free(np);
+	n = 0;
+	for (i = 0; ; i++) {
+		if (t->node[n].prio > best)
+			best = t->node[n].prio;
+		if (i == len)
+			break;
+		n = _trie_child(t, n, (dir > 0) ? s[i] : s[len - 1 - i]);
+		if (n == TRIE_NONE)
+			break;
 	}
-	_head = NULL;
+
+	return best;
+}
+
+/*
+ * Runs s through the automaton. Returns the highest priority of any
+ * "*literal*" pattern occurring in s, or of any general pattern whose
+ * literal run occurs in s and which matches, if higher than best.
+ */
+static int
+_ac_scan(struct ruleset *rs, const char *s, size_t len, int best)
+{
+	struct trienode *node;
+	struct gentry *g;
+	uint32_t n, next, d, i_gen;
+	size_t i;
+
+	node = rs->ac.node;
+	if (node[0].child == TRIE_NONE)
+		return node[0].best > best ? node[0].best : best;
+
+	n = 0;
+	for (i = 0; i < len; i++) {
+		while ((next = _trie_child(&rs->ac, n, s[i])) == TRIE_NONE &&
+		    n != 0)
+			n = node[n].fail;
+		n = (next == TRIE_NONE) ? 0 : next;
+
+		if (node[n].best > best)
+			best = node[n].best;
+
+		d = node[n].general != TRIE_NONE ? n : node[n].dict;
+		for (; d != TRIE_NONE; d = node[d].dict) {
+			for (i_gen = node[d].general; i_gen != TRIE_NONE;
+			    i_gen = g->next) {
+				g = &rs->gen[i_gen];
+				if (g->prio < best)
+					break;
+				if (fnmatch(rs->rule[g->prio].pattern, s, 0) !=
+				    FNM_NOMATCH) {
+					best = g->prio;
+					break;
+				}
+			}
+		}
+	}
+
+	return best;
+}
+
+static char *
+_mk_hostport_str(char *dst, size_t dstsz, const char *host, int port)
+{
+	snprintf(dst, dstsz, "%s:%d", host, port);
+
+	return dst;
 }
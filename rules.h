@@ -3,9 +3,25 @@
 
 #include <stddef.h>
 
+struct rules_stats
+{
+	unsigned long reloads;
+	size_t nrules;
+	double last_reload_ms;	/* From request to publication */
+	double max_reload_ms;
+};
+
 const char *rules_match          (const char *, int);
 void        rules_load           (void);
 void        rules_load_from_data (char *);
 char*       rules_to_data        (void);
 
+void        rules_reload_async   (char *);
+void        rules_quiesce        (void);
+void        rules_get_stats      (struct rules_stats *);
+
+unsigned long
+            rules_generation     (void);
+void        rules_invalidate     (void);
+
 #endif
@@ -3,7 +3,13 @@
 #include "client.h"
 #include "server.h"
 #include "hostdb.h"
+#include "host.h"
 #include "rules.h"
+#include "denyset.h"
+#include "accesslog.h"
+#include "log.h"
+#include "shmstats.h"
+#include "mem.h"
 
 #include <assert.h>
 #include <err.h>
@@ -15,6 +21,7 @@
 #include <sys/socket.h>
 #include <strings.h>
 #include <string.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <time.h>
@@ -24,145 +31,192 @@ static void		 acceptclient(struct webgw *, struct client *);
 static void	 	 acceptclient_webserver(struct webgw *,
 			    struct client *);
 static void		 dotimer(struct webgw *ctx, struct client *);
+static void		 publish_stats(struct webgw *, struct client *);
 
-static struct hostport *
-server_find_from_authlist(struct hostport *head, const char *host, int port)
-{
-	struct hostport *n;
+/*
+ * The authorization state of a host is kept in the host itself, so
+ * these are all hostdb lookups. A host is authorized, denied, or held
+ * while waiting for a decision; a hold lasts HOST_HOLD_SEC seconds.
+ */
 
-	for (n = head; n != NULL; n = n->next)
-		if (strcmp(n->host, host) == 0 && n->port == port)
-			break;
-	if (n != NULL)
-		return n;
-	return NULL;
+static struct host *
+server_host(struct webgw *server, const char *host, int port)
+{
+	return hostdb_get(server->hostdb, host, port);
 }
 
 int
 server_has_authorized(struct webgw *server, const char *host, int port)
 {
-	return server_find_from_authlist(server->authorized_head, host, port)
-	    != NULL;
+	struct host *h;
+
+	h = hostdb_lookup(server->hostdb, host, port);
+	return h != NULL && host_is_authorized(h);
 }
 
 int
 server_on_hold(struct webgw *server, const char *host, int port)
 {
-	struct hostport *n;
+	struct host *h;
 
-	n = server_find_from_authlist(server->unauthorized_head, host, port);
-	if (n != NULL && n->hold_timer > 0)
-		return 1;
-	return 0;
+	h = hostdb_lookup(server->hostdb, host, port);
+	return h != NULL && host_is_held(h) && host_held_since(h) > 0;
 }
 
-struct hostport *
-server_iterate_unauthorized(struct webgw *server, struct hostport **iter,
-    const char **host, int *port, int *hold)
+/*
+ * Iterates the hosts that are not authorized. Sets hold to the seconds
+ * left of the hold, or 0 if there is none.
+ */
+struct host *
+server_iterate_unauthorized(struct webgw *server, struct hostnode **iter,
+    int *hold)
 {
-	int diff;
-	struct hostport *current;
-
-	if (*iter == NULL)
-		*iter = server->unauthorized_head;
-	if (*iter == NULL)
-		return *iter;
-	*host = (*iter)->host;
-	*port = (*iter)->port;
-
-	diff = time(0) - (*iter)->hold_timer;
-	if (diff >= 30)
-		*hold = 0;
-	else
-		*hold = 30 - diff;
+	struct host *h;
+	time_t diff;
 
-	current = *iter;
-	*iter = (*iter)->next;
-	return current;	
-}
-
-static struct hostport *
-server_add_to_authlist(struct hostport **head, const char *host, int port)
-{
-	struct hostport *n;
+	while ((h = hostdb_iterate(server->hostdb, iter)) != NULL) {
+		if (host_is_authorized(h))
+			continue;
 
-	if ((n = malloc(sizeof(struct hostport))) == NULL) {
-		syslog(LOG_ERR, "malloc in %s: %m", __FUNCTION__);
-		return NULL;
-	}
-	if (strlcpy(n->host, host, sizeof(n->host)) >= sizeof(n->host) ||
-	    port > USHRT_MAX) {
-		syslog(LOG_WARNING,
-		    "bogus data while adding to unauthorized list");
-		free(n);
-		return NULL;
+		diff = time(0) - host_held_since(h);
+		if (!host_is_held(h) || diff >= HOST_HOLD_SEC)
+			*hold = 0;
+		else
+			*hold = HOST_HOLD_SEC - diff;
+		break;
 	}
 
-	n->port = port;
-	n->next = *head;
-	if (*head != NULL)
-		(*head)->prev = n;
-	n->prev = NULL;
-	*head = n;
-
-	return n;
+	return h;
 }
 
+/*
+ * Starts holding the host, unless it already is. Returns the seconds
+ * left of the hold, or 0 if the host is not held or the hold is over.
+ */
 int
 server_hold(struct webgw *server, const char *host, int port)
 {
-	struct hostport *n;
-
-	n = server_find_from_authlist(server->unauthorized_head, host, port);
-	if (n == NULL) {
-		n = server_add_to_authlist(&server->unauthorized_head, host,
-		    port);
-		if (n != NULL) {
-			n->hold_timer = time(0);
-			return n->hold_timer;
-		}
+	struct host *h;
+	time_t diff;
+
+	h = server_host(server, host, port);
+	if (!host_is_held(h))
 		return 0;
-	} else {
-		if (time(0) - n->hold_timer >= 30)
-			return 0;
-		return 30 - (time(0) - n->hold_timer);
+
+	if (host_held_since(h) == 0) {
+		host_set_held_since(h, time(0));
+		return HOST_HOLD_SEC;
 	}
+
+	diff = time(0) - host_held_since(h);
+	if (diff >= HOST_HOLD_SEC)
+		return 0;
+	return HOST_HOLD_SEC - diff;
 }
 
 void
 server_unauthorize(struct webgw *server, const char *host, int port)
 {
-	struct hostport *n;
-
-	n = server_find_from_authlist(server->unauthorized_head, host, port);
-	if (n == NULL)
-		n = server_add_to_authlist(&server->unauthorized_head,
-		    host, port);
-	if (n != NULL)
-		n->hold_timer = 0;
+	struct host *h;
+
+	h = server_host(server, host, port);
+	host_set_held_since(h, 0);
+	if (host_is_authorized(h) || host_is_held(h)) {
+		host_unauthorize(h);
+		hostdb_touch(server->hostdb, h);
+		hostdb_refile(server->hostdb, h);
+		denyset_add(server->denyset, host_name(h), host_port(h));
+		rules_invalidate();
+	}
 }
 
 void
 server_authorize(struct webgw *server, const char *host, int port)
 {
-	struct hostport *n;
+	struct host *h;
+
+	h = server_host(server, host, port);
+	host_set_held_since(h, 0);
+	if (!host_is_authorized(h)) {
+		host_authorize(h, NULL);
+		hostdb_touch(server->hostdb, h);
+		hostdb_refile(server->hostdb, h);
+		rules_invalidate();
+	}
+}
 
-	if (server_has_authorized(server, host, port))
-		return;
+/*
+ * Tells if requests to the host can be rejected without further ado:
+ * the host is denied and no rule authorizes it. False positives of the
+ * deny set are weeded out by checking the host itself, and a host whose
+ * rule verdict is not yet cached for this generation takes the normal
+ * path once to get it cached.
+ */
+int
+server_is_denied(struct webgw *server, const char *host, int port)
+{
+	struct host *h;
+	unsigned long gen;
+	const char *rule;
+
+	gen = rules_generation();
+	if (!denyset_maybe(server->denyset, host, port))
+		return 0;
+	if ((h = hostdb_lookup(server->hostdb, host, port)) == NULL ||
+	    host_is_authorized(h) || host_is_held(h))
+		return 0;
+	if (!host_policy_cached(h, gen, &rule) || rule != NULL)
+		return 0;
 
-	n = server_find_from_authlist(server->unauthorized_head, host,
-	    port);
-	if (n != NULL) {
-		if (n->next != NULL)
-			n->next->prev = n->prev;
-		if (n->prev != NULL)
-			n->prev->next = n->next;
-		if (n == server->unauthorized_head)
-			server->unauthorized_head = n->next;
-		free(n);
+	host_incr_visits(h);
+	hostdb_touch(server->hostdb, h);
+	return 1;
+}
+
+/*
+ * Counts the denied hosts in state, adding them to the deny set if add
+ * is set.
+ */
+static size_t
+denied_hosts(struct webgw *ctx, int state, int add)
+{
+	struct hostdb_cursor *cur;
+	struct host *h;
+	size_t n;
+
+	n = 0;
+	cur = hostdb_cursor_open(ctx->hostdb, state);
+	while ((h = hostdb_cursor_next(ctx->hostdb, cur)) != NULL) {
+		if (host_is_authorized(h) || host_is_held(h))
+			continue;
+		if (add)
+			denyset_add(ctx->denyset, host_name(h), host_port(h));
+		n++;
 	}
+	hostdb_cursor_close(ctx->hostdb, cur);
+
+	return n;
+}
+
+/*
+ * Refills the deny set from the denied hosts: those on the unauthorized
+ * list that are not held, and the denied ones in use. It is sized for
+ * twice as many, to leave room for hosts denied later.
+ */
+void
+server_denyset_rebuild(struct webgw *ctx)
+{
+	struct rules_stats rst;
+	size_t n;
+
+	n = denied_hosts(ctx, HOSTDB_UNAUTHORIZED, 0) +
+	    denied_hosts(ctx, HOSTDB_ACTIVE, 0);
+	denyset_reset(ctx->denyset, 2 * n);
+	denied_hosts(ctx, HOSTDB_UNAUTHORIZED, 1);
+	denied_hosts(ctx, HOSTDB_ACTIVE, 1);
 
-	n = server_add_to_authlist(&server->authorized_head, host, port);
+	rules_get_stats(&rst);
+	ctx->denyset_reloads = rst.reloads;
 }
 
 static void
@@ -178,10 +232,11 @@ init_webserver(struct webgw *ctx, const char *addr, int port)
 	if ((ctx->serverfd_webserver = tcpbind(addr, port)) < 0) 
 		err(1, "listening on TCP %s:%d (webserver)", addr, port);
 	else
-		syslog(LOG_INFO, "listening on %s:%d (webserver) fd=%d",
+		log_msg(LOG_INFO, "listening on %s:%d (webserver) fd=%d",
 		    addr, port, ctx->serverfd_webserver);
 
 	callback.readfunc = acceptclient_webserver;
+	callback.readkind = CB_ACCEPT_ADMIN;
 
 	EV_SET(&changelist[0], ctx->serverfd_webserver,
 	    EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, &callback);
@@ -193,9 +248,10 @@ init_webserver(struct webgw *ctx, const char *addr, int port)
 void
 init(struct webgw *ctx, const char *addr, int port)
 {
-	struct kevent changelist[2];
+	struct kevent changelist[3];
 	static struct evcallback callback;
 	static struct evcallback timercallback;
+	static struct evcallback statscallback;
 
 	assert(ctx != NULL);
 	assert(addr != NULL);
@@ -208,78 +264,228 @@ init(struct webgw *ctx, const char *addr, int port)
 	if (ctx->serverhostname[sizeof(ctx->serverhostname)-1] != '\0')
 		errx(1, "serverhostname not null terminated");
 
-	syslog(LOG_INFO, "hostname: %s", ctx->serverhostname);
+	log_msg(LOG_INFO, "hostname: %s", ctx->serverhostname);
 
 	if ((ctx->serverfd = tcpbind(addr, port)) < 0) 
 		err(1, "listening on TCP %s:%d", addr, port);
 	else
-		syslog(LOG_INFO, "listening on %s:%d (fd=%d)", addr, port,
+		log_msg(LOG_INFO, "listening on %s:%d (fd=%d)", addr, port,
 		    ctx->serverfd);
 
 	if ((ctx->kq = kqueue()) == -1)
 		err(1, "setting up event queue");
 
 	callback.readfunc = acceptclient;
+	callback.readkind = CB_ACCEPT;
 
 	timercallback.readfunc = dotimer;
 	timercallback.writefunc = dotimer;
+	timercallback.readkind = CB_HOUSEKEEPING;
+	timercallback.writekind = CB_HOUSEKEEPING;
 
-	ctx->refill_queue = 0;
-
-	ctx->server_max_usec = 0;
-	ctx->server_sum_usec = 0;
-	ctx->server_samples = 0;
+	statscallback.readfunc = publish_stats;
+	statscallback.readkind = CB_HOUSEKEEPING;
 
-	ctx->client_max_usec = 0;
-	ctx->client_sum_usec = 0;
-	ctx->client_samples = 0;
-
-	ctx->target_max_usec = 0;
-	ctx->target_sum_usec = 0;
-	ctx->target_samples = 0;
-
-	ctx->resolv_max_usec = 0;
-	ctx->resolv_sum_usec = 0;
-	ctx->resolv_samples = 0;
-
-	ctx->request_size_max = 0;
-	ctx->request_size_sum = 0;
-	ctx->request_size_samples = 0;
+	ctx->refill_queue = 0;
+	memset(ctx->phase, 0, sizeof(ctx->phase));
 
 	EV_SET(&changelist[0], ctx->serverfd,
 	    EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, &callback);
 
-#if 0
+	/*
+	 * Periodic housekeeping, e.g. flushing the hostdb journal.
+	 */
 	EV_SET(&changelist[1], 1,
-	    EVFILT_TIMER, EV_ADD | EV_ENABLE, 0, 5000, &timercallback);
-#endif
+	    EVFILT_TIMER, EV_ADD | EV_ENABLE, 0, HOSTDB_FLUSH_MSEC,
+	    &timercallback);
+	EV_SET(&changelist[2], 2,
+	    EVFILT_TIMER, EV_ADD | EV_ENABLE, 0, STATS_PUBLISH_MSEC,
+	    &statscallback);
 
-	if (kevent(ctx->kq, changelist, 1, NULL, 0, NULL) == -1)
+	if (kevent(ctx->kq, changelist, 3, NULL, 0, NULL) == -1)
 		err(1, "adding listening socket to event queue");
 
 	init_webserver(ctx, addr, 8080);
 
 	ctx->hostdb = hostdb_create();
+	if (ctx->hostdb_max_bytes == 0)
+		ctx->hostdb_max_bytes = (size_t) HOSTDB_MAX_MB * 1024 * 1024;
+	hostdb_set_max_bytes(ctx->hostdb, ctx->hostdb_max_bytes);
+	hostdb_load(ctx->hostdb);
 	rules_load();
+
+	ctx->accesslog = accesslog_open(ACCESSLOG_FILE);
+	ctx->shmstats = shmstats_open(STATS_FILE);
+
+	ctx->denyset = denyset_create();
+	server_denyset_rebuild(ctx);
+	clock_gettime(CLOCK_MONOTONIC, &ctx->fastreject_ts);
 }
 
 static void
 dotimer(struct webgw *ctx, struct client *client)
 {
-	syslog(LOG_INFO, "server timer tick");
+	struct hostdb_stats hs;
+	struct rules_stats rst;
+	struct timespec now;
+	double sec;
+
+	hostdb_flush(ctx->hostdb);
+
+	rules_get_stats(&rst);
+	if (rst.reloads != ctx->denyset_reloads ||
+	    denyset_full(ctx->denyset))
+		server_denyset_rebuild(ctx);
+
+	hostdb_get_stats(ctx->hostdb, &hs);
+	if (hs.evictions != ctx->hostdb_evictions)
+		log_msg(LOG_INFO, "hostdb: %zu hosts, %.1f/%.1f MB, "
+		    "%lu evicted", hs.nhosts, hs.bytes / 1048576.0,
+		    hs.max_bytes / 1048576.0,
+		    hs.evictions - ctx->hostdb_evictions);
+	ctx->hostdb_evictions = hs.evictions;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	sec = (now.tv_sec - ctx->fastreject_ts.tv_sec) +
+	    (now.tv_nsec - ctx->fastreject_ts.tv_nsec) / 1e9;
+	if (sec > 0)
+		ctx->fastreject_rate =
+		    (ctx->fastreject_total - ctx->fastreject_last) / sec;
+	if (ctx->fastreject_total != ctx->fastreject_last)
+		log_msg(LOG_INFO, "fast rejects: %.1f/s (%lu total)",
+		    ctx->fastreject_rate, ctx->fastreject_total);
+	ctx->fastreject_last = ctx->fastreject_total;
+	ctx->fastreject_ts = now;
 }
 
+const char *
+server_callback_name(int kind)
+{
+	static const char *name[NCALLBACKS] = {
+		[CB_ACCEPT]		= "acceptclient",
+		[CB_ACCEPT_ADMIN]	= "acceptclient_webserver",
+		[CB_HOUSEKEEPING]	= "dotimer",
+		[CB_READCLIENT]		= "readclient",
+		[CB_READTARGET]		= "readtarget",
+		[CB_CONNECT]		= "connect_completed",
+		[CB_RESOLV]		= "resolv",
+		[CB_TIMEOUT]		= "client_timeout",
+		[CB_REPROCESS]		= "reprocess_body",
+		[CB_ADMIN_READ]		= "webclient_read",
+		[CB_ADMIN_WRITE]	= "webclient_write",
+	};
+
+	assert(kind >= 0 && kind < NCALLBACKS);
+	return name[kind];
+}
+
+/*
+ * Copies the counters into the stats segment for webgw-top, with the
+ * hosts that have connections open ranked by traffic. Only active
+ * hosts are ranked, so this stays cheap with a large hostdb.
+ */
+static void
+publish_stats(struct webgw *ctx, struct client *client)
+{
+	struct shmstats *s;
+	struct shmstats_host top[SHMSTATS_TOP];
+	struct hostdb_stats hs;
+	struct hostdb_cursor *cur;
+	struct log_stats ls;
+	struct timespec now;
+	struct host *h;
+	uint64_t traffic;
+	size_t ntop, i;
+
+	client_log_phases(ctx);
+
+	if ((s = ctx->shmstats) == NULL)
+		return;
+
+	/* Insertion into the short sorted table, before shmstats_begin() */
+	ntop = 0;
+	cur = hostdb_cursor_open(ctx->hostdb, HOSTDB_ACTIVE);
+	while ((h = hostdb_cursor_next(ctx->hostdb, cur)) != NULL) {
+		traffic = host_rx_bytes(h) + host_tx_bytes(h);
+		for (i = ntop; i > 0 &&
+		    top[i - 1].rx + top[i - 1].tx < traffic; i--)
+			if (i < SHMSTATS_TOP)
+				top[i] = top[i - 1];
+		if (i == SHMSTATS_TOP)
+			continue;
+		strlcpy(top[i].name, host_name(h), sizeof(top[i].name));
+		top[i].port = host_port(h);
+		top[i].conns = host_ref_count(h);
+		top[i].rx = host_rx_bytes(h);
+		top[i].tx = host_tx_bytes(h);
+		if (ntop < SHMSTATS_TOP)
+			ntop++;
+	}
+	hostdb_cursor_close(ctx->hostdb, cur);
+
+	hostdb_get_stats(ctx->hostdb, &hs);
+	log_get_stats(&ls);
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	shmstats_begin(s);
+	s->time_usec = (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	s->accepted = ctx->accepted_total;
+	s->bytes_upstream = ctx->bytes_upstream;
+	s->bytes_downstream = ctx->bytes_downstream;
+	s->denied_fast = ctx->fastreject_total;
+	s->denied_policy = ctx->denied_policy;
+	s->denied_port = ctx->denied_port;
+	s->dns_failures = ctx->dns_failures;
+	s->loop_stalls = ctx->loop_stalls;
+	s->log_dropped = ls.dropped;
+	s->hostdb_hosts = hs.nhosts;
+	s->hostdb_bytes = hs.bytes;
+	s->hostdb_evictions = hs.evictions;
+	s->loop_lag_p99_usec = hist_percentile(&ctx->loop_lag, 0.99);
+	s->firstbyte_p50_usec =
+	    hist_percentile(&ctx->phase[PHASE_FIRSTBYTE], 0.5);
+	s->firstbyte_p99_usec =
+	    hist_percentile(&ctx->phase[PHASE_FIRSTBYTE], 0.99);
+	s->nclient = ctx->nclient;
+	for (i = 0; i < NCONNSTATES && i < SHMSTATS_NSTATES; i++)
+		s->nconn[i] = ctx->nconn[i];
+	s->ntop = ntop;
+	memcpy(s->top, top, ntop * sizeof(top[0]));
+	shmstats_end(s);
+}
+
+/*
+ * Runs the callbacks of one batch of events. Each is timed into the
+ * histogram of its kind, and the whole batch into loop_lag, as that is
+ * how long an event arriving meanwhile waits. A batch over
+ * LOOP_STALL_MSEC is logged with its slowest callback.
+ */
 void
 server_dispatch_events(struct webgw *ctx)
 {
 	static struct kevent evlist[QUEUE_DEPTH];
 	struct evcallback *callback;
 	struct kevent *ev;
-	int i, nevents;
+	struct timespec ts_batch, ts_prev, ts_now;
+	char rid[sizeof(((struct client *) 0)->rid)];
+	char slow_rid[sizeof(rid)];
+	uint64_t usec, slow_usec;
+	int i, nevents, kind, slow_kind;
+
+	rules_quiesce();
 
 	nevents = kevent(ctx->kq, NULL, 0, evlist, QUEUE_DEPTH, NULL);
-	if (nevents == -1)
+	if (nevents == -1) {
+		if (errno == EINTR)	/* SIGPROF, with the profiler on */
+			return;
 		err(1, "reading events from event queue");
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts_batch);
+	ts_prev = ts_batch;
+	slow_usec = 0;
+	slow_kind = CB_ACCEPT;
+	slow_rid[0] = '\0';
 
 	/*
 	 * We need to keep QUEUE_DEPTH as 1 until we fix the situation
@@ -290,6 +496,14 @@ server_dispatch_events(struct webgw *ctx)
 		ev = &evlist[i];
 
 		callback = ev->udata;
+		kind = (ev->filter == EVFILT_WRITE) ? callback->writekind :
+		    callback->readkind;
+		/* The callback may free the client */
+		if (callback->client != NULL)
+			memcpy(rid, callback->client->rid, sizeof(rid));
+		else
+			rid[0] = '\0';
+
 		if (ev->filter == EVFILT_READ)
 			callback->readfunc(ctx, callback->client);
 		else if (ev->filter == EVFILT_WRITE)
@@ -299,6 +513,16 @@ server_dispatch_events(struct webgw *ctx)
 		else
 			assert(0);
 
+		clock_gettime(CLOCK_MONOTONIC, &ts_now);
+		usec = hist_usec(&ts_prev, &ts_now);
+		hist_record(&ctx->callback[kind], usec);
+		if (usec > slow_usec) {
+			slow_usec = usec;
+			slow_kind = kind;
+			memcpy(slow_rid, rid, sizeof(rid));
+		}
+		ts_prev = ts_now;
+
 		/*
 		 * We need this hack until we implement a more elegant
 		 * solution for breaking this event-callback loop in
@@ -311,6 +535,16 @@ server_dispatch_events(struct webgw *ctx)
 			break;
 		}
 	}
+
+	usec = hist_usec(&ts_batch, &ts_prev);
+	hist_record(&ctx->loop_lag, usec);
+	if (usec > LOOP_STALL_MSEC * 1000) {
+		ctx->loop_stalls++;
+		log_msg(LOG_WARNING, "stall: %d events took %.1f ms, "
+		    "%s %.1f ms%s%s", nevents, usec / 1000.0,
+		    server_callback_name(slow_kind), slow_usec / 1000.0,
+		    slow_rid[0] != '\0' ? " client " : "", slow_rid);
+	}
 }
 
 static void
@@ -321,11 +555,11 @@ acceptclient_webserver(struct webgw *ctx, struct client *client)
 	socklen_t sz = sizeof(a);
 	char *addr;
 
-	syslog(LOG_INFO, "acceptclient_webserver");
+	log_msg(LOG_DEBUG, "acceptclient_webserver");
 
 	if ((fd = accept(ctx->serverfd_webserver,
 	    (struct sockaddr *) &a, &sz)) == -1) {
-		syslog(LOG_ERR, "accept: %m");
+		log_msg(LOG_ERR, "accept: %s", strerror(errno));
 		return;
 	}
 
@@ -333,14 +567,15 @@ acceptclient_webserver(struct webgw *ctx, struct client *client)
 	 * If we're full, we simply start dropping connections.
 	 */
 	if (ctx->nclient == MAX_CLIENTS) {
-		syslog(LOG_ERR, "dropped connection (max clients reached)");
+		log_msg(LOG_ERR, "dropped connection (max clients reached)");
 		close(fd);
 		return;
 	}
 
-	client = calloc(1, sizeof(struct client));
+	client = mem_calloc(MEM_CLIENT, 1, sizeof(struct client));
 	if (client == NULL) {
-		syslog(LOG_ERR, "couldn't allocate client: %m");
+		log_msg(LOG_ERR, "couldn't allocate client: %s",
+		    strerror(errno));
 		close(fd);
 		return;
 	}
@@ -348,7 +583,7 @@ acceptclient_webserver(struct webgw *ctx, struct client *client)
 
 	addr = inet_ntoa(a.sin_addr);
 	mkrid(client);
-	syslog(LOG_INFO, "[%s] new client (webserver) fd=%d ip=%s",
+	log_msg(LOG_INFO, "[%s] new client (webserver) fd=%d ip=%s",
 	    client->rid, fd, addr);
 
 	webclient_init(ctx, client, fd);
@@ -359,7 +594,6 @@ static void acceptclient(struct webgw *ctx, struct client *client)
 	int fd;
 	struct sockaddr_in a;
 	socklen_t sz = sizeof(a);
-	int usec;
 	char *addr;
 
 	struct timespec tv_before, tv_after;
@@ -367,7 +601,7 @@ static void acceptclient(struct webgw *ctx, struct client *client)
 	clock_gettime(CLOCK_MONOTONIC, &tv_before);
 
 	if ((fd = accept(ctx->serverfd, (struct sockaddr *) &a, &sz)) == -1) {
-		syslog(LOG_ERR, "accept: %m");
+		log_msg(LOG_ERR, "accept: %s", strerror(errno));
 		return;
 	}
 
@@ -375,32 +609,29 @@ static void acceptclient(struct webgw *ctx, struct client *client)
 	 * If we're full, we simply start dropping connections.
 	 */
 	if (ctx->nclient == MAX_CLIENTS) {
-		syslog(LOG_ERR, "dropped connection (max clients reached)");
+		log_msg(LOG_ERR, "dropped connection (max clients reached)");
 		close(fd);
 		return;
 	}
 
-	client = calloc(1, sizeof(struct client));
+	client = mem_calloc(MEM_CLIENT, 1, sizeof(struct client));
 	if (client == NULL) {
-		syslog(LOG_ERR, "couldn't allocate client: %m");
+		log_msg(LOG_ERR, "couldn't allocate client: %s",
+		    strerror(errno));
 		close(fd);
 		return;
 	}
 	ctx->nclient++;
+	ctx->accepted_total++;
 
 	addr = inet_ntoa(a.sin_addr);
 	mkrid(client);
-	syslog(LOG_INFO, "[%s] new client fd=%d ip=%s",
+	log_msg(LOG_INFO, "[%s] new client fd=%d ip=%s",
 	    client->rid, fd, addr);
 
 	initclient(client, fd, ctx);
 
 	clock_gettime(CLOCK_MONOTONIC, &tv_after);
-
-	usec = (tv_after.tv_nsec - tv_before.tv_nsec) / 1000;
-	if (usec > ctx->server_max_usec)
-		ctx->server_max_usec = usec;
-	ctx->server_sum_usec += usec;
-	ctx->server_samples++;
-
+	hist_record(&ctx->phase[PHASE_ACCEPT],
+	    hist_usec(&tv_before, &tv_after));
 }
@@ -1,7 +1,8 @@
 #ifndef SERVER_H
 #define SERVER_H
 
-struct hostport;
+struct host;
+struct hostnode;
 
 void			 server_unauthorize(struct webgw *, const char *, int);
 void			 server_authorize(struct webgw *, const char *, int);
@@ -9,7 +10,10 @@ int			 server_hold(struct webgw *, const char *, int);
 int			 server_on_hold(struct webgw *, const char *, int);
 int			 server_has_authorized(struct webgw *,
 			    const char *, int);
-struct hostport		*server_iterate_unauthorized(struct webgw *,
-			    struct hostport **, const char **, int *, int *);
+struct host		*server_iterate_unauthorized(struct webgw *,
+			    struct hostnode **, int *);
+int			 server_is_denied(struct webgw *, const char *, int);
+void			 server_denyset_rebuild(struct webgw *);
+const char		*server_callback_name(int);
 
 #endif
@@ -0,0 +1,60 @@
+#include "shmstats.h"
+#include <stddef.h>
+#include <string.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+/*
+ * Maps file as the stats segment, creating it if needed, and marks it
+ * as ours. Returns NULL, having logged why, if it cannot.
+ */
+struct shmstats *
+shmstats_open(const char *file)
+{
+	struct shmstats *self;
+	int fd;
+
+	if ((fd = open(file, O_RDWR | O_CREAT, 0644)) == -1) {
+		syslog(LOG_ERR, "shmstats: %s: %m", file);
+		return NULL;
+	}
+	if (ftruncate(fd, sizeof(struct shmstats)) == -1) {
+		syslog(LOG_ERR, "shmstats: ftruncate %s: %m", file);
+		close(fd);
+		return NULL;
+	}
+	self = mmap(NULL, sizeof(struct shmstats), PROT_READ | PROT_WRITE,
+	    MAP_SHARED, fd, 0);
+	close(fd);
+	if (self == MAP_FAILED) {
+		syslog(LOG_ERR, "shmstats: mmap %s: %m", file);
+		return NULL;
+	}
+
+	shmstats_begin(self);
+	memset(&self->pid, 0,
+	    sizeof(struct shmstats) - offsetof(struct shmstats, pid));
+	memcpy(self->magic, SHMSTATS_MAGIC, sizeof(self->magic));
+	self->version = SHMSTATS_VERSION;
+	self->size = sizeof(struct shmstats);
+	self->pid = getpid();
+	shmstats_end(self);
+
+	return self;
+}
+
+void
+shmstats_begin(struct shmstats *self)
+{
+	__atomic_store_n(&self->seq, self->seq | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void
+shmstats_end(struct shmstats *self)
+{
+	__atomic_store_n(&self->seq, self->seq + 1, __ATOMIC_RELEASE);
+}
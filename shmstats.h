@@ -0,0 +1,65 @@
+#ifndef SHMSTATS_H
+#define SHMSTATS_H
+
+#include <stdint.h>
+
+/*
+ * Counters and gauges of a running webgw, published into a file that
+ * readers such as webgw-top map. The writer makes seq odd while it
+ * updates the rest and even again when done, so a reader copies the
+ * whole struct and keeps the copy only if seq was even and unchanged
+ * around it. Readers never write to the segment and the proxy never
+ * waits for them.
+ */
+
+#define SHMSTATS_MAGIC		"webgwsts"
+#define SHMSTATS_VERSION	1
+#define SHMSTATS_TOP		16	/* Hosts in the top table */
+#define SHMSTATS_NSTATES	8	/* Room for enum conn_state */
+
+struct shmstats_host
+{
+	char name[64];
+	uint32_t port;
+	uint32_t conns;		/* Open connections to it */
+	uint64_t rx;		/* Bytes, since it was first seen */
+	uint64_t tx;
+};
+
+struct shmstats
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t size;		/* Of struct shmstats */
+	uint64_t seq;		/* Odd while being written */
+	int64_t pid;
+	uint64_t time_usec;	/* Of publishing, since the epoch */
+
+	uint64_t accepted;	/* Proxy connections, ever */
+	uint64_t bytes_upstream;
+	uint64_t bytes_downstream;
+	uint64_t denied_fast;
+	uint64_t denied_policy;
+	uint64_t denied_port;
+	uint64_t dns_failures;
+	uint64_t loop_stalls;
+	uint64_t log_dropped;
+	uint64_t hostdb_hosts;
+	uint64_t hostdb_bytes;
+	uint64_t hostdb_evictions;
+
+	uint64_t loop_lag_p99_usec;
+	uint64_t firstbyte_p50_usec;
+	uint64_t firstbyte_p99_usec;
+
+	uint32_t nclient;
+	uint32_t nconn[SHMSTATS_NSTATES];	/* By enum conn_state */
+	uint32_t ntop;
+	struct shmstats_host top[SHMSTATS_TOP];	/* By traffic */
+};
+
+struct shmstats *shmstats_open  (const char *);
+void             shmstats_begin (struct shmstats *);
+void             shmstats_end   (struct shmstats *);
+
+#endif
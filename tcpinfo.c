@@ -0,0 +1,44 @@
+#include "tcpinfo.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#ifdef __linux__
+#include <linux/tcp.h>	/* glibc's struct tcp_info lacks the rate */
+#endif
+
+/*
+ * Fills ti from the socket fd. Returns 0, or -1 with errno set if the
+ * system has no TCP_INFO or the socket is not TCP.
+ */
+int
+tcpinfo_get(int fd, struct tcpinfo *ti)
+{
+#if defined(__linux__) && defined(TCP_INFO)
+	struct tcp_info info;
+	socklen_t len;
+
+	memset(&info, 0, sizeof(info));
+	len = sizeof(info);
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1)
+		return -1;
+
+	ti->rtt_usec = info.tcpi_rtt;
+	ti->retransmits = info.tcpi_total_retrans;
+	/* Older kernels return a shorter struct */
+	if (len >= offsetof(struct tcp_info, tcpi_delivery_rate) +
+	    sizeof(info.tcpi_delivery_rate))
+		ti->delivery_rate = info.tcpi_delivery_rate;
+	else
+		ti->delivery_rate = 0;
+	return 0;
+#else
+	(void) fd;
+	memset(ti, 0, sizeof(*ti));
+	errno = ENOPROTOOPT;
+	return -1;
+#endif
+}
@@ -0,0 +1,18 @@
+#ifndef TCPINFO_H
+#define TCPINFO_H
+
+/*
+ * What the kernel knows about a TCP connection, for telling slow
+ * targets apart from time spent in the proxy. Only the Linux build
+ * reads it; elsewhere tcpinfo_get() always fails.
+ */
+struct tcpinfo
+{
+	unsigned rtt_usec;		/* Smoothed round trip time */
+	unsigned retransmits;		/* Over the life of the connection */
+	unsigned long long delivery_rate; /* Bytes per second, 0 if unknown */
+};
+
+int tcpinfo_get(int, struct tcpinfo *);
+
+#endif
@@ -0,0 +1,206 @@
+#include "extern.h"
+#include "trace.h"
+#include "dynstr.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Timelines of a sample of proxied connections, exported as Chrome
+ * trace events for chrome://tracing or Perfetto. A connection is picked
+ * when it is accepted, with probability trace_rate(), and its timeline
+ * copied here when it is removed. The last TRACE_SAMPLES are kept.
+ *
+ * Each connection is a thread of its own in the trace, with a span for
+ * the whole connection and one for each phase it went through.
+ */
+
+enum mark
+{
+	MARK_BEGIN,
+	MARK_HEADERS,
+	MARK_POLICY,
+	MARK_HELD,
+	MARK_RESOLVE,
+	MARK_RESOLVED,
+	MARK_CONNECT,
+	MARK_FIRSTBYTE,
+	MARK_END,
+	NMARKS
+};
+
+struct sample
+{
+	char rid[9];
+	char method[8];
+	char host[256];
+	int port;
+	uint64_t usec[NMARKS];	/* 0 if not reached */
+};
+
+/*
+ * Phases shown, each between two marks.
+ */
+static const struct
+{
+	const char *name;
+	int from;
+	int to;
+} _phases[] = {
+	{ "parse", MARK_BEGIN, MARK_HEADERS },
+	{ "policy", MARK_HEADERS, MARK_POLICY },
+	{ "hold", MARK_HELD, MARK_RESOLVE },
+	{ "dns", MARK_RESOLVE, MARK_RESOLVED },
+	{ "connect", MARK_RESOLVED, MARK_CONNECT },
+	{ "origin", MARK_CONNECT, MARK_FIRSTBYTE },
+	{ "transfer", MARK_FIRSTBYTE, MARK_END },
+};
+
+static struct sample _samples[TRACE_SAMPLES];
+static unsigned long _nsamples;	/* Ever added */
+static uint32_t _ppm = TRACE_RATE_PPM;	/* Sampled per million */
+static struct dynstr _out;
+
+static uint64_t _usec(const struct timespec *);
+static void     _span(const char *, uint64_t, uint64_t, int);
+static void     _json_str(const char *);
+
+/*
+ * Returns 1 if a new connection should be traced.
+ */
+int
+trace_sample(void)
+{
+	return _ppm > 0 && arc4random_uniform(1000000) < _ppm;
+}
+
+void
+trace_add(const struct client *client)
+{
+	struct sample *s;
+
+	s = &_samples[_nsamples++ % TRACE_SAMPLES];
+	memset(s, 0, sizeof(*s));
+	strlcpy(s->rid, client->rid, sizeof(s->rid));
+	if (client->parser.state == HTTP_BODY) {
+		strlcpy(s->method, client->parser.method, sizeof(s->method));
+		strlcpy(s->host, client->parser.host, sizeof(s->host));
+		s->port = client->parser.port;
+	}
+
+	s->usec[MARK_BEGIN] = _usec(&client->ts_begin);
+	s->usec[MARK_HEADERS] = _usec(&client->ts_headers);
+	s->usec[MARK_POLICY] = _usec(&client->ts_policy);
+	s->usec[MARK_HELD] = _usec(&client->ts_held);
+	s->usec[MARK_RESOLVE] = _usec(&client->ts_resolve);
+	s->usec[MARK_RESOLVED] = _usec(&client->ts_resolved);
+	if (client->targetconnected)
+		s->usec[MARK_CONNECT] = _usec(&client->ts_connect);
+	if (client->bytes_from_target > 0)
+		s->usec[MARK_FIRSTBYTE] = _usec(&client->ts_firstbyte);
+	s->usec[MARK_END] = _usec(&client->ts_end);
+}
+
+/*
+ * Sets the fraction of connections traced, from 0 to 1.
+ */
+void
+trace_set_rate(double rate)
+{
+	if (rate < 0)
+		rate = 0;
+	if (rate > 1)
+		rate = 1;
+	_ppm = rate * 1000000;
+}
+
+double
+trace_rate(void)
+{
+	return _ppm / 1000000.0;
+}
+
+/*
+ * Returns the samples as a JSON trace, with its length in len, or NULL
+ * if out of memory. It is valid until the next call.
+ */
+const char *
+trace_render(size_t *len)
+{
+	const struct sample *s;
+	unsigned long i, first;
+	uint64_t from, to;
+	const char *str;
+	size_t j;
+	int tid;
+
+	dynstr_clear(&_out);
+	dynstr_add(&_out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+	    "{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\","
+	    "\"args\":{\"name\":\"webgw\"}}");
+
+	first = _nsamples > TRACE_SAMPLES ? _nsamples - TRACE_SAMPLES : 0;
+	for (i = first; i < _nsamples; i++) {
+		s = &_samples[i % TRACE_SAMPLES];
+		tid = i - first + 1;
+
+		dynstr_add(&_out, ",\n{\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+		    "\"name\":\"thread_name\",\"args\":{\"name\":\"", tid);
+		_json_str(s->rid);
+		dynstr_add(&_out, " ");
+		_json_str(s->method);
+		dynstr_add(&_out, " ");
+		_json_str(s->host);
+		dynstr_add(&_out, ":%d\"}}", s->port);
+
+		_span("connection", s->usec[MARK_BEGIN], s->usec[MARK_END],
+		    tid);
+		for (j = 0; j < sizeof(_phases) / sizeof(_phases[0]); j++) {
+			from = s->usec[_phases[j].from];
+			to = s->usec[_phases[j].to];
+			/* A host can be held until the client gives up */
+			if (to == 0 && _phases[j].from == MARK_HELD)
+				to = s->usec[MARK_END];
+			if (from != 0 && to != 0)
+				_span(_phases[j].name, from, to, tid);
+		}
+	}
+	dynstr_add(&_out, "\n]}\n");
+
+	if ((str = dynstr_get(&_out)) != NULL)
+		*len = dynstr_len(&_out);
+	return str;
+}
+
+static uint64_t
+_usec(const struct timespec *ts)
+{
+	return (uint64_t) ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+static void
+_span(const char *name, uint64_t from, uint64_t to, int tid)
+{
+	dynstr_add(&_out, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+	    "\"name\":\"%s\",\"ts\":%llu,\"dur\":%llu}", tid, name,
+	    (unsigned long long) from,
+	    (unsigned long long) (to > from ? to - from : 0));
+}
+
+/*
+ * Adds s, escaped to go between the quotes of a JSON string.
+ */
+static void
+_json_str(const char *s)
+{
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\')
+			dynstr_add(&_out, "\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			dynstr_add(&_out, "\\u%04x", (unsigned char) *s);
+		else
+			dynstr_add(&_out, "%c", *s);
+	}
+}
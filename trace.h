@@ -0,0 +1,14 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+
+struct client;
+
+int         trace_sample    (void);
+void        trace_add       (const struct client *);
+void        trace_set_rate  (double);
+double      trace_rate      (void);
+const char *trace_render    (size_t *);
+
+#endif
@@ -6,6 +6,11 @@
 #include "hostdb.h"
 #include "host.h"
 #include "rules.h"
+#include "metrics.h"
+#include "trace.h"
+#include "log.h"
+#include "mem.h"
+#include "prof.h"
 
 #include <sys/types.h>
 #include <sys/event.h>
@@ -15,12 +20,148 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+
+/*
+ * The host listing is written as a chunked response, a little at a time:
+ * every time the socket is writable, at most ADMIN_LIST_STEP hosts are
+ * visited and about ADMIN_LIST_CHUNK bytes rendered before returning to
+ * the event loop, so a large hostdb does not hold up proxy traffic.
+ * Each section is read through a hostdb cursor over the hosts in its
+ * state, which stays valid when hosts are evicted in between. Sorting
+ * by traffic keeps the top hosts of the section in a heap while its
+ * cursor is walked, and renders them once the walk is done.
+ */
+
+enum list_phase
+{
+	LIST_HEAD,
+	LIST_SECTION,
+	LIST_SCAN,		/* Collecting the top hosts, when sorting */
+	LIST_SKIP,		/* Skipping to the page, when not sorting */
+	LIST_ROWS,
+	LIST_SECTION_END,
+	LIST_TAIL,
+	LIST_DONE
+};
+
+static const struct section
+{
+	int state;		/* -1 for the rules form */
+	const char *title;
+	const char *key;	/* In the state= argument */
+} sections[] = {
+	{ HOSTDB_ACTIVE, "Active", "active" },
+	{ -1, "Wildcard Rules", NULL },
+	{ HOSTDB_AUTHORIZED, "Authorized", "authorized" },
+	{ HOSTDB_UNAUTHORIZED, "Unauthorized", "unauthorized" },
+};
+#define NSECTIONS	(sizeof(sections) / sizeof(sections[0]))
+
+struct row
+{
+	char *name;		/* Owned when in the heap */
+	int port;
+	int refs;
+	int authorized;
+	int held;
+	unsigned long long visits;
+	unsigned long long rx;
+	unsigned long long tx;
+	struct host_tcp_stats tcp;
+};
+
+struct response
+{
+	struct dynstr *out;	/* Queued for the client */
+	size_t sent;		/* Bytes of out already written */
+
+	struct dynstr *body;	/* Written after out */
+	size_t bodysent;
+	void (*release)(struct dynstr *); /* Disposes of body */
+
+	int phase;
+	int only;		/* State asked for, or -1 for all */
+	int sort;		/* By traffic, or in filing order */
+	size_t page;
+	size_t per;
+
+	size_t section;
+	struct hostdb_cursor *cursor;
+	size_t skip;
+	size_t left;		/* Rows left on the page */
+
+	struct row *rows;	/* Heap of the top hosts, when sorting */
+	size_t nrows;
+	size_t maxrows;
+	size_t next;		/* Next row to render, once sorted */
+
+	struct dynstr *frag;	/* Section being rendered */
+	size_t fragpos;		/* Bytes of frag already copied out */
+	unsigned long gen;	/* Of what the section shows */
+	int error;		/* errno, if rendering failed */
+
+	struct prof_render *prof;	/* Profile being folded, if not a list */
+};
+
+struct fragment
+{
+	size_t section;
+	int only;
+	size_t page;
+	size_t per;
+	int sort;
+	unsigned long gen;
+	unsigned long used;	/* cache_clock when last used */
+	char *html;		/* NULL if the slot is free */
+};
+
+static struct fragment cache[ADMIN_CACHE_SLOTS];
+static unsigned long cache_clock;
 
 static void	 webclient_read(struct webgw *, struct client *);
+static void	 webclient_post_rules(struct webgw *, struct client *);
+static void	 webclient_read_body(struct webgw *, struct client *);
 static void	 webclient_write_response(struct webgw *, struct client *,
-		    int, const char *);
+		    int, const char *, const char *);
+static void	 webclient_write_body(struct webgw *, struct client *,
+		    const char *, struct dynstr *,
+		    void (*)(struct dynstr *));
+static void	 webclient_head(struct response *, int, const char *,
+		    size_t);
 static void	 webclient_list_unauthorized(struct webgw *, struct client *);
+static void	 webclient_metrics(struct webgw *, struct client *);
+static void	 webclient_trace(struct webgw *, struct client *);
+static void	 webclient_memory(struct webgw *, struct client *);
+static void	 webclient_profile(struct webgw *, struct client *);
 static void	 webclient_redirect(struct webgw *, struct client *);
+static struct response *webclient_respond(struct webgw *, struct client *);
+static void	 webclient_chunked(struct response *, const char *);
+static void	 webclient_profile_step(struct response *, struct dynstr *);
+static void	 webclient_write(struct webgw *, struct client *);
+static int	 webclient_flush(struct client *, struct response *);
+static int	 webclient_send(struct client *, const char *, size_t,
+		    size_t *);
+static void	 webclient_list_args(struct response *, const char *);
+static void	 webclient_list_step(struct webgw *, struct response *,
+		    struct dynstr *);
+static void	 webclient_list_link(struct dynstr *, struct response *,
+		    const char *, size_t, int, const char *);
+static void	 webclient_list_head(struct webgw *, struct response *,
+		    struct dynstr *);
+static void	 webclient_list_section_end(struct webgw *,
+		    struct response *, struct dynstr *);
+static void	 webclient_list_row(struct dynstr *, int, struct row *);
+static void	 webclient_list_emit(struct response *, struct dynstr *);
+static int	 webclient_cache_match(struct fragment *, struct response *);
+static const char *webclient_cache_get(struct webgw *, struct response *);
+static void	 webclient_cache_put(struct response *);
+static void	 webclient_row(struct row *, struct host *);
+static void	 webclient_top_add(struct response *, struct host *);
+static void	 webclient_top_free(struct response *);
+static int	 webclient_row_cmp(const void *, const void *);
 
 void
 webclient_init(struct webgw *ctx, struct client *client, int fd)
@@ -28,6 +169,8 @@ webclient_init(struct webgw *ctx, struct client *client, int fd)
 	struct kevent changelist[2];
 
 	client->type = CLIENT_WEBSERVER;
+	client->state = CONN_ADMIN;
+	ctx->nconn[CONN_ADMIN]++;
 	client->fd = fd;
 	client->targetfd = -1;
 
@@ -36,13 +179,17 @@ webclient_init(struct webgw *ctx, struct client *client, int fd)
 
 	client->clientcallback.client = client;
 	client->clientcallback.readfunc = webclient_read;
+	client->clientcallback.readkind = CB_ADMIN_READ;
+
+	if (fcntl(client->fd, F_SETFL, O_NONBLOCK) == -1)
+		clientlog(client, LOG_ERR, "fcntl: %s", strerror(errno));
 
 	EV_SET(&changelist[0], client->fd,
 	    EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0,
 	    &client->clientcallback);
 
 	if (kevent(ctx->kq, changelist, 1, NULL, 0, NULL) == -1) {
-		syslog(LOG_ERR, "adding listening socket to event queue: %s",
+		log_msg(LOG_ERR, "adding listening socket to event queue: %s",
 		    strerror(errno));
 	}
 }
@@ -85,7 +232,8 @@ webclient_read(struct webgw *ctx, struct client *client)
 	buf[n] = '\0';
 
 	if (parser->state != HTTP_BODY) {
-		while ((parsed = parseline(client->buf, line, sizeof(line))) !=
+		while (parser->state != HTTP_BODY &&
+		    (parsed = parseline(client->buf, line, sizeof(line))) !=
 		    -1) {
 			client->sz -= parsed;
 			client->request_size += parsed;
@@ -120,8 +268,34 @@ webclient_read(struct webgw *ctx, struct client *client)
 			return;
 		}
 		if (parser->state == HTTP_BODY) {
-			if (strcmp(parser->path, "/") == 0) {
+			if (strcmp(parser->path, "/") == 0 ||
+			    strncmp(parser->path, "/?", 2) == 0) {
 				webclient_list_unauthorized(ctx, client);
+			} else if (strcmp(parser->path, "/metrics") == 0) {
+				webclient_metrics(ctx, client);
+			} else if (strcmp(parser->path, "/trace") == 0 ||
+			    strncmp(parser->path, "/trace?", 7) == 0) {
+				webclient_trace(ctx, client);
+			} else if (strcmp(parser->path, "/memory") == 0) {
+				webclient_memory(ctx, client);
+			} else if (strncmp(parser->path, "/profile",
+			    strlen("/profile")) == 0) {
+				webclient_profile(ctx, client);
+			} else if (strncmp(parser->path, "/loglevel/",
+			    strlen("/loglevel/")) == 0) {
+				if ((n = log_level_from_name(
+				    &parser->path[strlen("/loglevel/")])) ==
+				    -1) {
+					write_error(client->fd,
+					    HTTP_STATUS_BAD_REQUEST,
+					    "Unknown log level.\r\n");
+					removeclient(ctx, client);
+					return;
+				}
+				log_msg(LOG_NOTICE, "log level set to %s",
+				    &parser->path[strlen("/loglevel/")]);
+				log_set_level(n);
+				webclient_redirect(ctx, client);
 			} else if (strncmp(parser->path, "/authorize/",
 			    strlen("/authorize/")) == 0) {
 				if (http_parse_hostport(
@@ -132,11 +306,10 @@ webclient_read(struct webgw *ctx, struct client *client)
 					    "Error parsing hostport.\r\n");
 					return;
 				}
-				syslog(LOG_INFO,
+				log_msg(LOG_INFO,
 				    "authorize req for host=%s port=%d",
 				    host, port);
-				host_authorize(hostdb_find(
-				    ctx->hostdb, host, port), NULL);
+				server_authorize(ctx, host, port);
 				webclient_redirect(ctx, client);
 			} else if (strncmp(parser->path, "/unauthorize/",
 			    strlen("/unauthorize/")) == 0) {
@@ -148,25 +321,106 @@ webclient_read(struct webgw *ctx, struct client *client)
 					    "Error parsing hostport.\r\n");
 					return;
 				}
-				syslog(LOG_INFO,
+				log_msg(LOG_INFO,
 				    "unauthorize req for host=%s port=%d",
 				    host, port);
-				host_unauthorize(hostdb_find(
-				    ctx->hostdb, host, port));
+				server_unauthorize(ctx, host, port);
 				webclient_redirect(ctx, client);
 			} else if (strncmp(parser->path, "/rules",
 			    strlen("/rules")) == 0) {
-				printf("was rules path\n");
-				webclient_redirect(ctx, client);
+				if (strcasecmp(parser->method, "POST") == 0)
+					webclient_post_rules(ctx, client);
+				else
+					webclient_redirect(ctx, client);
 			}
 		}
+	} else if (client->body != NULL)
+		webclient_read_body(ctx, client);
+}
+
+/*
+ * Starts collecting a new set of rules posted from the rules form. What
+ * is already in the buffer after the headers is the start of the body.
+ */
+static void
+webclient_post_rules(struct webgw *ctx, struct client *client)
+{
+	const char *s;
+	long len;
+
+	if ((s = http_header_value(&client->parser, "Content-Length")) ==
+	    NULL || (len = strtol(s, NULL, 10)) < 0 || len > RULES_MAX_BODY) {
+		write_error(client->fd, HTTP_STATUS_BAD_REQUEST,
+		    "Missing or too large Content-Length.\r\n");
+		removeclient(ctx, client);
+		return;
+	}
+	if ((client->body = dynstr_create()) == NULL) {
+		clientlog(client, LOG_ERR, "post_rules: %s", strerror(errno));
+		write_error(client->fd, HTTP_STATUS_INTERNAL_ERROR,
+		    "Out of memory.\r\n");
+		removeclient(ctx, client);
+		return;
+	}
+	client->content_length = len;
+
+	webclient_read_body(ctx, client);
+}
+
+/*
+ * Appends what has been read to the request body and, once all of it
+ * is there, hands the rules over to be reloaded in the background.
+ */
+static void
+webclient_read_body(struct webgw *ctx, struct client *client)
+{
+	const char *s, *type;
+	char *data;
+	int n;
+
+	n = client->sz;
+	if (n > client->content_length)
+		n = client->content_length;
+	dynstr_append(client->body, client->buf, n);
+	client->content_length -= n;
+	client->sz = 0;
+	client->request_size += n;
+
+	if (client->content_length > 0)
+		return;
+
+	if ((s = dynstr_get(client->body)) == NULL) {
+		clientlog(client, LOG_ERR, "read_body: %s", strerror(errno));
+		write_error(client->fd, HTTP_STATUS_INTERNAL_ERROR,
+		    "Out of memory.\r\n");
+		removeclient(ctx, client);
+		return;
+	}
+
+	type = http_header_value(&client->parser, "Content-Type");
+	if (type != NULL && strncasecmp(type,
+	    "application/x-www-form-urlencoded",
+	    strlen("application/x-www-form-urlencoded")) == 0)
+		data = http_form_value(s, "rules");
+	else
+		data = mem_strdup(MEM_RULES, s);
+	if (data == NULL) {
+		write_error(client->fd, HTTP_STATUS_BAD_REQUEST,
+		    "No rules submitted.\r\n");
+		removeclient(ctx, client);
+		return;
 	}
+
+	log_msg(LOG_INFO, "rules reload requested (%zu bytes)", strlen(data));
+	rules_reload_async(data);
+	webclient_redirect(ctx, client);
 }
 
 static void
 webclient_redirect(struct webgw *ctx, struct client *client)
 {
-	webclient_write_response(ctx, client, 200, 
+	webclient_write_response(ctx, client, 200,
+	    "text/html;charset=us-ascii",
 	    "<html>\n"
 	    "  <head>\n"
 	    "    <meta http-equiv=\"refresh\" "
@@ -177,148 +431,950 @@ webclient_redirect(struct webgw *ctx, struct client *client)
 	    );
 }
 
+/*
+ * Answers a scrape of "/metrics".
+ */
 static void
-webclient_list_unauthorized(struct webgw *ctx, struct client *client)
+webclient_metrics(struct webgw *ctx, struct client *client)
+{
+	struct dynstr *d;
+
+	if ((d = metrics_render(ctx)) == NULL) {
+		clientlog(client, LOG_ERR, "metrics: %s", strerror(errno));
+		write_error(client->fd, HTTP_STATUS_INTERNAL_ERROR,
+		    "Out of memory.\r\n");
+		removeclient(ctx, client);
+		return;
+	}
+	webclient_write_body(ctx, client, "text/plain; version=0.0.4", d,
+	    metrics_release);
+}
+
+/*
+ * Answers "/trace" with the sampled connection timelines as a Chrome
+ * trace. "/trace?rate=0.05" first sets the fraction of connections
+ * sampled from now on.
+ */
+static void
+webclient_trace(struct webgw *ctx, struct client *client)
+{
+	const char *s;
+	char *rate;
+	size_t len;
+
+	if (client->parser.path[6] == '?' &&
+	    (rate = http_form_value(&client->parser.path[7], "rate")) !=
+	    NULL) {
+		trace_set_rate(strtod(rate, NULL));
+		log_msg(LOG_NOTICE, "tracing %.4f of connections",
+		    trace_rate());
+		mem_free(rate);
+	}
+
+	if ((s = trace_render(&len)) == NULL) {
+		clientlog(client, LOG_ERR, "trace: %s", strerror(errno));
+		write_error(client->fd, HTTP_STATUS_INTERNAL_ERROR,
+		    "Out of memory.\r\n");
+		removeclient(ctx, client);
+		return;
+	}
+	webclient_write_response(ctx, client, 200, "application/json", s);
+}
+
+/*
+ * Answers "/memory" with the memory held by each subsystem and, in a
+ * build with MEM_DEBUG, the allocation sites holding the most.
+ */
+static void
+webclient_memory(struct webgw *ctx, struct client *client)
 {
-	static struct dynstr dn;
+	struct mem_site sites[ADMIN_MEM_SITES];
+	struct mem_stats ms;
+	struct dynstr *ds;
 	const char *s;
-	struct hostnode *n;
+	size_t i, n;
+
+	if ((ds = dynstr_create()) == NULL) {
+		clientlog(client, LOG_ERR, "memory: %s", strerror(errno));
+		write_error(client->fd, HTTP_STATUS_INTERNAL_ERROR,
+		    "Out of memory.\r\n");
+		removeclient(ctx, client);
+		return;
+	}
+	dynstr_clear(ds);
+
+	dynstr_add(ds, "%-10s %12s %12s %14s %16s\n", "subsystem",
+	    "live kB", "peak kB", "allocs", "allocated kB");
+	for (i = 0; i < NMEMTAGS; i++) {
+		mem_get_stats(i, &ms);
+		dynstr_add(ds, "%-10s %12.1f %12.1f %14llu %16.1f\n",
+		    mem_tag_name(i), ms.live / 1024.0, ms.peak / 1024.0,
+		    ms.allocs, ms.bytes / 1024.0);
+	}
+
+	n = mem_top_sites(sites, ADMIN_MEM_SITES);
+	if (n > 0)
+		dynstr_add(ds, "\n%12s %14s  %s\n", "live kB", "allocs",
+		    "site");
+	for (i = 0; i < n; i++)
+		dynstr_add(ds, "%12.1f %14llu  %s:%d\n",
+		    sites[i].live / 1024.0, sites[i].allocs, sites[i].file,
+		    sites[i].line);
+
+	if ((s = dynstr_get(ds)) == NULL) {
+		clientlog(client, LOG_ERR, "memory: %s", strerror(errno));
+		write_error(client->fd, HTTP_STATUS_INTERNAL_ERROR,
+		    "Out of memory.\r\n");
+		removeclient(ctx, client);
+	} else
+		webclient_write_response(ctx, client, 200, "text/plain", s);
+	dynstr_free(ds);
+}
+
+/*
+ * Controls the sampling profiler: "/profile/start" starts it afresh,
+ * at "/profile/start?hz=199" for another rate, "/profile/stop" stops
+ * it, and "/profile" answers with the stacks sampled so far, folded
+ * for flame graph tools.
+ */
+static void
+webclient_profile(struct webgw *ctx, struct client *client)
+{
+	const char *path = &client->parser.path[strlen("/profile")];
+	struct prof_render *pr;
+	struct prof_stats ps;
+	struct response *r;
+	char msg[128];
+	char *hz;
+
+	if (strcmp(path, "/start") == 0 || strncmp(path, "/start?", 7) == 0) {
+		hz = path[6] == '?' ? http_form_value(&path[7], "hz") : NULL;
+		if (prof_start(hz != NULL ? atoi(hz) : PROF_HZ) == -1) {
+			clientlog(client, LOG_ERR, "profile: %s",
+			    strerror(errno));
+			write_error(client->fd, HTTP_STATUS_INTERNAL_ERROR,
+			    "Failed to start the profiler.\r\n");
+			mem_free(hz);
+			removeclient(ctx, client);
+			return;
+		}
+		mem_free(hz);
+		prof_get_stats(&ps);
+		log_msg(LOG_NOTICE, "profiling at %d Hz", ps.hz);
+		snprintf(msg, sizeof(msg), "profiling at %d Hz\n", ps.hz);
+		webclient_write_response(ctx, client, 200, "text/plain", msg);
+	} else if (strcmp(path, "/stop") == 0) {
+		prof_stop();
+		prof_get_stats(&ps);
+		log_msg(LOG_NOTICE, "profiling stopped, %lu samples, "
+		    "%lu dropped", ps.samples, ps.dropped);
+		snprintf(msg, sizeof(msg),
+		    "stopped, %lu samples, %lu dropped\n", ps.samples,
+		    ps.dropped);
+		webclient_write_response(ctx, client, 200, "text/plain", msg);
+	} else if (*path == '\0') {
+		if ((pr = prof_render_begin()) == NULL) {
+			clientlog(client, LOG_ERR, "profile: %s",
+			    strerror(errno));
+			write_error(client->fd, HTTP_STATUS_INTERNAL_ERROR,
+			    "Out of memory.\r\n");
+			removeclient(ctx, client);
+			return;
+		}
+		if ((r = webclient_respond(ctx, client)) == NULL) {
+			prof_render_free(pr);
+			return;
+		}
+		r->prof = pr;
+		webclient_chunked(r, "text/plain");
+		r->phase = LIST_ROWS;
+	} else {
+		write_error(client->fd, HTTP_STATUS_BAD_REQUEST,
+		    "Unknown profiler command.\r\n");
+		removeclient(ctx, client);
+	}
+}
+
+/*
+ * Starts the listing of hosts at "/", taking its arguments from the
+ * query string: state (active, authorized or unauthorized; all if not
+ * given), page, per (hosts per page) and sort (traffic).
+ */
+static void
+webclient_list_unauthorized(struct webgw *ctx, struct client *client)
+{
+	struct response *r;
+
+	if ((r = webclient_respond(ctx, client)) == NULL)
+		return;
+
+	if ((r->frag = dynstr_create()) == NULL) {
+		clientlog(client, LOG_ERR, "list_unauthorized: %s",
+		    strerror(errno));
+		removeclient(ctx, client);
+		return;
+	}
+	webclient_list_args(r, client->parser.path[1] == '?' ?
+	    &client->parser.path[2] : "");
+
+	webclient_chunked(r, "text/html;charset=us-ascii");
+	r->phase = LIST_HEAD;
+}
+
+/*
+ * Queues the head of a response whose body is rendered in chunks as the
+ * client takes them.
+ */
+static void
+webclient_chunked(struct response *r, const char *type)
+{
+	char datebuf[80];
+	struct tm *tm;
+	time_t t;
+
+	t = time(0);
+	tm = gmtime(&t);
+	strftime(datebuf, sizeof(datebuf), "%a, %d %b %Y %T %Z", tm);
+
+	dynstr_add(r->out,
+	    "HTTP/1.1 %d %s\r\n"
+	    "Server: webgw/1.0\r\n"
+	    "Date: %s\r\n"
+	    "Content-Type: %s\r\n"
+	    "Transfer-Encoding: chunked\r\n"
+	    "Connection: close\r\n\r\n",
+	    200, http_status(200), datebuf, type);
+}
+
+/*
+ * Folds the next few profiled stacks into ds. The phase only tells
+ * when the profile is done.
+ */
+static void
+webclient_profile_step(struct response *r, struct dynstr *ds)
+{
+	switch (prof_render_step(r->prof, ds)) {
+	case -1:
+		r->error = errno;
+		break;
+	case 0:
+		r->phase = LIST_DONE;
+		break;
+	}
+}
+
+static void
+webclient_list_args(struct response *r, const char *query)
+{
+	char *s;
+	size_t i;
+
+	r->only = -1;
+	if ((s = http_form_value(query, "state")) != NULL) {
+		for (i = 0; i < NSECTIONS; i++)
+			if (sections[i].key != NULL &&
+			    strcmp(s, sections[i].key) == 0)
+				r->only = sections[i].state;
+		mem_free(s);
+	}
+
+	r->per = ADMIN_PAGE_ROWS;
+	if ((s = http_form_value(query, "per")) != NULL) {
+		r->per = strtoul(s, NULL, 10);
+		if (r->per == 0 || r->per > ADMIN_MAX_ROWS)
+			r->per = ADMIN_PAGE_ROWS;
+		mem_free(s);
+	}
+
+	/*
+	 * Only a single section is paged.
+	 */
+	if (r->only != -1 && (s = http_form_value(query, "page")) != NULL) {
+		r->page = strtoul(s, NULL, 10);
+		if (r->page > SIZE_MAX / ADMIN_MAX_ROWS)
+			r->page = 0;
+		mem_free(s);
+	}
+
+	if ((s = http_form_value(query, "sort")) != NULL) {
+		r->sort = strcmp(s, "traffic") == 0;
+		mem_free(s);
+	}
+}
+
+/*
+ * Renders the next piece of the listing into ds. A host section or the
+ * rules form is rendered into r->frag, copied to ds as it grows, and
+ * cached whole once done.
+ */
+static void
+webclient_list_step(struct webgw *ctx, struct response *r,
+    struct dynstr *ds)
+{
+	const struct section *sec;
+	struct rules_stats rst;
 	struct host *host;
+	struct row row;
+	const char *s;
+	char *data;
+	size_t visited;
+
+	for (visited = 0; visited < ADMIN_LIST_STEP &&
+	    dynstr_len(ds) + dynstr_len(r->frag) - r->fragpos <
+	    ADMIN_LIST_CHUNK && r->phase != LIST_DONE && r->error == 0;
+	    visited++) {
+		sec = &sections[r->section];
+
+		switch (r->phase) {
+		case LIST_HEAD:
+			webclient_list_head(ctx, r, ds);
+			r->section = 0;
+			r->phase = LIST_SECTION;
+			break;
+		case LIST_SECTION:
+			if (r->section == NSECTIONS) {
+				r->phase = LIST_TAIL;
+				break;
+			}
+			if (r->only != -1 && sec->state != r->only) {
+				r->section++;
+				break;
+			}
+
+			r->gen = (sec->state == -1) ? rules_generation() :
+			    hostdb_generation(ctx->hostdb, sec->state);
+			if ((s = webclient_cache_get(ctx, r)) != NULL) {
+				dynstr_add(ds, "%s", s);
+				r->section++;
+				break;
+			}
+			dynstr_clear(r->frag);
+			r->fragpos = 0;
+
+			if (sec->state == -1) {
+				if ((data = rules_to_data()) == NULL) {
+					r->error = errno;
+					break;
+				}
+				rules_get_stats(&rst);
+				dynstr_add(r->frag,
+				    "    <h1>%s</h1>\n"
+				    "    <p>%zu rules; last reload %.1f ms, "
+				    "slowest %.1f ms, %lu reloads</p>\n"
+				    "    <form method=\"post\" "
+				    "action=\"/rules\">\n"
+				    "    <textarea name=\"rules\" rows=\"20\" "
+				    "cols=\"60\">\n"
+				    "%s"
+				    "</textarea><br>\n"
+				    "    <input type=\"submit\" "
+				    "value=\"Submit\"></form>\n",
+				    sec->title, rst.nrules, rst.last_reload_ms,
+				    rst.max_reload_ms, rst.reloads, data);
+				mem_free(data);
+				r->phase = LIST_SECTION_END;
+				break;
+			}
+
+			dynstr_add(r->frag,
+			    "    <h1>%s (%zu)</h1>\n"
+			    "    <ul>\n",
+			    sec->title, hostdb_count(ctx->hostdb, sec->state));
+			r->cursor = hostdb_cursor_open(ctx->hostdb, sec->state);
+			r->skip = r->page * r->per;
+			r->left = r->per;
+			if (r->sort) {
+				r->maxrows = r->skip + r->per;
+				if (r->maxrows > ADMIN_SORT_MAX)
+					r->maxrows = ADMIN_SORT_MAX;
+				r->nrows = 0;
+				if (r->maxrows > r->skip &&
+				    (r->rows = mem_reallocarray(MEM_ADMIN, NULL,
+				    r->maxrows, sizeof(struct row))) == NULL)
+					r->error = errno;
+				r->phase = LIST_SCAN;
+			} else
+				r->phase = LIST_SKIP;
+			break;
+		case LIST_SCAN:
+			if (r->rows != NULL && (host = hostdb_cursor_next(
+			    ctx->hostdb, r->cursor)) != NULL) {
+				webclient_top_add(r, host);
+				break;
+			}
+			if (r->rows != NULL)
+				qsort(r->rows, r->nrows, sizeof(struct row),
+				    webclient_row_cmp);
+			r->next = r->skip;
+			r->phase = LIST_ROWS;
+			break;
+		case LIST_SKIP:
+			if (r->skip == 0 ||
+			    hostdb_cursor_next(ctx->hostdb, r->cursor) == NULL)
+				r->phase = LIST_ROWS;
+			else
+				r->skip--;
+			break;
+		case LIST_ROWS:
+			if (r->left == 0) {
+				r->phase = LIST_SECTION_END;
+				break;
+			}
+			if (r->sort) {
+				if (r->next >= r->nrows) {
+					r->phase = LIST_SECTION_END;
+					break;
+				}
+				row = r->rows[r->next++];
+			} else {
+				if (r->skip > 0 || (host = hostdb_cursor_next(
+				    ctx->hostdb, r->cursor)) == NULL) {
+					r->phase = LIST_SECTION_END;
+					break;
+				}
+				webclient_row(&row, host);
+			}
+			webclient_list_row(r->frag, sec->state, &row);
+			r->left--;
+			break;
+		case LIST_SECTION_END:
+			if (sec->state != -1)
+				webclient_list_section_end(ctx, r, r->frag);
+			webclient_list_emit(r, ds);
+			webclient_cache_put(r);
+			r->section++;
+			r->phase = LIST_SECTION;
+			break;
+		case LIST_TAIL:
+			dynstr_add(ds,
+			    "    <p>Cached sections: %lu of %lu</p>\n"
+			    "  </body>\n"
+			    "</html>\n",
+			    ctx->admin_cache_hits,
+			    ctx->admin_cache_hits + ctx->admin_cache_misses);
+			r->phase = LIST_DONE;
+			break;
+		}
+	}
+
+	webclient_list_emit(r, ds);
+}
+
+/*
+ * Copies what has been rendered of the current section since the last
+ * call into ds.
+ */
+static void
+webclient_list_emit(struct response *r, struct dynstr *ds)
+{
+	const char *s;
+
+	if (dynstr_len(r->frag) == r->fragpos)
+		return;
+	if ((s = dynstr_get(r->frag)) == NULL) {
+		r->error = errno;
+		return;
+	}
+	dynstr_add(ds, "%s", s + r->fragpos);
+	r->fragpos = dynstr_len(r->frag);
+}
+
+/*
+ * Rendered sections are cached by what was asked for and the
+ * generation of what they show: the hostdb generation of the section's
+ * state, or the rules generation for the rules form. A generation that
+ * moved on while a section was being rendered makes the cached copy
+ * stale at once, which is what we want.
+ */
+static int
+webclient_cache_match(struct fragment *f, struct response *r)
+{
+	if (f->html == NULL || f->section != r->section)
+		return 0;
+	if (sections[r->section].state == -1)
+		return 1;
+	return f->only == r->only && f->page == r->page &&
+	    f->per == r->per && f->sort == r->sort;
+}
+
+static const char *
+webclient_cache_get(struct webgw *ctx, struct response *r)
+{
+	struct fragment *f;
+
+	for (f = cache; f < &cache[ADMIN_CACHE_SLOTS]; f++)
+		if (webclient_cache_match(f, r) && f->gen == r->gen) {
+			f->used = ++cache_clock;
+			ctx->admin_cache_hits++;
+			return f->html;
+		}
+
+	ctx->admin_cache_misses++;
+	return NULL;
+}
+
+/*
+ * Stores the section just rendered, replacing an older copy of it or
+ * the least recently used one.
+ */
+static void
+webclient_cache_put(struct response *r)
+{
+	struct fragment *f, *victim;
+	const char *s;
+	char *html;
+
+	if (r->error != 0 || (s = dynstr_get(r->frag)) == NULL ||
+	    (html = mem_strdup(MEM_ADMIN, s)) == NULL)
+		return;
+
+	victim = &cache[0];
+	for (f = cache; f < &cache[ADMIN_CACHE_SLOTS]; f++) {
+		if (webclient_cache_match(f, r)) {
+			victim = f;
+			break;
+		}
+		if (f->used < victim->used)
+			victim = f;
+	}
+
+	mem_free(victim->html);
+	victim->html = html;
+	victim->section = r->section;
+	victim->only = r->only;
+	victim->page = r->page;
+	victim->per = r->per;
+	victim->sort = r->sort;
+	victim->gen = r->gen;
+	victim->used = ++cache_clock;
+}
+
+static void
+webclient_list_head(struct webgw *ctx, struct response *r,
+    struct dynstr *ds)
+{
+	size_t i;
 
 	/*
 	 * TODO: replace these with a real template system, not hardcoded
 	 * strings...
 	 */
-
-	dynstr_add(&dn, 
+	dynstr_add(ds,
 	    "<html>\n"
 	    "  <head>\n"
 	    "    <title>Authorize targets</title>\n"
 	    "  </head>\n"
 	    "  <body>\n"
-	    "    <h1>Active</h1>\n"
-	    "    <ul>\n");
+	    "    <p>Show: <a href=\"/?sort=%s\">All</a>",
+	    r->sort ? "traffic" : "");
+	for (i = 0; i < NSECTIONS; i++)
+		if (sections[i].key != NULL) {
+			dynstr_add(ds, " | ");
+			webclient_list_link(ds, r, sections[i].key, 0, r->sort,
+			    sections[i].title);
+		}
+
+	dynstr_add(ds, "<br>\n    Sort: ");
+	webclient_list_link(ds, r, NULL, r->page, 0, "Newest first");
+	dynstr_add(ds, " | ");
+	webclient_list_link(ds, r, NULL, r->page, 1, "Most traffic");
+	dynstr_add(ds, "</p>\n");
+}
+
+/*
+ * Writes a link to the listing, keeping the current arguments but for
+ * the ones given. A NULL key keeps the current state.
+ */
+static void
+webclient_list_link(struct dynstr *ds, struct response *r, const char *key,
+    size_t page, int sort, const char *text)
+{
+	size_t i;
+
+	if (key == NULL)
+		for (key = "", i = 0; i < NSECTIONS; i++)
+			if (sections[i].key != NULL && r->only != -1 &&
+			    sections[i].state == r->only)
+				key = sections[i].key;
+
+	dynstr_add(ds, "<a href=\"/?state=%s&amp;page=%zu&amp;per=%zu"
+	    "&amp;sort=%s\">%s</a>", key, page, r->per,
+	    sort ? "traffic" : "", text);
+}
+
+static void
+webclient_list_section_end(struct webgw *ctx, struct response *r,
+    struct dynstr *ds)
+{
+	const struct section *sec;
+	size_t count, reach;
+
+	sec = &sections[r->section];
+	count = hostdb_count(ctx->hostdb, sec->state);
+	reach = r->sort && count > ADMIN_SORT_MAX ? ADMIN_SORT_MAX : count;
+
+	dynstr_add(ds, "    </ul>\n");
+	if (r->only == -1) {
+		if (count > r->per) {
+			dynstr_add(ds, "    <p>");
+			webclient_list_link(ds, r, sec->key, 1, r->sort,
+			    "More");
+			dynstr_add(ds, "</p>\n");
+		}
+	} else {
+		dynstr_add(ds, "    <p>Page %zu of %zu ", r->page + 1,
+		    reach > 0 ? (reach + r->per - 1) / r->per : 1);
+		if (r->page > 0)
+			webclient_list_link(ds, r, NULL, r->page - 1, r->sort,
+			    "Previous");
+		if ((r->page + 1) * r->per < reach) {
+			dynstr_add(ds, " ");
+			webclient_list_link(ds, r, NULL, r->page + 1, r->sort,
+			    "Next");
+		}
+		if (reach < count)
+			dynstr_add(ds, " (sorting stops at the top %d)",
+			    ADMIN_SORT_MAX);
+		dynstr_add(ds, "</p>\n");
+	}
+
+	hostdb_cursor_close(ctx->hostdb, r->cursor);
+	r->cursor = NULL;
+	webclient_top_free(r);
+}
+
+static void
+webclient_list_row(struct dynstr *ds, int state, struct row *row)
+{
+	dynstr_add(ds,
+	    "      <li>\n"
+	    "        %s:%d (", row->name, row->port);
+	if (state == HOSTDB_ACTIVE)
+		dynstr_add(ds, "refs=%d, ", row->refs);
+	dynstr_add(ds, "%llu requests, %.1f kB in, %.1f kB out",
+	    row->visits, row->rx / 1024.0, row->tx / 1024.0);
+	if (row->tcp.samples > 0) {
+		dynstr_add(ds, ", rtt %.1f ms (max %.1f), %llu retransmits",
+		    row->tcp.rtt_usec / 1e3, row->tcp.rtt_max_usec / 1e3,
+		    row->tcp.retransmits);
+		if (row->tcp.delivery_rate > 0)
+			dynstr_add(ds, ", %.1f kB/s delivered",
+			    row->tcp.delivery_rate / 1024.0);
+	}
+	dynstr_add(ds, ")\n");
 
-	n = NULL;
-	while ((host = hostdb_iterate(ctx->hostdb, &n)) != NULL) {
-		if (host_ref_count(host) <= 0)
-			continue;
+	if (!row->authorized)
+		dynstr_add(ds,
+		    "        <a href=\"/authorize/%s:%d\">Authorize</a>\n",
+		    row->name, row->port);
+	if (row->authorized || (state == HOSTDB_ACTIVE && row->held))
+		dynstr_add(ds,
+		    "        <a href=\"/unauthorize/%s:%d\">Unauthorize</a>\n",
+		    row->name, row->port);
 
-		dynstr_add(&dn,
-		    "      <li>\n"
-		    "        %s:%d (refs=%d)",
-		    host_name(host), host_port(host), host_ref_count(host));
+	dynstr_add(ds,
+	    "      </li>\n");
+}
 
-		if (!host_is_authorized(host))
-			dynstr_add(&dn,
-			    "        "
-			    "<a href=\"/authorize/%s:%d\">Authorize</a>\n",
-			    host_name(host), host_port(host));
+/*
+ * Fills row from host. The name points into the host and is valid as
+ * long as the host is; rows kept in the heap own a copy of it.
+ */
+static void
+webclient_row(struct row *row, struct host *host)
+{
+	row->name = (char *) host_name(host);
+	row->port = host_port(host);
+	row->refs = host_ref_count(host);
+	row->authorized = host_is_authorized(host);
+	row->held = host_is_held(host);
+	row->visits = host_visits(host);
+	row->rx = host_rx_bytes(host);
+	row->tx = host_tx_bytes(host);
+	host_get_tcp_stats(host, &row->tcp);
+}
 
-		if (host_is_held(host))
-			dynstr_add(&dn,
-			    "        <a href=\"/unauthorize/%s:%d\">"
-			    "Unauthorize</a>\n", host_name(host),
-			    host_port(host));
+/*
+ * Offers host to the heap of the top maxrows hosts by traffic. The
+ * least busy of them is at the root.
+ */
+static void
+webclient_top_add(struct response *r, struct host *host)
+{
+	struct row row, tmp;
+	size_t i, child;
 
-		dynstr_add(&dn,
-		    "      </li>");
+	webclient_row(&row, host);
+	if (r->nrows == r->maxrows) {
+		if (row.rx + row.tx <= r->rows[0].rx + r->rows[0].tx)
+			return;
+		mem_free(r->rows[0].name);
+		r->rows[0] = r->rows[--r->nrows];
+		for (i = 0; (child = 2 * i + 1) < r->nrows; i = child) {
+			if (child + 1 < r->nrows &&
+			    r->rows[child + 1].rx + r->rows[child + 1].tx <
+			    r->rows[child].rx + r->rows[child].tx)
+				child++;
+			if (r->rows[i].rx + r->rows[i].tx <=
+			    r->rows[child].rx + r->rows[child].tx)
+				break;
+			tmp = r->rows[i];
+			r->rows[i] = r->rows[child];
+			r->rows[child] = tmp;
+		}
 	}
 
-	dynstr_add(&dn,
-	    "    </ul><h1>Wildcard Rules</h1>\n"
-	    "    <form method=\"post\" action=\"/rules\" method=\"post\">\n"
-	    "    <textarea>\n");
+	if ((row.name = mem_strdup(MEM_ADMIN, row.name)) == NULL) {
+		r->error = errno;
+		return;
+	}
+	for (i = r->nrows++; i > 0 && r->rows[(i - 1) / 2].rx +
+	    r->rows[(i - 1) / 2].tx > row.rx + row.tx; i = (i - 1) / 2)
+		r->rows[i] = r->rows[(i - 1) / 2];
+	r->rows[i] = row;
+}
 
-	dynstr_add(&dn, rules_to_data());
+static void
+webclient_top_free(struct response *r)
+{
+	size_t i;
 
-	dynstr_add(&dn,
-	    "</textarea><br>\n"
-	    "    <input type=\"submit\" value=\"Submit\"></form>\n");
+	if (r->rows == NULL)
+		return;
+	for (i = 0; i < r->nrows; i++)
+		mem_free(r->rows[i].name);
+	mem_free(r->rows);
+	r->rows = NULL;
+	r->nrows = 0;
+}
 
-	dynstr_add(&dn,
-	    "    </ul><h1>Authorized</h1><ul>\n");
+/*
+ * Most traffic first.
+ */
+static int
+webclient_row_cmp(const void *a, const void *b)
+{
+	const struct row *ra = a, *rb = b;
+	unsigned long long ta, tb;
 
-	n = NULL;
-	while ((host = hostdb_iterate(ctx->hostdb, &n)) != NULL) {
-		if (!host_is_authorized(host) || host_ref_count(host) > 0)
-			continue;
+	ta = ra->rx + ra->tx;
+	tb = rb->rx + rb->tx;
+	if (ta != tb)
+		return ta < tb ? 1 : -1;
+	return 0;
+}
 
-		dynstr_add(&dn, "<li>%s:%d", host_name(host), host_port(host));
+/*
+ * Sets the client up for writing a response: requests are no longer
+ * read, and the response is written as the socket has room for it.
+ */
+static struct response *
+webclient_respond(struct webgw *ctx, struct client *client)
+{
+	struct kevent changelist[2];
+	struct response *r;
 
-		dynstr_add(&dn,
-		    "<a href=\"/unauthorize/%s:%d\">"
-		    "Unauthorize</a>\n", host_name(host), host_port(host));
+	if ((r = mem_calloc(MEM_ADMIN, 1, sizeof(*r))) == NULL ||
+	    (r->out = dynstr_create()) == NULL) {
+		mem_free(r);
+		clientlog(client, LOG_ERR, "respond: %s", strerror(errno));
+		write_error(client->fd, HTTP_STATUS_INTERNAL_ERROR,
+		    "Out of memory.\r\n");
+		removeclient(ctx, client);
+		return NULL;
+	}
+	r->phase = LIST_DONE;
+	client->response = r;
 
-		dynstr_add(&dn,
-		    "      </li>");
+	client->clientcallback.writefunc = webclient_write;
+	client->clientcallback.writekind = CB_ADMIN_WRITE;
+	EV_SET(&changelist[0], client->fd, EVFILT_READ, EV_DELETE, 0, 0,
+	    NULL);
+	EV_SET(&changelist[1], client->fd, EVFILT_WRITE, EV_ADD | EV_ENABLE,
+	    0, 0, &client->clientcallback);
+	if (kevent(ctx->kq, changelist, 2, NULL, 0, NULL) == -1) {
+		clientlog(client, LOG_ERR, "respond: kevent: %s",
+		    strerror(errno));
+		removeclient(ctx, client);
+		return NULL;
 	}
 
-	dynstr_add(&dn,
-	    "    </ul><h1>Unauthorized</h1><ul>\n");
+	return r;
+}
 
-	n = NULL;
-	while ((host = hostdb_iterate(ctx->hostdb, &n)) != NULL) {
-		if (host_is_authorized(host) || host_ref_count(host) > 0)
-			continue;
+/*
+ * Called when the socket is writable: writes out what is queued and,
+ * once all of it is gone, renders the next piece as one chunk.
+ */
+static void
+webclient_write(struct webgw *ctx, struct client *client)
+{
+	static struct dynstr chunk;
+	struct response *r;
+	const char *s;
 
-		dynstr_add(&dn,
-		    "      <li>\n"
-		    "        %s:%d",
-		    host_name(host), host_port(host));
+	r = client->response;
+	if (webclient_flush(client, r) == -1) {
+		removeclient(ctx, client);
+		return;
+	}
+	if (dynstr_len(r->out) > 0 ||
+	    (r->body != NULL && r->bodysent < dynstr_len(r->body)))
+		return;
+	if (r->phase == LIST_DONE) {
+		removeclient(ctx, client);
+		return;
+	}
 
-		dynstr_add(&dn,
-		    "        <a href=\"/authorize/%s:%d\">Authorize</a>\n",
-		    host_name(host), host_port(host));
+	dynstr_clear(&chunk);
+	if (r->prof != NULL)
+		webclient_profile_step(r, &chunk);
+	else
+		webclient_list_step(ctx, r, &chunk);
+	if ((s = dynstr_get(&chunk)) == NULL || r->error != 0) {
+		clientlog(client, LOG_ERR, "%s: %s",
+		    r->prof != NULL ? "profile" : "list_unauthorized",
+		    strerror(s == NULL ? errno : r->error));
+		removeclient(ctx, client);
+		return;
+	}
+	if (dynstr_len(&chunk) > 0)
+		dynstr_add(r->out, "%zx\r\n%s\r\n", dynstr_len(&chunk), s);
+	if (r->phase == LIST_DONE)
+		dynstr_add(r->out, "0\r\n\r\n");
+
+	if (webclient_flush(client, r) == -1)
+		removeclient(ctx, client);
+}
 
-		dynstr_add(&dn,
-		    "      </li>");
+/*
+ * Writes as much of the queued output, and then of the body, as the
+ * socket takes. Returns -1 on error.
+ */
+static int
+webclient_flush(struct client *client, struct response *r)
+{
+	const char *s;
+	int done;
+
+	if ((s = dynstr_get(r->out)) == NULL) {
+		clientlog(client, LOG_ERR, "flush: %s", strerror(errno));
+		return -1;
 	}
 
-	dynstr_add(&dn,
-	    "  </body>\n"
-	    "</html>\n");
+	if ((done = webclient_send(client, s, dynstr_len(r->out),
+	    &r->sent)) != 1)
+		return done;
+	dynstr_clear(r->out);
+	r->sent = 0;
 
-	if ((s = dynstr_get(&dn)) != NULL)
-		webclient_write_response(ctx, client, 200, s);
-	else {
-		clientlog(client, LOG_ERR, "list_unauthorized: %s",
-		    strerror(errno));
-		write_error(client->fd, HTTP_STATUS_INTERNAL_ERROR,
-		    "Server had trouble constructing content for \n"
-		    "listing unauthorized clients.\n");
+	if (r->body == NULL)
+		return 0;
+	return webclient_send(client, dynstr_get(r->body),
+	    dynstr_len(r->body), &r->bodysent) == -1 ? -1 : 0;
+}
+
+/*
+ * Writes what is left of len bytes at s, of which sent are already
+ * written. Returns 1 once all are, 0 if the socket is full, and -1 on
+ * error.
+ */
+static int
+webclient_send(struct client *client, const char *s, size_t len,
+    size_t *sent)
+{
+	ssize_t n;
+
+	while (*sent < len) {
+		n = write(client->fd, s + *sent, len - *sent);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 0;
+			clientlog(client, LOG_WARNING, "write client: %s",
+			    strerror(errno));
+			return -1;
+		}
+		*sent += n;
+		client->bytes_out += n;
 	}
+	return 1;
+}
+
+/*
+ * Frees what is left of a response; called by removeclient().
+ */
+void
+webclient_free_response(struct webgw *ctx, struct client *client)
+{
+	struct response *r;
 
-	dynstr_clear(&dn);
+	if ((r = client->response) == NULL)
+		return;
+
+	if (r->cursor != NULL)
+		hostdb_cursor_close(ctx->hostdb, r->cursor);
+	webclient_top_free(r);
+	prof_render_free(r->prof);
+	if (r->release != NULL)
+		r->release(r->body);
+	dynstr_free(r->frag);
+	dynstr_free(r->out);
+	mem_free(r);
+	client->response = NULL;
 }
 
 static void
 webclient_write_response(struct webgw *ctx, struct client *client,
-    int code, const char *text)
+    int code, const char *type, const char *text)
+{
+	struct response *r;
+
+	if ((r = webclient_respond(ctx, client)) == NULL)
+		return;
+
+	webclient_head(r, code, type, strlen(text));
+	dynstr_add(r->out, "%s", text);
+}
+
+/*
+ * Answers with the text in body, which is written from there rather
+ * than copied. The response takes body over and hands it to release
+ * once the client is done with it, or right away if it cannot be set
+ * up.
+ */
+static void
+webclient_write_body(struct webgw *ctx, struct client *client,
+    const char *type, struct dynstr *body, void (*release)(struct dynstr *))
+{
+	struct response *r;
+
+	if ((r = webclient_respond(ctx, client)) == NULL) {
+		release(body);
+		return;
+	}
+
+	webclient_head(r, 200, type, dynstr_len(body));
+	r->body = body;
+	r->release = release;
+}
+
+static void
+webclient_head(struct response *r, int code, const char *type, size_t len)
 {
-	static char buf[8192];
-	int n;
 	char datebuf[80];
 	struct tm *tm;
 	time_t t;
-	unsigned long len;
 
 	t = time(0);
 	tm = gmtime(&t);
 	strftime(datebuf, sizeof(datebuf), "%a, %d %b %Y %T %Z", tm);
 
-	len = strlen(text);
-	n = snprintf(buf, sizeof(buf),
+	dynstr_add(r->out,
 	    "HTTP/1.1 %d %s\r\n"
 	    "Server: webgw/1.0\r\n"
 	    "Date: %s\r\n"
-	    "Content-Type: text/html;charset=us-ascii\r\n"
-	    "Content-Length: %lu\r\n"
+	    "Content-Type: %s\r\n"
+	    "Content-Length: %zu\r\n"
 	    "Connection: close\r\n\r\n",
-	    code, http_status(code), datebuf, len);
-	if (write_fd(client->fd, buf, n) == -1)
-		syslog(LOG_ERR, "write_error: %m");
-	if (write_fd(client->fd, text, len) == -1)
-		syslog(LOG_ERR, "write_error in body: %m");
-	removeclient(ctx, client);
+	    code, http_status(code), datebuf, type, len);
 }
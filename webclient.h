@@ -5,5 +5,6 @@ struct webgw;
 struct client;
 
 void webclient_init(struct webgw *, struct client *, int);
+void webclient_free_response(struct webgw *, struct client *);
 
 #endif
@@ -0,0 +1,193 @@
+/*
+ * Shows what a running webgw is doing, from the stats segment it
+ * publishes: rates, connection states, latencies and the busiest hosts.
+ *
+ * Usage: webgw-top [-d secs] [-n count] [-f file]
+ */
+
+#include "extern.h"
+#include "shmstats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <err.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_TRIES	1000
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: webgw-top [-d secs] [-n count] [-f file]\n");
+	exit(1);
+}
+
+static const struct shmstats *
+map_stats(const char *file)
+{
+	const struct shmstats *s;
+	struct stat sb;
+	int fd;
+
+	if ((fd = open(file, O_RDONLY)) == -1)
+		err(1, "%s", file);
+	if (fstat(fd, &sb) == -1)
+		err(1, "%s", file);
+	if ((size_t) sb.st_size < sizeof(*s))
+		errx(1, "%s: short file", file);
+	s = mmap(NULL, sizeof(*s), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s == MAP_FAILED)
+		err(1, "mmap %s", file);
+
+	if (memcmp(s->magic, SHMSTATS_MAGIC, sizeof(s->magic)) != 0 ||
+	    s->version != SHMSTATS_VERSION || s->size != sizeof(*s))
+		errx(1, "%s: unknown format", file);
+	return s;
+}
+
+/*
+ * Copies a consistent snapshot: one taken while seq was even and did
+ * not move. Returns 0 if the writer kept getting in the way.
+ */
+static int
+snapshot(const struct shmstats *s, struct shmstats *copy)
+{
+	uint64_t seq;
+	int i;
+
+	for (i = 0; i < SNAPSHOT_TRIES; i++) {
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(copy, s, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq)
+			return 1;
+	}
+	return 0;
+}
+
+static double
+rate(uint64_t now, uint64_t then, double secs)
+{
+	if (secs <= 0 || now < then)
+		return 0;
+	return (now - then) / secs;
+}
+
+static void
+show(const struct shmstats *cur, const struct shmstats *prev)
+{
+	struct timespec ts;
+	double secs, age;
+	uint64_t now;
+	uint32_t i;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	now = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	age = now > cur->time_usec ? (now - cur->time_usec) / 1e6 : 0;
+	secs = prev == NULL ? 0 :
+	    (cur->time_usec - prev->time_usec) / 1e6;
+	if (prev == NULL)
+		prev = cur;
+
+	printf("\033[H\033[J");
+	printf("webgw pid %lld, snapshot %.1fs old\n\n",
+	    (long long) cur->pid, age);
+
+	printf("%-12s %10.1f/s %12llu total\n", "conns",
+	    rate(cur->accepted, prev->accepted, secs),
+	    (unsigned long long) cur->accepted);
+	printf("%-12s %10.1f kB/s %10.1f MB total\n", "upstream",
+	    rate(cur->bytes_upstream, prev->bytes_upstream, secs) / 1024,
+	    cur->bytes_upstream / 1048576.0);
+	printf("%-12s %10.1f kB/s %10.1f MB total\n", "downstream",
+	    rate(cur->bytes_downstream, prev->bytes_downstream, secs) / 1024,
+	    cur->bytes_downstream / 1048576.0);
+	printf("%-12s %10.1f/s  fast %.1f policy %.1f port %.1f\n", "denied",
+	    rate(cur->denied_fast + cur->denied_policy + cur->denied_port,
+	    prev->denied_fast + prev->denied_policy + prev->denied_port,
+	    secs),
+	    rate(cur->denied_fast, prev->denied_fast, secs),
+	    rate(cur->denied_policy, prev->denied_policy, secs),
+	    rate(cur->denied_port, prev->denied_port, secs));
+	printf("%-12s %10.1f/s\n", "dns failed",
+	    rate(cur->dns_failures, prev->dns_failures, secs));
+
+	printf("\n%-12s %10u  reading %u held %u resolving %u "
+	    "connecting %u tunnelling %u\n", "clients", cur->nclient,
+	    cur->nconn[CONN_READING], cur->nconn[CONN_PARKED],
+	    cur->nconn[CONN_RESOLVING], cur->nconn[CONN_CONNECTING],
+	    cur->nconn[CONN_TUNNELLING]);
+	printf("%-12s %10llu  %.1f MB, %llu evicted\n", "hosts",
+	    (unsigned long long) cur->hostdb_hosts,
+	    cur->hostdb_bytes / 1048576.0,
+	    (unsigned long long) cur->hostdb_evictions);
+
+	printf("\n%-12s p99 %.1f ms, %llu stalls\n", "loop lag",
+	    cur->loop_lag_p99_usec / 1000.0,
+	    (unsigned long long) cur->loop_stalls);
+	printf("%-12s p50 %.1f ms, p99 %.1f ms\n", "first byte",
+	    cur->firstbyte_p50_usec / 1000.0,
+	    cur->firstbyte_p99_usec / 1000.0);
+	if (cur->log_dropped > 0)
+		printf("%-12s %llu lines dropped\n", "log",
+		    (unsigned long long) cur->log_dropped);
+
+	printf("\n  %6s %12s %12s  %s\n", "conns", "rx kB", "tx kB", "host");
+	for (i = 0; i < cur->ntop && i < SHMSTATS_TOP; i++)
+		printf("  %6u %12.1f %12.1f  %.*s:%u\n", cur->top[i].conns,
+		    cur->top[i].rx / 1024.0, cur->top[i].tx / 1024.0,
+		    (int) sizeof(cur->top[i].name), cur->top[i].name,
+		    cur->top[i].port);
+	fflush(stdout);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const struct shmstats *s;
+	struct shmstats snap[2];
+	const char *file;
+	int delay, count, ch, n;
+
+	file = STATS_FILE;
+	delay = 1;
+	count = 0;
+	while ((ch = getopt(argc, argv, "d:f:n:")) != -1) {
+		switch (ch) {
+		case 'd':
+			if ((delay = atoi(optarg)) <= 0)
+				usage();
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'n':
+			if ((count = atoi(optarg)) <= 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc != optind)
+		usage();
+
+	s = map_stats(file);
+	for (n = 0; count == 0 || n < count; n++) {
+		if (n > 0)
+			sleep(delay);
+		if (!snapshot(s, &snap[n % 2]))
+			errx(1, "%s: no consistent snapshot", file);
+		show(&snap[n % 2], n > 0 ? &snap[(n + 1) % 2] : NULL);
+	}
+	return 0;
+}
@@ -6,25 +6,94 @@
 #include <errno.h>
 #include <unistd.h>
 #include <signal.h>
+#include <stdio.h>
 
 #include <sys/select.h>
 
 #include "extern.h"
 #include "config.h"
+#include "hostdb.h"
+#include "log.h"
+#include "resolvmap.h"
+#include "server.h"
 
 void sigpipe()
 {
 	syslog(LOG_ERR, "sigpipe");
 }
 
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: webgw [-a listen_addr] [-i import_file] "
+	    "[-l log_file] [-m max_hostdb_mb]\n"
+	    "             [-r resolve_file] [-x export_file]\n");
+	exit(1);
+}
+
+/*
+ * Writes the host database in the text format and exits, without
+ * starting the proxy.
+ */
+static int
+export_hostdb(const char *file)
+{
+	struct hostdb *hostdb;
+
+	hostdb = hostdb_create();
+	hostdb_load(hostdb);
+	if (hostdb_export(hostdb, file) == -1)
+		err(1, "%s", file);
+	hostdb_free(hostdb);
+
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	static struct webgw ctx;
+	const char *listen_addr = LISTEN_ADDR;
+	const char *import_file = NULL;
+	const char *resolve_file = NULL;
+	const char *log_file = NULL;
+	long mb;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "a:i:l:m:r:x:")) != -1) {
+		switch (ch) {
+		case 'a':
+			listen_addr = optarg;
+			break;
+		case 'i':
+			import_file = optarg;
+			break;
+		case 'l':
+			log_file = optarg;
+			break;
+		case 'm':
+			if ((mb = strtol(optarg, NULL, 10)) <= 0)
+				usage();
+			ctx.hostdb_max_bytes = (size_t) mb * 1024 * 1024;
+			break;
+		case 'r':
+			resolve_file = optarg;
+			break;
+		case 'x':
+			return export_hostdb(optarg);
+		default:
+			usage();
+		}
+	}
 
 	openlog(argv[0], LOG_NDELAY | LOG_CONS | LOG_PID, LOG_DAEMON);
+	log_init(log_file);
 
 	signal(SIGPIPE, sigpipe);
 
+	if (resolve_file != NULL &&
+	    (ctx.resolvmap = resolvmap_load(resolve_file)) == NULL)
+		err(1, "%s", resolve_file);
+
 #if 0
 	if (daemon(0, 0) < 0) {
 		syslog(LOG_ERR, "failed to daemonize: %m");
@@ -32,7 +101,12 @@ int main(int argc, char *argv[])
 	}
 #endif
 
-	init(&ctx, LISTEN_ADDR, LISTEN_PORT);
+	init(&ctx, listen_addr, LISTEN_PORT);
+
+	if (import_file != NULL) {
+		hostdb_import(ctx.hostdb, import_file);
+		server_denyset_rebuild(&ctx);
+	}
 
 /*
 	Practically no need for chroot because we already set pledge list